@@ -1,5 +1,6 @@
 QT       += core
 QT       += sql
+QT       += network
 QT       -= gui
 
 TARGET = 2safe-daemon
@@ -15,7 +16,26 @@ SOURCES += main.cpp \
     fswatcher.cpp \
     saferpcqueue.cpp \
     safestatedb.cpp \
-    safewatcher.cpp
+    safewatcher.cpp \
+    safefingerprint.cpp \
+    safedirwalker.cpp \
+    safeuploadsource.cpp \
+    safedownloadsink.cpp \
+    safehashcache.cpp \
+    safefasthash.cpp \
+    safechunker.cpp \
+    safedeltatarget.cpp \
+    saferesumabletarget.cpp \
+    safechunkedtransfer.cpp \
+    safescrubber.cpp \
+    safetransferscheduler.cpp \
+    saferatelimiter.cpp \
+    saferetryqueue.cpp \
+    safetimerwheel.cpp \
+    safedirplanner.cpp \
+    safeoplog.cpp \
+    safecontentcache.cpp \
+    safepeerservice.cpp
 
 include(lib2safe/safe.pri)
 
@@ -26,6 +46,26 @@ HEADERS += \
     fswatcher.h \
     saferpcqueue.h \
     safestatedb.h \
-    safewatcher.h
+    safewatcher.h \
+    safefingerprint.h \
+    safedirwalker.h \
+    safeuploadsource.h \
+    safedownloadsink.h \
+    safehashcache.h \
+    safefasthash.h \
+    safechunker.h \
+    safedeltatarget.h \
+    saferesumabletarget.h \
+    safechunkedtransfer.h \
+    safescrubber.h \
+    safetransferscheduler.h \
+    saferatelimiter.h \
+    saferetryqueue.h \
+    safetimerwheel.h \
+    safedirplanner.h \
+    safeoplog.h \
+    safecontentcache.h \
+    safepeerservice.h
 
 LIBS = -linotifytools
+LIBS += -lxxhash
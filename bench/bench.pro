@@ -0,0 +1,6 @@
+# Standalone benchmarks of the parts of the daemon that don't need lib2safe:
+#   qmake bench.pro && make && ./hashmodes/bench-hashmodes
+TEMPLATE = subdirs
+
+SUBDIRS += hashmodes \
+    walker
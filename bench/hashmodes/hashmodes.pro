@@ -0,0 +1,19 @@
+QT       += core
+QT       -= gui
+
+TARGET = bench-hashmodes
+CONFIG   += console
+CONFIG   += c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp \
+    ../../safefasthash.cpp
+
+HEADERS += \
+    ../../safefasthash.h
+
+LIBS += -lxxhash
@@ -0,0 +1,122 @@
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QStringList>
+#include <QFile>
+#include <QDir>
+#include "safefasthash.h"
+
+// Indexing throughput per "hash_mode" on a generated tree. "fast" is what
+// indexFile() does by default, XXH3 only; "md5" also computes the server's
+// MD5 in a pass of its own, as makeFastHash() and makeHash() do.
+//
+//   bench-hashmodes [files] [KB per file] [dir]
+//
+// Every file is read once before timing, so the numbers are for a warm
+// page cache and compare the hashes rather than the disk.
+
+namespace {
+
+const int BUFFER = 4 * 1024 * 1024;
+const int FILES_PER_DIR = 100;
+
+void generate(const QString &root, int files, int kb)
+{
+    QByteArray block(kb * 1024, Qt::Uninitialized);
+    qsrand(2);
+    for(int i = 0; i < block.size(); ++i) {
+        block[i] = char(qrand());
+    }
+    for(int i = 0; i < files; ++i) {
+        QString dir(root + QString("/d%1").arg(i / FILES_PER_DIR));
+        QDir().mkpath(dir);
+        QFile file(dir + QString("/f%1").arg(i));
+        file.open(QIODevice::WriteOnly);
+        // no two files alike
+        QByteArray head(QByteArray::number(i).leftJustified(16, ' '));
+        file.write(head);
+        file.write(block.constData() + head.size(), block.size() - head.size());
+    }
+}
+
+QStringList listFiles(const QString &root)
+{
+    QStringList paths;
+    QDirIterator it(root, QDir::Files, QDirIterator::Subdirectories);
+    while(it.hasNext()) {
+        paths.append(it.next());
+    }
+    return paths;
+}
+
+// one read of every file, fed to whatever hashes the mode needs
+qint64 pass(const QStringList &paths, bool fast, bool md5)
+{
+    QByteArray buffer(BUFFER, Qt::Uninitialized);
+    qint64 bytes = 0;
+    foreach(QString path, paths) {
+        QFile file(path);
+        if(!file.open(QIODevice::ReadOnly)) {
+            continue;
+        }
+        SafeFastHash xxh;
+        QCryptographicHash md(QCryptographicHash::Md5);
+        qint64 n;
+        while((n = file.read(buffer.data(), buffer.size())) > 0) {
+            if(fast) {
+                xxh.addData(buffer.constData(), int(n));
+            }
+            if(md5) {
+                md.addData(buffer.constData(), int(n));
+            }
+            bytes += n;
+        }
+        if(fast) {
+            xxh.result();
+        }
+        if(md5) {
+            md.result();
+        }
+    }
+    return bytes;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args(app.arguments());
+    int files = args.size() > 1 ? args.at(1).toInt() : 2000;
+    int kb = args.size() > 2 ? args.at(2).toInt() : 512;
+    QTemporaryDir tmp;
+    QString root(args.size() > 3 ? args.at(3) : tmp.path());
+
+    QTextStream out(stdout);
+    out << "Generating " << files << " files of " << kb << " KB in " << root << endl;
+    generate(root, files, kb);
+    QStringList paths(listFiles(root));
+    pass(paths, false, false);
+
+    struct Mode { const char *name; int passes; bool md5; } modes[] = {
+        { "fast", 1, false },
+        { "md5", 2, true },
+    };
+    for(const Mode &mode : modes) {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 bytes = pass(paths, true, false);
+        if(mode.md5) {
+            pass(paths, false, true);
+        }
+        double seconds = qMax<qint64>(timer.elapsed(), 1) / 1000.0;
+        out << "Hash mode: " << mode.name
+            << "\n  Reads per file: " << mode.passes
+            << "\n  Seconds: " << seconds
+            << "\n  MB/s: " << bytes / (1024.0 * 1024.0) / seconds << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include "safedirwalker.h"
+
+// SafeDirWalker against the QDirIterator walk fullIndex() used to do, on
+// a synthetic tree of empty files.
+//
+//   bench-walker [entries] [dir] [threads]
+//
+// An existing non-empty dir is walked as it is, so a large tree has to be
+// generated only once. Both walks run on a warm dentry cache.
+
+namespace {
+
+const int FANOUT = 100;
+
+// FANOUT files per directory, FANOUT directories per level
+void generate(const QString &root, int entries)
+{
+    int made = 0;
+    for(int top = 0; made < entries; ++top) {
+        for(int mid = 0; mid < FANOUT && made < entries; ++mid) {
+            QString dir(root + QString("/t%1/m%2").arg(top).arg(mid));
+            QDir().mkpath(dir);
+            made += mid == 0 ? 2 : 1;
+            for(int f = 0; f < FANOUT && made < entries; ++f, ++made) {
+                QFile(dir + QString("/f%1").arg(f)).open(QIODevice::WriteOnly);
+            }
+        }
+    }
+}
+
+struct Result {
+    qint64 entries = 0;
+    qint64 bytes = 0;
+    qint64 ms = 0;
+};
+
+// the walk before SafeDirWalker: an iterator, a QFileInfo per entry and a
+// count of every directory
+Result iterate(const QString &root)
+{
+    Result r;
+    QElapsedTimer timer;
+    timer.start();
+    QDirIterator it(root, QDir::AllEntries | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    while(it.hasNext()) {
+        QFileInfo info(it.next());
+        if(info.isDir()) {
+            QDir(info.filePath()).count();
+        } else {
+            r.bytes += info.size();
+        }
+        ++r.entries;
+    }
+    r.ms = timer.elapsed();
+    return r;
+}
+
+Result walk(const QString &root, int threads)
+{
+    Result r;
+    QElapsedTimer timer;
+    timer.start();
+    SafeDirWalker walker(root, threads);
+    SafeDirEntry entry;
+    while(walker.next(entry)) {
+        if(!entry.isDir) {
+            r.bytes += entry.fingerprint.size;
+        }
+        ++r.entries;
+    }
+    r.ms = timer.elapsed();
+    return r;
+}
+
+void report(QTextStream &out, const char *name, const Result &r)
+{
+    double seconds = qMax<qint64>(r.ms, 1) / 1000.0;
+    out << name
+        << "\n  Entries: " << r.entries
+        << "\n  Seconds: " << seconds
+        << "\n  Entries/s: " << qint64(r.entries / seconds) << endl;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QStringList args(app.arguments());
+    int entries = args.size() > 1 ? args.at(1).toInt() : 1000000;
+    QTemporaryDir tmp;
+    QString root(args.size() > 2 ? args.at(2) : tmp.path());
+    int threads = args.size() > 3 ? args.at(3).toInt() : QThread::idealThreadCount();
+
+    QTextStream out(stdout);
+    QDir dir(root);
+    if(!dir.exists() || dir.entryList(QDir::AllEntries | QDir::NoDotAndDotDot).isEmpty()) {
+        out << "Generating " << entries << " entries in " << root << endl;
+        generate(root, entries);
+    }
+
+    // fills the dentry and inode caches for both
+    iterate(root);
+    report(out, "QDirIterator", iterate(root));
+    report(out, "SafeDirWalker", walk(root, threads));
+    return 0;
+}
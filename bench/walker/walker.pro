@@ -0,0 +1,19 @@
+QT       += core
+QT       -= gui
+
+TARGET = bench-walker
+CONFIG   += console
+CONFIG   += c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+SOURCES += main.cpp \
+    ../../safedirwalker.cpp \
+    ../../safefingerprint.cpp
+
+HEADERS += \
+    ../../safedirwalker.h \
+    ../../safefingerprint.h
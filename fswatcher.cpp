@@ -2,6 +2,8 @@
 
 FSWatcher::FSWatcher(QString path, QObject *parent) :
     QObject(parent),
+    looper(0),
+    cookie(0),
     m_path(path),
     events(IN_CREATE|IN_DELETE|IN_MOVE|IN_CLOSE_WRITE)
 {
@@ -29,104 +31,103 @@ void FSWatcher::watch()
 {
     qDebug() << "Started local watcher";
 
-    struct inotify_event * event;
-    QString moved_from;
-    uint32_t cookie;
-
+    // polled from the event loop of the caller, which goes on meanwhile
     this->looper = new QTimer(this);
     this->looper->setInterval(1000);
     this->looper->setTimerType(Qt::VeryCoarseTimer);
-    connect(looper, &QTimer::timeout, [&](){
-        event = inotifytools_next_event( 0 );
-        if ( !event ) {
-            if ( !inotifytools_error() ) {
-                this->looper->setTimerType(Qt::VeryCoarseTimer);
-                this->looper->setInterval(1000);
-                //qDebug() << "Cycle elapsed";
-                if(!moved_from.isEmpty()) {
-                    handleMovedAwayFile(moved_from);
-                    moved_from.clear();
-                    cookie = 0;
-                }
-                return;
-            }
-            else {
-                qWarning() << "Watching stopped by error:" <<  strerror( inotifytools_error() );
-                stop();
-                return;
+    connect(this->looper, &QTimer::timeout, this, &FSWatcher::poll);
+    this->looper->start();
+}
+
+void FSWatcher::poll()
+{
+    struct inotify_event * event = inotifytools_next_event( 0 );
+    if ( !event ) {
+        if ( !inotifytools_error() ) {
+            this->looper->setTimerType(Qt::VeryCoarseTimer);
+            this->looper->setInterval(1000);
+            //qDebug() << "Cycle elapsed";
+            if(!moved_from.isEmpty()) {
+                handleMovedAwayFile(moved_from);
+                moved_from.clear();
+                cookie = 0;
             }
+            return;
         }
-
-        u_int32_t event_cookie = event->cookie;
-        u_int32_t event_mask = event->mask;
-        char *event_name = event->name;
-        int event_wd = event->wd;
-
-        this->looper->setTimerType(Qt::PreciseTimer);
-        this->looper->setInterval(100);
-        //qDebug() << "Fast cycle elapsed";
-        QString path;
-        path.append(inotifytools_filename_from_wd( event_wd )).append( event_name );
-        if( (event_mask & IN_ISDIR) ) {
-            path.append(QDir::separator());
+        else {
+            qWarning() << "Watching stopped by error:" <<  strerror( inotifytools_error() );
+            stop();
+            return;
         }
+    }
 
-        // Event debug
-        // qDebug() << event_cookie << inotifytools_event_to_str(event_mask) << path;
+    u_int32_t event_cookie = event->cookie;
+    u_int32_t event_mask = event->mask;
+    char *event_name = event->name;
+    int event_wd = event->wd;
+
+    this->looper->setTimerType(Qt::PreciseTimer);
+    this->looper->setInterval(100);
+    //qDebug() << "Fast cycle elapsed";
+    QString path;
+    path.append(inotifytools_filename_from_wd( event_wd )).append( event_name );
+    if( (event_mask & IN_ISDIR) ) {
+        path.append(QDir::separator());
+    }
 
+    // Event debug
+    // qDebug() << event_cookie << inotifytools_event_to_str(event_mask) << path;
 
-        // Moved away
-        if ( !moved_from.isEmpty() && !(event_mask & IN_MOVED_TO) ) {
-            handleMovedAwayFile(moved_from);
-            moved_from.clear();
-            cookie = 0;
-        }
 
-        // Obvious delete
-        if ( (event_mask & IN_DELETE) ) {
-            emit deleted(path, (event_mask & IN_ISDIR));
-            return;
-        }
+    // Moved away
+    if ( !moved_from.isEmpty() && !(event_mask & IN_MOVED_TO) ) {
+        handleMovedAwayFile(moved_from);
+        moved_from.clear();
+        cookie = 0;
+    }
 
-        // Obvious modification
-        if( (event_mask & IN_CLOSE_WRITE) ) {
-            emit modified(path);
-            return;
-        }
+    // Obvious delete
+    if ( (event_mask & IN_DELETE) ) {
+        emit deleted(path, (event_mask & IN_ISDIR));
+        return;
+    }
 
-        // Obvious rename
-        if ( !moved_from.isEmpty() && cookie == event_cookie
-             && (event_mask & IN_MOVED_TO) ){
-            QString new_name = path;
-            inotifytools_replace_filename( moved_from.toStdString().c_str(),
-                                           new_name.toStdString().c_str() );
-            emit moved(moved_from, new_name, (event_mask & IN_ISDIR));
-
-            // necessary cleanup
-            moved_from.clear();
-            cookie = 0;
-        } else if ( ((event_mask & IN_CREATE) || (event_mask & IN_MOVED_TO)) ) {
-            QString new_file = path;
-
-            // New file - if it is a directory, watch it
-            if (event_mask & IN_ISDIR) {
-                if( !inotifytools_watch_recursively( new_file.toStdString().c_str(), this->events )) {
-                    qWarning() << "Couldn't watch new directory" << new_file
-                               << ":" << strerror( inotifytools_error() );
-                }
+    // Obvious modification
+    if( (event_mask & IN_CLOSE_WRITE) ) {
+        emit modified(path);
+        return;
+    }
+
+    // Obvious rename
+    if ( !moved_from.isEmpty() && cookie == event_cookie
+         && (event_mask & IN_MOVED_TO) ){
+        QString new_name = path;
+        inotifytools_replace_filename( moved_from.toStdString().c_str(),
+                                       new_name.toStdString().c_str() );
+        emit moved(moved_from, new_name, (event_mask & IN_ISDIR));
+
+        // necessary cleanup
+        moved_from.clear();
+        cookie = 0;
+    } else if ( ((event_mask & IN_CREATE) || (event_mask & IN_MOVED_TO)) ) {
+        QString new_file = path;
+
+        // New file - if it is a directory, watch it
+        if (event_mask & IN_ISDIR) {
+            if( !inotifytools_watch_recursively( new_file.toStdString().c_str(), this->events )) {
+                qWarning() << "Couldn't watch new directory" << new_file
+                           << ":" << strerror( inotifytools_error() );
             }
-            emit added(new_file, (event_mask & IN_ISDIR));
-
-            // cleanup for safe
-            moved_from.clear();
-            cookie = 0;
-        } else if ( (event_mask & IN_MOVED_FROM) ) {
-            moved_from = path;
-            cookie = event_cookie;
         }
-    });
-    this->looper->start();
-    this->loop.exec();
+        emit added(new_file, (event_mask & IN_ISDIR));
+
+        // cleanup for safe
+        moved_from.clear();
+        cookie = 0;
+    } else if ( (event_mask & IN_MOVED_FROM) ) {
+        moved_from = path;
+        cookie = event_cookie;
+    }
 }
 
 FSWatcher::~FSWatcher()
@@ -145,8 +146,9 @@ void FSWatcher::handleMovedAwayFile(QString path)
 
 void FSWatcher::stop()
 {
-    this->looper->stop();
-    this->loop.exit();
+    if(this->looper) {
+        this->looper->stop();
+    }
 }
 
 void FSWatcher::addRecursiveWatch(QString path)
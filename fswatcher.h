@@ -7,7 +7,6 @@
 #include <QDir>
 #include <cstring>
 #include <errno.h>
-#include <QEventLoop>
 #include <QTimer>
 #include <inotifytools/inotify.h>
 #include <inotifytools/inotifytools.h>
@@ -30,8 +29,11 @@ signals:
 
 private:
     void handleMovedAwayFile(QString path);
-    QEventLoop loop;
+    void poll();
     QTimer *looper;
+    // first half of a rename, until its IN_MOVED_TO shows up
+    QString moved_from;
+    uint32_t cookie;
     QString m_path;
     int events;
 
@@ -1,49 +1,128 @@
 #include "safeapifactory.h"
 
 SafeApiFactory::SafeApiFactory(QString host, QObject *parent) :
-    QObject(parent)
+    QObject(parent),
+    refreshing(false),
+    busy(0),
+    created(0),
+    acquired(0),
+    reused(0),
+    waited(0),
+    logins(0)
 {
     this->host = host;
 }
 
+void SafeApiFactory::acquire(Ready ready)
+{
+    if(this->idle.isEmpty() && this->busy >= API_POOL_SIZE) {
+        ++this->waited;
+        this->waiting.append(ready);
+        return;
+    }
+    ready(newApi());
+}
+
+void SafeApiFactory::serveWaiting()
+{
+    while(!this->waiting.isEmpty()
+          && (!this->idle.isEmpty() || this->busy < API_POOL_SIZE)) {
+        Ready ready(this->waiting.takeFirst());
+        ready(newApi());
+    }
+}
+
 SafeApi *SafeApiFactory::newApi()
 {
-    auto api = new SafeApi(this->host, this);
+    if(QDateTime::currentDateTime().toTime_t() - this->sharedState.tokenTimestamp >= TOKEN_LIFESPAN / 2
+            && !this->refreshing && !this->m_login.isEmpty()) {
+        // half its life is left, requests go on with it until the new one is there
+        this->refreshing = true;
+        authUser(this->m_login, this->password, [this](bool){
+            this->refreshing = false;
+        });
+    }
 
-    if(QDateTime::currentDateTime().toTime_t() - this->sharedState.tokenTimestamp < TOKEN_LIFESPAN / 2) {
-        api->setState(this->sharedState);
-        return api;
+    SafeApi *api;
+    if(!this->idle.isEmpty()) {
+        api = this->idle.takeLast(); // most recently used, likeliest to be connected
+        ++this->reused;
+    } else {
+        api = new SafeApi(this->host, this);
+        ++this->created;
     }
+    ++this->acquired;
+    ++this->busy;
+    api->setState(this->sharedState);
+    return api;
+}
 
-    if(this->authUser(this->m_login, this->password)) {
-        return api;
+void SafeApiFactory::release(SafeApi *api)
+{
+    if(!api) {
+        return;
+    }
+    --this->busy;
+    api->disconnect();
+    this->idle.append(api);
+    serveWaiting();
+    if(this->idle.size() + this->busy > API_POOL_SIZE) {
+        this->idle.takeFirst()->deleteLater();
     }
+}
 
-    return NULL;
+void SafeApiFactory::discard(SafeApi *api)
+{
+    if(!api) {
+        return;
+    }
+    --this->busy;
+    api->disconnect();
+    api->deleteLater();
+    serveWaiting();
 }
 
-bool SafeApiFactory::authUser(QString login, QString password)
+void SafeApiFactory::authUser(QString login, QString password, AuthCallback done)
 {
-    QEventLoop loop;
-    auto api = new SafeApi(this->host);
-    bool success;
+    SAFE_ASSERT_NOT_NESTED();
+    auto api = new SafeApi(this->host, this);
+    ++this->logins;
 
-    connect(api, &SafeApi::authUserComplete, [&](ulong id, QString user_id){
+    connect(api, &SafeApi::authUserComplete, this, [=](ulong id, QString user_id){
         qDebug() << "Authentication complete (user id:" << user_id << ")";
         this->sharedState = api->state();
         this->m_login = login;
         this->password = password;
-        success = true;
-        loop.exit();
+        api->disconnect();
+        api->deleteLater();
+        if(done) {
+            done(true);
+        }
     });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
+    connect(api, &SafeApi::errorRaised, this, [=](ulong id, quint16 code, QString text){
         this->sharedState.clear();
-        api = NULL;
         qWarning() << "Authentication error:" << text;
-        loop.exit();
+        api->disconnect();
+        api->deleteLater();
+        if(done) {
+            done(false);
+        }
     });
 
     api->authUser(login, password);
-    loop.exec();
-    return success;
+}
+
+QJsonObject SafeApiFactory::stats() const
+{
+    QJsonObject values;
+    values.insert("created", (qint64)this->created);
+    values.insert("acquired", (qint64)this->acquired);
+    values.insert("reused", (qint64)this->reused);
+    values.insert("reuse_rate", this->acquired ? double(this->reused) / this->acquired : 0.0);
+    values.insert("waited", (qint64)this->waited);
+    values.insert("waiting", this->waiting.size());
+    values.insert("logins", (qint64)this->logins);
+    values.insert("busy", this->busy);
+    values.insert("idle", this->idle.size());
+    return values;
 }
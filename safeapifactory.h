@@ -2,26 +2,77 @@
 #define SAFEAPIFACTORY_H
 
 #include <QObject>
+#include <QList>
+#include <QJsonObject>
+#include <QThread>
+#include <functional>
 #include <safeapi.h>
 #include <safecommon.h>
 
+#define API_POOL_SIZE 8 // clients per host, each keeps its own connections alive
+
+// Requests are never waited for: a nested event loop would run other
+// handlers halfway through the one waiting, and hold every later reply
+// behind this one. Debug builds check it where requests are started.
+#define SAFE_ASSERT_NOT_NESTED() \
+    Q_ASSERT_X(QThread::currentThread()->loopLevel() <= 1, Q_FUNC_INFO, \
+               "request started from a nested event loop")
+
+// Hands out SafeApi clients. Every client owns its network manager, so a
+// fresh one means fresh TCP and TLS handshakes; released clients are kept
+// idle and handed out again with their connections still open. At most
+// API_POOL_SIZE clients are out at once, later callers wait in line for
+// the next one given back.
 class SafeApiFactory : public QObject
 {
     Q_OBJECT
 public:
     explicit SafeApiFactory(QString host, QObject *parent = 0);
-    SafeApi* newApi();
-    bool authUser(QString login, QString password);
+    typedef std::function<void(SafeApi *api)> Ready;
+    // ready gets a client right away when one is free, otherwise once one
+    // is released or discarded
+    void acquire(Ready ready);
+    // callers still waiting are forgotten, e.g. when the session ends
+    void dropWaiting() { this->waiting.clear(); }
+    // only once its request finished: the client is disconnected from
+    // everything and may be handed out again
+    void release(SafeApi *api);
+    // for clients with a request still in flight
+    void discard(SafeApi *api);
+    typedef std::function<void(bool ok)> AuthCallback;
+    typedef std::function<void(quint16 code, const QString &text)> Failure;
+    // done is called once the server answered, the credentials are kept on success
+    void authUser(QString login, QString password, AuthCallback done = AuthCallback());
+    // one request on a pooled client: start sends it, done gets the
+    // arguments of complete and failed those of errorRaised. The client is
+    // given back after either, nothing is called once the factory is gone
+    template<typename Signal, typename Continuation>
+    void call(Signal complete, std::function<void(SafeApi *)> start, Continuation done,
+              Failure failed = Failure());
     void setState(SafeApiState state){ this->sharedState = state; }
     void setLogin(QString login) { this->m_login = login; }
     void setPassword(QString password) { this->password = password; }
     QString login(){ return this->m_login; }
+    QJsonObject stats() const;
 
 private:
     QString host;
     QString m_login;
     QString password;
     SafeApiState sharedState;
+    bool refreshing;
+
+    QList<SafeApi *> idle;
+    QList<Ready> waiting;
+    int busy;
+    quint64 created;
+    quint64 acquired;
+    quint64 reused;
+    quint64 waited;
+    quint64 logins;
+
+    SafeApi *newApi();
+    void serveWaiting();
 
 signals:
 
@@ -29,4 +80,26 @@ public slots:
 
 };
 
+template<typename Signal, typename Continuation>
+void SafeApiFactory::call(Signal complete, std::function<void(SafeApi *)> start,
+                          Continuation done, Failure failed)
+{
+    SAFE_ASSERT_NOT_NESTED();
+    acquire([=](SafeApi *api){
+        // in connection order: the continuation sees the result first, and
+        // release() drops both connections after it
+        connect(api, complete, this, done);
+        connect(api, complete, this, [=](){
+            release(api);
+        });
+        connect(api, &SafeApi::errorRaised, this, [=](ulong, quint16 code, QString text){
+            release(api);
+            if(failed) {
+                failed(code, text);
+            }
+        });
+        start(api);
+    });
+}
+
 #endif // SAFEAPIFACTORY_H
@@ -0,0 +1,212 @@
+#include "safechunkedtransfer.h"
+#include <QTimer>
+#include <QDebug>
+
+SafeChunkedTransfer::SafeChunkedTransfer(SafeResumableTarget *target, const QString &relative,
+                                         const QString &path, QObject *parent) :
+    QObject(parent),
+    target(target),
+    relative(relative),
+    source(new SafeUploadSource(path, this)),
+    sink(0),
+    limiter(0),
+    total(0),
+    offset(0),
+    reported(0),
+    resumedAt(0),
+    waiting(false),
+    done(false)
+{
+    // data is available again once the limiter refilled
+    connect(this->source, &QIODevice::readyRead, this, [this](){
+        if(this->waiting) {
+            this->waiting = false;
+            next();
+        }
+    });
+}
+
+SafeChunkedTransfer::SafeChunkedTransfer(SafeResumableTarget *target, const QString &relative,
+                                         SafeDownloadSink *sink, QObject *parent) :
+    QObject(parent),
+    target(target),
+    relative(relative),
+    source(0),
+    sink(sink),
+    limiter(0),
+    total(0),
+    offset(0),
+    reported(0),
+    resumedAt(0),
+    waiting(false),
+    done(false)
+{
+    sink->setParent(this);
+}
+
+SafeChunkedTransfer::~SafeChunkedTransfer()
+{
+    // cancelled or the daemon quits: what is on disk stays for the next attempt
+    if(this->sink && !this->done) {
+        this->sink->sync();
+        this->sink->suspend();
+    }
+}
+
+void SafeChunkedTransfer::setRateLimiter(SafeRateLimiter *limiter)
+{
+    this->limiter = limiter;
+    if(this->sink) {
+        connect(limiter, &SafeRateLimiter::refilled, this, [this](){
+            if(this->waiting) {
+                this->waiting = false;
+                next();
+            }
+        });
+    }
+}
+
+bool SafeChunkedTransfer::start(qint64 offset)
+{
+    if(this->source) {
+        if(!this->source->open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        this->total = this->source->size();
+        if(offset > this->total) {
+            offset = 0;
+        }
+        // the part the target has is read only for the hashes, unthrottled
+        QByteArray buffer(TRANSFER_CHUNK, Qt::Uninitialized);
+        while(this->offset < offset) {
+            qint64 len = this->source->read(buffer.data(),
+                                            qMin<qint64>(buffer.size(), offset - this->offset));
+            if(len <= 0) {
+                return false;
+            }
+            this->offset += len;
+        }
+        if(this->limiter) {
+            this->source->setRateLimiter(this->limiter);
+        }
+    } else {
+        this->total = this->target->size(this->relative);
+        if(this->total < 0) {
+            return false;
+        }
+        if(offset <= 0 || offset > this->total || !this->sink->resume(offset)) {
+            offset = 0;
+            if(!this->sink->open(QIODevice::WriteOnly)) {
+                return false;
+            }
+        }
+        this->offset = offset;
+    }
+
+    if(offset > 0) {
+        qDebug() << "Continuing transfer of" << this->relative << "at" << offset
+                 << "/" << this->total;
+    }
+    this->resumedAt = offset;
+    this->reported = offset;
+    next();
+    return true;
+}
+
+void SafeChunkedTransfer::next()
+{
+    QTimer::singleShot(0, this, [this](){ step(); });
+}
+
+void SafeChunkedTransfer::step()
+{
+    if(this->done) {
+        return;
+    }
+
+    if(this->source) {
+        QByteArray data(RESUME_CHUNK, Qt::Uninitialized);
+        qint64 len = this->offset < this->total ? this->source->read(data.data(), data.size()) : 0;
+        if(len < 0) {
+            qWarning() << "Unable to read" << this->relative << "for upload";
+            end(false);
+            return;
+        }
+        if(len == 0 && this->offset < this->total) {
+            this->waiting = true; // throttled, readyRead() follows
+            return;
+        }
+        data.resize(len);
+        // an empty file is a single empty range
+        if((len > 0 || this->total == 0) && !this->target->append(this->relative, this->offset, data)) {
+            qWarning() << "Upload of" << this->relative << "refused at" << this->offset;
+            end(false);
+            return;
+        }
+        this->offset += len;
+        if(this->offset < this->total) {
+            checkpoint(false);
+            next();
+            return;
+        }
+        // only content read in one piece that did not change on the way
+        if(this->source->hash().isEmpty() || this->source->isModified()
+                || !this->target->finish(this->relative)) {
+            end(false);
+            return;
+        }
+        end(true);
+        return;
+    }
+
+    qint64 wanted = qMin<qint64>(RESUME_CHUNK, this->total - this->offset);
+    if(this->limiter && wanted > 0) {
+        wanted = this->limiter->take(wanted);
+        if(wanted == 0) {
+            this->waiting = true; // refilled() follows
+            return;
+        }
+    }
+    if(wanted > 0) {
+        QByteArray data(this->target->read(this->relative, this->offset, wanted));
+        if(data.isEmpty() || this->sink->write(data) != data.size()) {
+            qWarning() << "Download of" << this->relative << "broken off at" << this->offset;
+            end(false);
+            return;
+        }
+        this->offset += data.size();
+    }
+    if(this->offset < this->total) {
+        checkpoint(false);
+        next();
+        return;
+    }
+    end(true);
+}
+
+void SafeChunkedTransfer::checkpoint(bool force)
+{
+    if(this->offset == this->reported
+            || (!force && this->offset - this->reported < RESUME_CHUNK)) {
+        return;
+    }
+    // appended to the target means acknowledged; a part file must be synced
+    if(this->sink && !this->sink->sync()) {
+        return;
+    }
+    this->reported = this->offset;
+    emit progress(this->offset);
+}
+
+void SafeChunkedTransfer::end(bool ok)
+{
+    if(!ok) {
+        checkpoint(true);
+    }
+    this->done = true;
+    if(this->sink && !ok) {
+        this->sink->sync();
+        this->sink->suspend();
+    }
+    emit finished(ok);
+}
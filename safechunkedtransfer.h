@@ -0,0 +1,63 @@
+#ifndef SAFECHUNKEDTRANSFER_H
+#define SAFECHUNKEDTRANSFER_H
+
+#include <QObject>
+#include "saferesumabletarget.h"
+#include "safeuploadsource.h"
+#include "safedownloadsink.h"
+#include "saferatelimiter.h"
+
+#define RESUME_CHUNK (16 * 1024 * 1024) // bytes between journaled offsets
+
+// Moves a file to or from a SafeResumableTarget a range at a time, one per
+// turn of the event loop. Every RESUME_CHUNK bytes the target (upload) or
+// the disk (download) has for certain are reported through progress(),
+// which the daemon journals; an interrupted transfer starts again there.
+// A download left unfinished keeps its part file.
+class SafeChunkedTransfer : public QObject
+{
+    Q_OBJECT
+public:
+    // upload of path to relative
+    SafeChunkedTransfer(SafeResumableTarget *target, const QString &relative,
+                        const QString &path, QObject *parent = 0);
+    // download of relative into sink, which it takes
+    SafeChunkedTransfer(SafeResumableTarget *target, const QString &relative,
+                        SafeDownloadSink *sink, QObject *parent = 0);
+    ~SafeChunkedTransfer();
+
+    void setRateLimiter(SafeRateLimiter *limiter);
+    // begins at offset, or at zero when what is before it can't be used;
+    // false if the local file can't be opened
+    bool start(qint64 offset);
+    qint64 startedAt() const { return resumedAt; }
+
+    // the upload's source, hashed on the way (uploads only)
+    SafeUploadSource *uploadSource() const { return source; }
+    // the download's part file, to be committed (downloads only)
+    SafeDownloadSink *downloadSink() const { return sink; }
+
+signals:
+    void progress(qint64 offset);
+    void finished(bool ok);
+
+private:
+    SafeResumableTarget *target;
+    QString relative;
+    SafeUploadSource *source;
+    SafeDownloadSink *sink;
+    SafeRateLimiter *limiter;
+    qint64 total;
+    qint64 offset;
+    qint64 reported;
+    qint64 resumedAt;
+    bool waiting;
+    bool done;
+
+    void step();
+    void next();
+    void checkpoint(bool force);
+    void end(bool ok);
+};
+
+#endif // SAFECHUNKEDTRANSFER_H
@@ -0,0 +1,110 @@
+#include "safechunker.h"
+#include <QSet>
+
+namespace {
+
+struct GearTable {
+    quint64 values[256];
+    GearTable() {
+        // splitmix64, fixed seed: boundaries must be stable across runs
+        quint64 x = 0x2545f4914f6cdd1dULL;
+        for(int i = 0; i < 256; ++i) {
+            quint64 z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+const GearTable gear;
+const quint64 boundaryMask = ((1ULL << CHUNK_AVG_BITS) - 1) << (64 - CHUNK_AVG_BITS);
+
+}
+
+SafeChunker::SafeChunker() :
+    rolling(0),
+    offset(0),
+    start(0)
+{
+}
+
+void SafeChunker::addData(const char *data, int length)
+{
+    this->fileHash.addData(data, length);
+
+    int from = 0;
+    for(int i = 0; i < length; ++i) {
+        this->rolling = (this->rolling << 1) + gear.values[(uchar)data[i]];
+        ++this->offset;
+
+        qint64 size = this->offset - this->start;
+        if((size >= CHUNK_MIN_SIZE && !(this->rolling & boundaryMask))
+                || size >= CHUNK_MAX_SIZE) {
+            this->chunkHash.addData(data + from, i + 1 - from);
+            from = i + 1;
+            cut();
+        }
+    }
+    this->chunkHash.addData(data + from, length - from);
+}
+
+bool SafeChunker::addData(QIODevice *device)
+{
+    if(!device->isReadable()) {
+        return false;
+    }
+
+    char buffer[64 * 1024];
+    qint64 length;
+    while((length = device->read(buffer, sizeof(buffer))) > 0) {
+        addData(buffer, int(length));
+    }
+    return device->atEnd();
+}
+
+QList<SafeChunk> SafeChunker::result()
+{
+    if(this->offset > this->start) {
+        cut();
+    }
+    return this->chunks;
+}
+
+QList<SafeByteRange> SafeChunker::changedRanges(const QList<SafeChunk> &old,
+                                                const QList<SafeChunk> &current)
+{
+    QSet<QString> known;
+    foreach(SafeChunk chunk, old) {
+        known.insert(chunk.digest);
+    }
+
+    QList<SafeByteRange> ranges;
+    foreach(SafeChunk chunk, current) {
+        if(known.contains(chunk.digest)) {
+            continue;
+        }
+        if(!ranges.isEmpty() && ranges.last().offset + ranges.last().length == chunk.offset) {
+            ranges.last().length += chunk.length;
+            continue;
+        }
+        SafeByteRange range;
+        range.offset = chunk.offset;
+        range.length = chunk.length;
+        ranges.append(range);
+    }
+    return ranges;
+}
+
+void SafeChunker::cut()
+{
+    SafeChunk chunk;
+    chunk.offset = this->start;
+    chunk.length = this->offset - this->start;
+    chunk.digest = this->chunkHash.result().toHex();
+    this->chunks.append(chunk);
+
+    this->chunkHash.reset();
+    this->rolling = 0;
+    this->start = this->offset;
+}
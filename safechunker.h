@@ -0,0 +1,55 @@
+#ifndef SAFECHUNKER_H
+#define SAFECHUNKER_H
+
+#include <QString>
+#include <QList>
+#include <QIODevice>
+#include "safefasthash.h"
+
+#define CHUNK_MIN_SIZE (256 * 1024)
+#define CHUNK_MAX_SIZE (4 * 1024 * 1024)
+#define CHUNK_AVG_BITS 20 // ~1 MB average chunk
+
+struct SafeChunk
+{
+    qint64 offset;
+    qint64 length;
+    QString digest;
+};
+
+struct SafeByteRange
+{
+    qint64 offset;
+    qint64 length;
+};
+
+// Content-defined chunking with a gear rolling hash: boundaries depend on
+// the data around them, not on offsets, so an insert or append only changes
+// the chunks it touches. Chunk digests and the whole-file hash are XXH3.
+class SafeChunker
+{
+public:
+    SafeChunker();
+
+    void addData(const char *data, int length);
+    bool addData(QIODevice *device);
+    QList<SafeChunk> result();
+    QString fastHash() const { return fileHash.result().toHex(); }
+
+    // ranges of current that are not covered by any chunk of old
+    static QList<SafeByteRange> changedRanges(const QList<SafeChunk> &old,
+                                              const QList<SafeChunk> &current);
+
+private:
+    Q_DISABLE_COPY(SafeChunker)
+    quint64 rolling;
+    qint64 offset;
+    qint64 start;
+    SafeFastHash chunkHash;
+    SafeFastHash fileHash;
+    QList<SafeChunk> chunks;
+
+    void cut();
+};
+
+#endif // SAFECHUNKER_H
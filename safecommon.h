@@ -6,9 +6,15 @@
 #define DEFAULT_ROOT_NAME "2safe"
 #define LOCAL_STATE_DATABASE "local.db"
 #define REMOTE_STATE_DATABASE "remote.db"
+#define STATE_DATABASE_VERSION 5
 #define SAFE_DIR ".2safe"
 #define SOCKET_FILE "control.sock"
+#define TRASH_DIR ".2safe-trash" // in the sync root
 #define TOKEN_LIFESPAN (24 * 60 * 60) // 24 hours
+#define CHUNK_THRESHOLD (64 * 1024 * 1024) // files with chunk manifests
+#define COPY_THRESHOLD (64 * 1024) // files worth copying remotely instead of uploading
+#define LOOKUP_HASH_LIMIT 4 // same-sized files hashed per content lookup
+#define USAGE_REFRESH_DELAY (5 * 1000) // ms of changes of unknown size per quota request
 
 #define SET_SETTINGS_TYPE "set_settings"
 #define GET_SETTINGS_TYPE "get_settings"
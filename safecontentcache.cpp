@@ -0,0 +1,120 @@
+#include "safecontentcache.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QDebug>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+SafeContentCache::SafeContentCache(const QString &dir, QSettings *settings) :
+    dir(dir),
+    settings(settings),
+    nextSeq(0),
+    bytes(0),
+    hits(0),
+    misses(0),
+    evicted(0)
+{
+    QDir().mkpath(dir);
+
+    // stored time is the order of the last run
+    QFileInfoList files(QDir(dir).entryInfoList(QDir::Files | QDir::Hidden,
+                                                QDir::Time | QDir::Reversed));
+    foreach(QFileInfo info, files) {
+        QString hash(info.fileName().mid(1));
+        Entry entry;
+        entry.seq = this->nextSeq++;
+        entry.size = info.size();
+        this->entries.insert(hash, entry);
+        this->order.insert(entry.seq, hash);
+        this->bytes += entry.size;
+    }
+    if(!this->entries.isEmpty()) {
+        qDebug() << "Trash holds" << this->entries.size() << "files," << this->bytes << "bytes";
+    }
+    evict(capacity());
+}
+
+qint64 SafeContentCache::capacity() const
+{
+    return qMax<qint64>(this->settings->value("trash_size", 1024).toLongLong(), 0) * 1024 * 1024;
+}
+
+QString SafeContentCache::pathFor(const QString &hash) const
+{
+    // hidden, so the daemon ignores watcher events on it
+    return this->dir + QDir::separator() + "." + hash;
+}
+
+bool SafeContentCache::put(const QString &path, const QString &hash)
+{
+    qint64 limit = capacity();
+    qint64 size = QFileInfo(path).size();
+    if(hash.isEmpty() || size > limit) {
+        return false;
+    }
+
+    QString target(pathFor(hash));
+    if(::rename(QFile::encodeName(path).constData(), QFile::encodeName(target).constData()) != 0) {
+        qWarning() << "Unable to move" << path << "to the trash";
+        return false;
+    }
+    // when it was stored, for the order after a restart
+    ::utimensat(AT_FDCWD, QFile::encodeName(target).constData(), 0, 0);
+
+    if(this->entries.contains(hash)) {
+        // replaced by the rename
+        drop(hash);
+    }
+    Entry entry;
+    entry.seq = this->nextSeq++;
+    entry.size = size;
+    this->entries.insert(hash, entry);
+    this->order.insert(entry.seq, hash);
+    this->bytes += size;
+    evict(limit);
+    return true;
+}
+
+QString SafeContentCache::take(const QString &hash)
+{
+    if(!this->entries.contains(hash)) {
+        ++this->misses;
+        return QString();
+    }
+    ++this->hits;
+    drop(hash);
+    return pathFor(hash);
+}
+
+void SafeContentCache::drop(const QString &hash)
+{
+    Entry entry(this->entries.take(hash));
+    this->order.remove(entry.seq);
+    this->bytes -= entry.size;
+}
+
+void SafeContentCache::evict(qint64 capacity)
+{
+    while(this->bytes > capacity && !this->order.isEmpty()) {
+        QString hash(this->order.first());
+        drop(hash);
+        QFile(pathFor(hash)).remove();
+        ++this->evicted;
+    }
+}
+
+QJsonObject SafeContentCache::stats() const
+{
+    QJsonObject values;
+    quint64 lookups = this->hits + this->misses;
+    values.insert("files", this->entries.size());
+    values.insert("bytes", this->bytes);
+    values.insert("capacity", capacity());
+    values.insert("hits", (qint64)this->hits);
+    values.insert("misses", (qint64)this->misses);
+    values.insert("hit_rate", lookups ? double(this->hits) / lookups : 0.0);
+    values.insert("evicted", (qint64)this->evicted);
+    return values;
+}
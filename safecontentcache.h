@@ -0,0 +1,50 @@
+#ifndef SAFECONTENTCACHE_H
+#define SAFECONTENTCACHE_H
+
+#include <QString>
+#include <QHash>
+#include <QMap>
+#include <QSettings>
+#include <QJsonObject>
+
+// Local trash: files removed on the server are moved in here instead of
+// being deleted, named by their MD5, so a restore or a re-add of the same
+// content is a rename back rather than a download. It lives in a hidden
+// directory of the sync root to stay on the same filesystem. The least
+// recently stored content goes first once it holds more than "trash_size"
+// MB, 0 turns it off.
+class SafeContentCache
+{
+public:
+    SafeContentCache(const QString &dir, QSettings *settings);
+
+    // moves path in under hash; false if it is not kept, path is untouched then
+    bool put(const QString &path, const QString &hash);
+    // file with the content of hash, no longer part of the cache: the caller
+    // moves it away or removes it. Empty if there is none
+    QString take(const QString &hash);
+    QJsonObject stats() const;
+
+private:
+    struct Entry {
+        qint64 seq;
+        qint64 size;
+    };
+
+    QString dir;
+    QSettings *settings;
+    QHash<QString, Entry> entries;
+    QMap<qint64, QString> order; // seq -> hash, oldest first
+    qint64 nextSeq;
+    qint64 bytes;
+    quint64 hits;
+    quint64 misses;
+    quint64 evicted;
+
+    qint64 capacity() const;
+    QString pathFor(const QString &hash) const;
+    void drop(const QString &hash);
+    void evict(qint64 capacity);
+};
+
+#endif // SAFECONTENTCACHE_H
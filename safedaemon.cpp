@@ -4,7 +4,64 @@ SafeDaemon::SafeDaemon(QObject *parent) : QObject(parent) {
     this->settings = new QSettings(ORG_NAME, APP_NAME, this);
     this->apiFactory = new SafeApiFactory(API_HOST, this);
     this->server = new QLocalServer(this);
+    this->transfers = new SafeTransferScheduler(this->settings, this->apiFactory, this);
+    this->uploadLimiter = new SafeRateLimiter(this);
+    this->downloadLimiter = new SafeRateLimiter(this);
     this->online = false;
+    this->deltaTarget = 0;
+    this->resumeTarget = 0;
+    this->scrubber = 0;
+    this->retries = 0;
+    this->dirs = 0;
+    this->watcher = 0;
+    this->swatcher = 0;
+    this->localStateDb = 0;
+    this->remoteStateDb = 0;
+    this->remoteBusy = false;
+    this->remoteDraining = false;
+    this->dirIdHits = 0;
+    this->dirIdMisses = 0;
+    this->localCopies = 0;
+    this->localCopyBytes = 0;
+    this->remoteCopies = 0;
+    this->remoteCopyBytes = 0;
+    this->unchangedFiles = 0;
+    this->unchangedBytes = 0;
+    this->oplog = 0;
+    this->trash = 0;
+    this->peers = 0;
+    this->peerBytes = 0;
+    this->used_bytes = 0;
+    this->total_bytes = 0;
+    this->quotaDrift = 0;
+    this->quotaTimer = new QTimer(this);
+    this->quotaTimer->setTimerType(Qt::VeryCoarseTimer);
+    connect(this->quotaTimer, &QTimer::timeout, this, &SafeDaemon::fetchUsage);
+    // changes the local accounting can't size are summed up by the server
+    this->usageRefresh = new QTimer(this);
+    this->usageRefresh->setSingleShot(true);
+    this->usageRefresh->setInterval(USAGE_REFRESH_DELAY);
+    connect(this->usageRefresh, &QTimer::timeout, this, &SafeDaemon::fetchUsage);
+    this->reachable = true;
+    this->probe = new QTimer(this);
+    this->probe->setTimerType(Qt::VeryCoarseTimer);
+    connect(this->probe, &QTimer::timeout, this, &SafeDaemon::probeServer);
+
+    QString mirror(this->settings->value("delta_mirror", "").toString());
+    if(!mirror.isEmpty()) {
+        this->deltaTarget = new SafeMirrorDeltaTarget(mirror);
+    }
+    mirror = this->settings->value("transfer_mirror", "").toString();
+    if(!mirror.isEmpty()) {
+        this->resumeTarget = new SafeMirrorResumableTarget(mirror);
+    }
+
+    // limits follow their schedule, if any
+    applyRateLimits();
+    QTimer *limitTicker = new QTimer(this);
+    limitTicker->setTimerType(Qt::VeryCoarseTimer);
+    connect(limitTicker, &QTimer::timeout, this, &SafeDaemon::applyRateLimits);
+    limitTicker->start(60 * 1000);
 
     connect(server, &QLocalServer::newConnection, this, &SafeDaemon::handleClientConnection);
     this->bindServer(this->server,
@@ -12,50 +69,108 @@ SafeDaemon::SafeDaemon(QObject *parent) : QObject(parent) {
                      QDir::separator() + SAFE_DIR +
                      QDir::separator() + SOCKET_FILE);
 
-    if (this->authUser())
-        init();
+    authUser([this](bool ok){
+        if(ok) {
+            init();
+        }
+    });
 }
 
 SafeDaemon::~SafeDaemon()
 {
     this->online = false;
+    delete this->transfers; // gives its clients back to the factory
+    delete this->dirs;
     this->apiFactory->deleteLater();
-    this->watcher->deleteLater();
-    this->swatcher->deleteLater();
-    this->localStateDb->deleteLater();
-    this->remoteStateDb->deleteLater();
+    // not there before the first login
+    if(this->watcher) {
+        this->watcher->deleteLater();
+    }
+    if(this->swatcher) {
+        this->swatcher->deleteLater();
+    }
+    if(this->localStateDb) {
+        this->localStateDb->deleteLater();
+        this->remoteStateDb->deleteLater();
+    }
+    delete this->deltaTarget;
+    delete this->resumeTarget;
 }
 
-bool SafeDaemon::authUser() {
+void SafeDaemon::authUser(std::function<void(bool ok)> done) {
     QString login = this->settings->value("login", "").toString();
     QString password = this->settings->value("password", "").toString();
 
     if (login.length() < 1 || password.length() < 1) {
         this->online = false;
         qDebug() << "Unauthorized";
-        return false;
-    } else if(!this->apiFactory->authUser(login, password)) {
-        this->online = false;
-        qWarning() << "Authentication failed";
-        return false;
+        done(false);
+        return;
     }
 
-    return true;
+    this->apiFactory->authUser(login, password, [=](bool ok){
+        if(!ok) {
+            this->online = false;
+            qWarning() << "Authentication failed";
+        }
+        done(ok);
+    });
 }
 
 void SafeDaemon::init()
 {
     this->online = true;
     fetchUsage();
+    this->quotaTimer->start(qMax(this->settings->value("quota_interval", 15).toInt(), 1) * 60 * 1000);
 
-    // debug clean dbs
-    purgeDb(LOCAL_STATE_DATABASE);
+    // remote state is rebuilt from scratch, local one is checked against disk
     purgeDb(REMOTE_STATE_DATABASE);
     // open dbs
     this->localStateDb = new SafeStateDb(LOCAL_STATE_DATABASE);
     this->remoteStateDb = new SafeStateDb(REMOTE_STATE_DATABASE);
-    // index all remote files
-    fullRemoteIndex();
+    this->oplog = new SafeOpLog(this->localStateDb);
+    this->trash = new SafeContentCache(getFilesystemPath() + QDir::separator() + TRASH_DIR,
+                                       this->settings);
+    if(this->settings->value("peer_sync", false).toBool()) {
+        // random, nothing about the account can be learned from it; the other
+        // daemons of the account need the same one to take part
+        QByteArray key(QByteArray::fromHex(this->settings->value("peer_key", "").toByteArray()));
+        if(key.isEmpty()) {
+            key = SafePeerService::newKey();
+            this->settings->setValue("peer_key", QString(key.toHex()));
+            qWarning() << "Generated a new peer key, set the same \"peer_key\" on the other"
+                          " daemons of this account";
+        }
+        if(key.size() < PEER_KEY_SIZE) {
+            qWarning() << "No usable \"peer_key\", not exchanging content with peers";
+        } else {
+            this->peers = new SafePeerService(key, this->settings,
+                                              [this](const QString &hash, qint64 size){
+                QString relativeF(findLocalContent(hash, size));
+                return relativeF.isEmpty() ? QString()
+                                           : getFilesystemPath() + QDir::separator() + relativeF;
+            }, this);
+        }
+    }
+    this->dirs = new SafeDirPlanner(this->remoteStateDb, this->apiFactory, this->settings, this);
+    connect(this->dirs, &SafeDirPlanner::created, [&](const QString &dir, const QString &id){
+        this->localStateDb->updateDirId(dir, id);
+        if(this->retries) {
+            this->retries->succeeded(getFilesystemPath() + QDir::separator() + dir);
+        }
+    });
+    connect(this->dirs, &SafeDirPlanner::failed, [&](const QString &dir, quint16 code, const QString &text){
+        retryLater(SafeRetryEntry::CreateDir, getFilesystemPath() + QDir::separator() + dir,
+                   QString(), code, text);
+    });
+    // index all remote files, the rest needs it
+    fullRemoteIndex([this](){
+        initIndexed();
+    });
+}
+
+void SafeDaemon::initIndexed()
+{
     // setup watcher (to track remote events from now)
     this->settings->setValue("last_updated", (quint32)QDateTime::currentDateTime().toTime_t());
     this->swatcher = new SafeWatcher((ulong)this->settings->value("last_updated").toDouble(),
@@ -63,17 +178,45 @@ void SafeDaemon::init()
     connect(this->swatcher, &SafeWatcher::timestampChanged, [&](ulong ts){
         this->settings->setValue("last_updated", (quint32)ts);
     });
-    connect(this->swatcher, &SafeWatcher::fileAdded, this, &SafeDaemon::remoteFileAdded);
-    connect(this->swatcher, &SafeWatcher::fileDeleted, this, &SafeDaemon::remoteFileDeleted);
-    connect(this->swatcher, &SafeWatcher::fileMoved, this, &SafeDaemon::remoteFileMoved);
-    connect(this->swatcher, &SafeWatcher::directoryCreated, this, &SafeDaemon::remoteDirectoryCreated);
-    connect(this->swatcher, &SafeWatcher::directoryDeleted, this, &SafeDaemon::remoteDirectoryDeleted);
-    connect(this->swatcher, &SafeWatcher::directoryMoved, this, &SafeDaemon::remoteDirectoryMoved);
+    connect(this->swatcher, &SafeWatcher::fileAdded, [&](QString id, QString pid, QString name){
+        enqueueRemote([=](Next done){
+            remoteFileAdded(id, pid, name, done);
+        });
+    });
+    connect(this->swatcher, &SafeWatcher::fileDeleted, [&](QString id, QString pid, QString name){
+        enqueueRemote([=](Next done){
+            remoteFileDeleted(id, pid, name);
+            done();
+        });
+    });
+    connect(this->swatcher, &SafeWatcher::fileMoved, [&](QString id, QString pid1, QString n1,
+            QString pid2, QString n2){
+        enqueueRemote([=](Next done){
+            remoteFileMoved(id, pid1, n1, pid2, n2, done);
+        });
+    });
+    connect(this->swatcher, &SafeWatcher::directoryCreated, [&](QString id, QString pid, QString name){
+        enqueueRemote([=](Next done){
+            remoteDirectoryCreated(id, pid, name, done);
+        });
+    });
+    connect(this->swatcher, &SafeWatcher::directoryDeleted, [&](QString id, QString pid, QString name){
+        enqueueRemote([=](Next done){
+            remoteDirectoryDeleted(id, pid, name);
+            done();
+        });
+    });
+    connect(this->swatcher, &SafeWatcher::directoryMoved, [&](QString id, QString pid1, QString n1,
+            QString pid2, QString n2){
+        enqueueRemote([=](Next done){
+            remoteDirectoryMoved(id, pid1, n1, pid2, n2, done);
+        });
+    });
 
     // local index
     if(this->settings->value("init", true).toBool()) {
         fullIndex(QDir(getFilesystemPath()));
-        //this->settings->setValue("init", false);
+        this->settings->setValue("init", false);
     } else {
         checkIndex(QDir(getFilesystemPath()));
     }
@@ -81,21 +224,100 @@ void SafeDaemon::init()
     this->swatcher->watch();
     // start watching for fs events
     this->initWatcher(getFilesystemPath());
+    // transfers cut short by the last shutdown
+    resumeTransfers();
+    // failures left over from the last run, once the index is complete
+    this->retries = new SafeRetryQueue(this->localStateDb, this->settings, this);
+    connect(this->retries, &SafeRetryQueue::retry, this, &SafeDaemon::retryOperation);
+    connect(this->retries, &SafeRetryQueue::failed, this, &SafeDaemon::notifyEventError);
+    connect(this->retries, &SafeRetryQueue::reauthenticate, [&](){
+        authUser([this](bool ok){
+            if(!ok) {
+                notifyEventAuth(false);
+            }
+        });
+    });
+    // changes made while the server was out of reach last time
+    if(!this->oplog->isEmpty()) {
+        replayOpLog();
+    }
+    // catch whatever the watchers miss
+    this->scrubber = new SafeScrubber(getFilesystemPath(), this->localStateDb,
+                                      this->remoteStateDb, this->settings, this);
+    connect(this->scrubber, &SafeScrubber::localChanged, this, &SafeDaemon::fileModified);
+    connect(this->scrubber, &SafeScrubber::localMissing, [&](const QString &path){
+        fileDeleted(path, false);
+    });
+    connect(this->scrubber, &SafeScrubber::localCorrupted, this, &SafeDaemon::restoreFile);
+    connect(this->scrubber, &SafeScrubber::remoteDiffers, this, &SafeDaemon::reconcileFile);
+    this->scrubber->start();
 }
 
 void SafeDaemon::deauthUser()
 {
     this->online = false;
-    this->watcher->stop();
+    if(!this->localStateDb) {
+        return; // never logged in
+    }
+    if(this->watcher) {
+        this->watcher->stop();
+    }
 
+    if(this->scrubber) {
+        this->scrubber->deleteLater();
+        this->scrubber = 0;
+    }
+    if(this->retries) {
+        this->retries->deleteLater();
+        this->retries = 0;
+    }
+    // nobody still in line for a client of the old session gets one
+    this->apiFactory->dropWaiting();
+    // queued jobs refer to the old session, running ones hold its clients
+    delete this->transfers;
+    delete this->dirs;
+    this->dirs = 0;
+    delete this->oplog;
+    this->oplog = 0;
+    delete this->trash;
+    this->trash = 0;
+    delete this->peers;
+    this->peers = 0;
+    this->reachable = true;
+    this->probe->stop();
+    this->quotaTimer->stop();
+    this->usageRefresh->stop();
+    this->quotaHeld.clear();
+    this->rootDirId.clear();
+    this->uploadingSizes.clear();
+    this->parkedUploads.clear();
+    this->uploadsAfterMove.clear();
+    // replies to the old session are dropped rather than run on the new
+    // one, the clients go with their factory
+    foreach(SafeApi *api, this->apiFactory->findChildren<SafeApi *>()) {
+        api->blockSignals(true);
+    }
+    this->remoteEvents.clear();
+    this->remoteBusy = false;
     this->apiFactory->deleteLater();
-    this->swatcher->deleteLater();
-    this->watcher->deleteLater();
+    if(this->swatcher) {
+        this->swatcher->deleteLater();
+        this->swatcher = 0;
+    }
+    if(this->watcher) {
+        this->watcher->deleteLater();
+        this->watcher = 0;
+    }
     this->localStateDb->deleteLater();
     this->remoteStateDb->deleteLater();
+    this->localStateDb = 0;
+    this->remoteStateDb = 0;
     this->settings->setValue("init", true);
+    this->settings->remove("scrub_position");
+    this->settings->remove("scrub_cycle_start");
 
     this->apiFactory = new SafeApiFactory(API_HOST, this);
+    this->transfers = new SafeTransferScheduler(this->settings, this->apiFactory, this);
     purgeDb(LOCAL_STATE_DATABASE);
     purgeDb(REMOTE_STATE_DATABASE);
 }
@@ -106,6 +328,17 @@ void SafeDaemon::purgeDb(const QString &name)
     QFile(path).remove();
 }
 
+void SafeDaemon::applyRateLimits()
+{
+    // KB/s, 0 for no limit
+    qint64 up = this->settings->value("upload_limit", 0).toLongLong() * 1024;
+    qint64 down = this->settings->value("download_limit", 0).toLongLong() * 1024;
+    SafeRateLimiter::scheduledRates(this->settings->value("limit_schedule", "").toString(),
+                                    QTime::currentTime(), &up, &down);
+    this->uploadLimiter->setRate(up);
+    this->downloadLimiter->setRate(down);
+}
+
 void SafeDaemon::initWatcher(const QString &path) {
     this->watcher = new FSWatcher(path, this);
     connect(this->watcher, &FSWatcher::added, this, &SafeDaemon::fileAdded);
@@ -125,15 +358,169 @@ QString SafeDaemon::socketPath() {
 
 void SafeDaemon::finishTransfer(const QString &path)
 {
-    if(this->activeTransfers.contains(path)) {
-        this->activeTransfers.take(path)->deleteLater();
-        fetchUsage();
+    if(this->transfers->isActive(path)) {
+        this->transfers->finish(path);
+    }
+}
+
+void SafeDaemon::accountRemote(const QString &path, qint64 size)
+{
+    // before the remote index changes; -1 once the file is gone
+    SafeFileRecord old(this->remoteStateDb->getFile(path));
+    if(!old.id.isEmpty() && old.fingerprint.isNull()) {
+        // what it replaces is of unknown size, so is the difference
+        refreshUsage();
+        return;
+    }
+    qint64 before = old.id.isEmpty() ? 0 : old.fingerprint.size;
+    accountUsage(qMax<qint64>(size, 0) - before);
+}
+
+void SafeDaemon::refreshUsage()
+{
+    // a burst of changes is one request
+    if(!this->usageRefresh->isActive()) {
+        this->usageRefresh->start();
+    }
+}
+
+void SafeDaemon::accountUsage(qint64 delta)
+{
+    this->used_bytes = ulong(qMax<qint64>(qint64(this->used_bytes) + delta, 0));
+    if(delta < 0) {
+        releaseHeldUploads();
+    }
+}
+
+bool SafeDaemon::fitsQuota(const QFileInfo &info)
+{
+    if(this->total_bytes == 0) {
+        return true; // not known yet
+    }
+    SafeFileRecord old(this->remoteStateDb->getFile(relativeFilePath(info)));
+    if(!old.id.isEmpty() && old.fingerprint.isNull()) {
+        // the growth is unknown; the server refuses it if need be and the
+        // usage is fetched again rather than guessed
+        refreshUsage();
+        return true;
+    }
+    qint64 growth = info.size() - (old.id.isEmpty() ? 0 : old.fingerprint.size);
+    return qint64(this->used_bytes) + growth <= qint64(this->total_bytes);
+}
+
+void SafeDaemon::releaseHeldUploads()
+{
+    for(auto it = this->quotaHeld.begin(); it != this->quotaHeld.end();) {
+        QFileInfo info(it.value().filePath());
+        if(!info.exists()) {
+            it = this->quotaHeld.erase(it);
+        } else if(fitsQuota(info)) {
+            qDebug() << "Quota allows" << info.filePath() << "now";
+            it = this->quotaHeld.erase(it);
+            queueUploadFile(info);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void SafeDaemon::storeTransfer(const QString &path, SafeApi *api, QObject *device)
+{
+    this->transfers->attach(path, api, device);
+}
+
+void SafeDaemon::retryLater(SafeRetryEntry::Operation operation, const QString &path,
+                            const QString &arg, quint16 code, const QString &text)
+{
+    // errors during the initial index happen before the queue exists
+    if(this->retries) {
+        this->retries->add(operation, path, arg, code, text);
+    }
+    // no response at all
+    if(code < 100) {
+        setReachable(false);
+    }
+}
+
+bool SafeDaemon::recordOffline(SafeOpEntry::Operation operation, const QString &path,
+                               bool isDir, bool known, const QString &from)
+{
+    if(!this->oplog || (this->online && this->reachable)) {
+        return false;
+    }
+    qDebug() << "Offline, recording change of" << path;
+    this->oplog->record(operation, path, isDir, known, from);
+    // it is the log's now
+    if(this->retries) {
+        this->retries->succeeded(getFilesystemPath() + QDir::separator() + path);
+    }
+    return true;
+}
+
+void SafeDaemon::setReachable(bool reachable)
+{
+    if(this->reachable == reachable) {
+        return;
+    }
+    this->reachable = reachable;
+    if(!reachable) {
+        qWarning() << "Server unreachable, recording local changes";
+        this->probe->start(qMax(this->settings->value("offline_probe", 30).toInt(), 1) * 1000);
+        return;
+    }
+
+    qDebug() << "Server reachable again";
+    this->probe->stop();
+    if(this->oplog && !this->oplog->isEmpty()) {
+        replayOpLog();
     }
 }
 
-void SafeDaemon::storeTransfer(const QString &path, SafeApi *api)
+void SafeDaemon::probeServer()
+{
+    this->apiFactory->call(&SafeApi::getDiskQuotaComplete, [](SafeApi *api){
+        api->getDiskQuota();
+    }, [=](ulong, ulong used_bytes, ulong total_bytes){
+        this->used_bytes = used_bytes;
+        this->total_bytes = total_bytes;
+        setReachable(true);
+    }, [=](quint16 code, const QString &){
+        // any answer means the network is back
+        if(code >= 100) {
+            setReachable(true);
+        }
+    });
+}
+
+void SafeDaemon::replayOpLog()
 {
-    this->activeTransfers.insert(path, api);
+    QList<SafeOpEntry> ops(this->oplog->take());
+    qDebug() << "Replaying" << ops.size() << "offline changes";
+    foreach(SafeOpEntry op, ops) {
+        QFileInfo info(getFilesystemPath() + QDir::separator() + op.path);
+        switch(op.operation) {
+        case SafeOpEntry::Upload:
+            if(info.exists()) {
+                queueUploadFile(info);
+            }
+            break;
+        case SafeOpEntry::Remove:
+            if(op.isDir) {
+                remoteRemoveDir(info);
+            } else {
+                remoteRemoveFile(info);
+            }
+            break;
+        case SafeOpEntry::Move:
+            remoteMove(op.from, info, op.isDir);
+            break;
+        case SafeOpEntry::MakeDir:
+            if(info.isDir()) {
+                this->dirs->ensure(op.path);
+            }
+            break;
+        }
+    }
 }
 
 QString SafeDaemon::getFilesystemPath()
@@ -213,24 +600,34 @@ void SafeDaemon::handleClientConnection()
         for (QJsonObject::ConstIterator i = args.begin(); i != args.end(); ++i) {
             this->settings->setValue(i.key(), i.value().toString());
         }
+        applyRateLimits();
     } else if(type == ACTION_TYPE) {
         QString verb = message["verb"].toString();
+        // answered once the server did, the client may be gone by then
+        QPointer<QLocalSocket> client(socket);
+        auto reply = [=](const QString &file, const QString &link){
+            qDebug() << "Got file:" << file << "link for it:" << link;
+            if(client) {
+                client->write(link.toUtf8());
+                client->flush();
+            }
+        };
         if(verb == "get_public_link") {
             QString file = message["args"].toObject().value("file").toString();
-            QString link = getPublicLink(QFileInfo(file));
-            qDebug() << "Got file:" << file << "link for it:" << link;
-            stream << link;
-            stream.flush();
+            getPublicLink(QFileInfo(file), [=](const QString &link){
+                reply(file, link);
+            });
         } else if (verb == "open_in_browser") {
             QString file = message["args"].toObject().value("file").toString();
-            QString link = getFolderLink(QFileInfo(file));
-            qDebug() << "Got file:" << file << "link for it:" << link;
-            stream << link;
-            stream.flush();
+            getFolderLink(QFileInfo(file), [=](const QString &link){
+                reply(file, link);
+            });
         } else if (verb == "logout") {
             deauthUser();
             this->settings->setValue("login", "");
             this->settings->setValue("password", "");
+            // shared by the daemons of one account only; a new root keeps it
+            this->settings->remove("peer_key");
         } else if (verb == "login") {
             QJsonObject args = message["args"].toObject();
             QString login = args["login"].toString();
@@ -238,10 +635,16 @@ void SafeDaemon::handleClientConnection()
             if (login.length() < 1 || password.length() < 1) {
                 return;
             }
+            if(login != this->settings->value("login", "").toString()) {
+                this->settings->remove("peer_key");
+            }
             this->settings->setValue("login", login);
             this->settings->setValue("password", password);
-            if(this->authUser())
-                init();
+            authUser([this](bool ok){
+                if(ok) {
+                    init();
+                }
+            });
         } else if (verb == "chdir") {
             QString dir = message["args"].toObject().value("dir").toString();
             QFileInfo d(dir);
@@ -250,14 +653,37 @@ void SafeDaemon::handleClientConnection()
                 deauthUser();
                 init();
             }
+        } else if (verb == "sync_now") {
+            QString file = message["args"].toObject().value("file").toString();
+            this->transfers->prioritize(QFileInfo(file).filePath());
         }
     } else if (type == API_CALL_TYPE) {
         // XXX
     } else if (type == NOOP_TYPE) {
         // State variables
         notifyEventQuota(this->used_bytes, this->total_bytes);
-        notifyEventSync(this->activeTransfers.count());
+        notifyEventSync(this->transfers->activeCount());
+        notifyEventTransfers();
+        notifyEventApiPool();
         notifyEventAuth(this->online, this->apiFactory->login());
+        if(this->scrubber) {
+            notifyEventScrub();
+        }
+        if(this->retries) {
+            notifyEventRetries();
+        }
+        if(this->dirs) {
+            notifyEventDirs();
+        }
+        if(this->oplog) {
+            notifyEventOffline();
+        }
+        if(this->trash) {
+            notifyEventTrash();
+        }
+        if(this->peers) {
+            notifyEventPeers();
+        }
 
         if(this->messagesQueue.isEmpty()) {
             QJsonObject obj;
@@ -285,15 +711,22 @@ void SafeDaemon::handleClientConnection()
 
 void SafeDaemon::fetchUsage()
 {
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::getDiskQuotaComplete, [&](ulong id, ulong used_bytes, ulong total_bytes){
+    this->apiFactory->call(&SafeApi::getDiskQuotaComplete, [](SafeApi *api){
+        api->getDiskQuota();
+    }, [=](ulong, ulong used_bytes, ulong total_bytes){
+        // what the local accounting missed, e.g. server side versions
+        if(this->total_bytes > 0) {
+            this->quotaDrift = qint64(used_bytes) - qint64(this->used_bytes);
+            if(this->quotaDrift != 0) {
+                qDebug() << "Quota accounting was off by" << this->quotaDrift << "bytes";
+            }
+        }
         this->used_bytes = used_bytes;
         this->total_bytes = total_bytes;
-    });
-    connect(api, &SafeApi::errorRaised, [](ulong id, quint16 code, QString text){
+        releaseHeldUploads();
+    }, [=](quint16 code, const QString &text){
         qWarning() << "Error fetching quota:" << text << "(" << code << ")";
     });
-    api->getDiskQuota();
 }
 
 void SafeDaemon::notifyEventQuota(ulong used, ulong total)
@@ -302,6 +735,8 @@ void SafeDaemon::notifyEventQuota(ulong used, ulong total)
     QJsonObject values;
     values.insert("used_bytes", (qint64)used);
     values.insert("total_bytes", (qint64)total);
+    values.insert("held_uploads", this->quotaHeld.size());
+    values.insert("last_drift", this->quotaDrift);
 
     obj.insert("type", QString("event"));
     obj.insert("category", QString("disk_quota"));
@@ -335,74 +770,130 @@ void SafeDaemon::notifyEventSync(ulong count)
     this->messagesQueue.append(obj);
 }
 
-QJsonObject SafeDaemon::fetchFileInfo(const QString &id)
+void SafeDaemon::notifyEventScrub()
 {
-    QJsonObject info;
-    QEventLoop loop;
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::getPropsComplete, [&](ulong id, QJsonObject props){
-        info = props.value("object").toObject();
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error fetching info:" << text << "(" << code << ")";
-        loop.exit();
-    });
-
-    api->getProps(id);
-    loop.exec();
-    return info;
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("scrub"));
+    obj.insert("values", this->scrubber->stats());
+    this->messagesQueue.append(obj);
 }
 
-QJsonObject SafeDaemon::fetchDirInfo(const QString &id)
+void SafeDaemon::notifyEventTransfers()
 {
-    QJsonObject info;
-    QEventLoop loop;
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::getPropsComplete, [&](ulong id, QJsonObject props){
-        info = props.value("object").toObject();
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error fetching info:" << text << "(" << code << ")";
-        loop.exit();
-    });
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("transfers"));
+    QJsonObject values(this->transfers->stats());
+    values.insert("local_copies", (qint64)this->localCopies);
+    values.insert("local_copy_bytes", (qint64)this->localCopyBytes);
+    values.insert("remote_copies", (qint64)this->remoteCopies);
+    values.insert("remote_copy_bytes", (qint64)this->remoteCopyBytes);
+    values.insert("unchanged_skips", (qint64)this->unchangedFiles);
+    values.insert("unchanged_bytes", (qint64)this->unchangedBytes);
+    obj.insert("values", values);
+    this->messagesQueue.append(obj);
+}
 
-    api->getProps(id);
-    loop.exec();
-    return info;
+void SafeDaemon::notifyEventApiPool()
+{
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("api_pool"));
+    obj.insert("values", this->apiFactory->stats());
+    this->messagesQueue.append(obj);
 }
 
-void SafeDaemon::prepareTree(const QFileInfo &info, const QString &root)
+void SafeDaemon::notifyEventRetries()
 {
-    qDebug() << "Preparing tree" << info.path() << "root:" << root;
-    QString relative = relativePath(info);
-    QStack<QString> stack;
-    while(relative != root && relative.length() > 1) {
-        QString path(getFilesystemPath() + QDir::separator() + relative);
-        qDebug() << "pushing relative" << relative;
-        stack.push(relative);
-        relative = relativePath(QFileInfo(path));
-        qDebug() << "next relative" << relative;
+    if(!this->retries) {
+        return; // not before the index is complete
     }
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("retries"));
+    obj.insert("values", this->retries->stats());
+    this->messagesQueue.append(obj);
+}
 
-    qDebug() << "relative exit";
+void SafeDaemon::notifyEventDirs()
+{
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("dirs"));
+    QJsonObject values(this->dirs->stats());
+    quint64 lookups = this->dirIdHits + this->dirIdMisses;
+    values.insert("id_hits", (qint64)this->dirIdHits);
+    values.insert("id_misses", (qint64)this->dirIdMisses);
+    values.insert("id_hit_rate", lookups ? double(this->dirIdHits) / lookups : 0.0);
+    obj.insert("values", values);
+    this->messagesQueue.append(obj);
+}
 
-    while(!stack.empty()) {
-        QString relative = stack.pop();
-        QString path(getFilesystemPath() + QDir::separator() + relative);
-        if(!this->remoteStateDb->existsDir(relative)) {
-            QString pid = fetchDirId(relativePath(QFileInfo(path)));
-            qDebug() << "preparing dir" << path << "(" << relative << ")" << "in"
-                     << pid << "(" << relativePath(QFileInfo(path)) << ")";
-            createDir(pid, path);
-        }
-    }
+void SafeDaemon::notifyEventOffline()
+{
+    QJsonObject obj;
+    QJsonObject values;
+    values.insert("offline", !this->reachable);
+    values.insert("pending", this->oplog->size());
+
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("offline"));
+    obj.insert("values", values);
+    this->messagesQueue.append(obj);
+}
+
+void SafeDaemon::notifyEventTrash()
+{
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("trash"));
+    obj.insert("values", this->trash->stats());
+    this->messagesQueue.append(obj);
+}
+
+void SafeDaemon::notifyEventPeers()
+{
+    QJsonObject obj;
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("peers"));
+    QJsonObject values(this->peers->stats());
+    values.insert("wan_bytes_saved", (qint64)this->peerBytes);
+    obj.insert("values", values);
+    this->messagesQueue.append(obj);
+}
+
+void SafeDaemon::notifyEventError(const SafeRetryEntry &entry)
+{
+    static const char *operations[] = { "upload", "download", "remove", "create_dir", "move" };
+    QJsonObject obj;
+    QJsonObject values;
+    values.insert("path", entry.path);
+    values.insert("operation", QString(operations[entry.operation]));
+    values.insert("code", entry.code);
+    values.insert("message", entry.message);
+    values.insert("attempts", entry.attempts);
+
+    obj.insert("type", QString("event"));
+    obj.insert("category", QString("sync_error"));
+    obj.insert("values", values);
+    this->messagesQueue.append(obj);
+}
+
+void SafeDaemon::fetchInfo(const QString &id, std::function<void(const QJsonObject &info)> done)
+{
+    this->apiFactory->call(&SafeApi::getPropsComplete, [=](SafeApi *api){
+        api->getProps(id);
+    }, [=](ulong, QJsonObject props){
+        done(props.value("object").toObject());
+    }, [=](quint16 code, const QString &text){
+        qWarning() << "Error fetching info:" << text << "(" << code << ")";
+        done(QJsonObject());
+    });
 }
 
-QString SafeDaemon::getPublicLink(const QFileInfo &info)
+void SafeDaemon::getPublicLink(const QFileInfo &info, std::function<void(const QString &link)> done)
 {
-    QString objLink;
     QString id;
     if(info.isDir()) {
         id = this->remoteStateDb->getDirId(relativeFilePath(info));
@@ -410,34 +901,32 @@ QString SafeDaemon::getPublicLink(const QFileInfo &info)
         id = this->remoteStateDb->getFileId(relativeFilePath(info));
     }
     if(id.isEmpty()){
-        return QString();
+        done(QString());
+        return;
     }
 
-    QEventLoop loop;
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::publicObjectComplete, [&](ulong id, QString link){
-        objLink = link;
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
+    this->apiFactory->call(&SafeApi::publicObjectComplete, [=](SafeApi *api){
+        api->publicObject(id);
+    }, [=](ulong, QString link){
+        done(link);
+    }, [=](quint16 code, const QString &text){
         qWarning() << "Error getting public link:" << text << "(" << code << ")";
-        loop.exit();
+        done(QString());
     });
-
-    api->publicObject(id);
-    loop.exec();
-    return objLink;
 }
 
-QString SafeDaemon::getFolderLink(const QFileInfo &info)
+void SafeDaemon::getFolderLink(const QFileInfo &info, std::function<void(const QString &link)> done)
 {
-    QString pid(fetchDirId(relativePath(info)));
-    if(pid.isEmpty()){
-        return QString();
-    }
+    QString name(info.fileName());
+    fetchDirId(relativePath(info), [=](const QString &pid){
+        if(pid.isEmpty()){
+            done(QString());
+            return;
+        }
 
-    QString prefix("https://www.2safe.com/web/");
-    return prefix + pid + QDir::separator() + info.fileName();
+        QString prefix("https://www.2safe.com/web/");
+        done(prefix + pid + QDir::separator() + name);
+    });
 }
 
 void SafeDaemon::fileAdded(const QString &path, bool isDir) {
@@ -468,25 +957,37 @@ void SafeDaemon::fileAdded(const QString &path, bool isDir) {
             return;
         }
 
-        QString dirId = createDir(fetchDirId(relative), info.filePath());
         this->localStateDb->removeDir(relativeF);
-        this->localStateDb->insertDir(relativeF, info.dir().dirName(), getMtime(info), dirId);
+        this->localStateDb->insertDir(relativeF, info.dir().dirName(), getMtime(info));
+        if(!recordOffline(SafeOpEntry::MakeDir, relativeF, true, false)) {
+            this->dirs->ensure(relativeF);
+        }
         fullIndex(QDir(path));
         return;
     }
 
     this->localStateDb->removeFile(relativeF);
-    this->localStateDb->insertFile(relative, relativeF, info.fileName(),
-                                   getMtime(info), makeHash(info));
-    this->localStateDb->updateDirHash(relative);
 
-    if(this->remoteStateDb->existsFile(relativeF)){
-        // XXX: check for cause (mtime/hash)
+    // the server may have it already; one pass yields both hashes
+    SafeFingerprint fp(SafeFingerprint::fromPath(info.filePath()));
+    if(mayBeUnchanged(relativeF, fp.size)) {
+        QString hash;
+        QString fhash(makeFastHash(info, &fp, &hash));
+        if(skipUnchanged(info, fp, fhash, hash)) {
+            return;
+        }
+    }
+    if(this->remoteStateDb->existsFile(relativeF)
+            && getMtime(info) <= this->remoteStateDb->getFileMtime(relativeF)) {
+        // the server has newer content
+        indexFile(info);
         return;
     }
 
+    // hash is committed by uploadFile, which reads the file anyway
+    this->localStateDb->insertFile(relative, relativeF, info.fileName(), getMtime(info));
     qDebug() << "File added: " << info.filePath();
-    queueUploadFile(fetchDirId(relative), info);
+    queueUploadFile(info);
 }
 
 void SafeDaemon::fileModified(const QString &path) {
@@ -499,21 +1000,60 @@ void SafeDaemon::fileModified(const QString &path) {
     QString relative(relativePath(info));
     QString relativeF(relativeFilePath(info));
 
-    this->localStateDb->removeFile(relativeF);
-    this->localStateDb->insertFile(relative, relativeF, info.fileName(),
-                                   getMtime(info), makeHash(info));
-    this->localStateDb->updateDirHash(relative);
+    SafeFingerprint fp(SafeFingerprint::fromPath(info.filePath()));
+    if(fp == this->localStateDb->getFileFingerprint(relativeF)) {
+        return; // already indexed in this state (e.g. our own download)
+    }
+
+    // the MD5 is only worth taking along when the server has a file of
+    // this size there; either way the file is read once here
+    QList<SafeChunk> chunks;
+    QString hash;
+    QString *md5 = mayBeUnchanged(relativeF, fp.size) ? &hash : 0;
+    QString fhash(fp.size >= CHUNK_THRESHOLD ? makeManifest(info, &fp, &chunks, md5)
+                                             : makeFastHash(info, &fp, md5));
+    if(!fhash.isEmpty() && fhash == this->localStateDb->getFileFastHash(relativeF)) {
+        // only metadata changed
+        this->localStateDb->setFileFingerprint(relativeF, fp);
+        return;
+    }
 
+    if(skipUnchanged(info, fp, fhash, hash)) {
+        if(!chunks.isEmpty()) {
+            this->localStateDb->setFileChunks(relativeF, chunks);
+        }
+        return;
+    }
     if(this->remoteStateDb->existsFile(relativeF)){
-        // XXX: check for cause (mtime/hash)
-        if(getMtime(info) > this->remoteStateDb->getFileMtime(relativeF)) {
-        } else {
+        // the server has newer content
+        if(getMtime(info) <= this->remoteStateDb->getFileMtime(relativeF)) {
+            this->localStateDb->setFileChunks(relativeF, QList<SafeChunk>());
+            indexFile(info);
             return;
         }
     }
 
+    // the stored manifest describes the last uploaded content
+    if(!chunks.isEmpty()) {
+        QList<SafeByteRange> ranges(SafeChunker::changedRanges(
+                                        this->localStateDb->getFileChunks(relativeF), chunks));
+        qint64 changed = 0;
+        foreach(SafeByteRange range, ranges) {
+            changed += range.length;
+        }
+        qDebug() << "Changed" << ranges.size() << "ranges," << changed << "of" << fp.size << "bytes";
+
+        PendingManifest pending;
+        pending.chunks = chunks;
+        pending.fhash = fhash;
+        pending.fp = fp;
+        this->pendingManifests.insert(path, pending);
+    }
+
+    // hash is committed by uploadFile, which reads the file anyway
+    this->localStateDb->insertFile(relative, relativeF, info.fileName(), getMtime(info));
     qDebug() << "File modified: " << info.filePath();
-    queueUploadFile(fetchDirId(relative), info);
+    queueUploadFile(info);
 }
 
 void SafeDaemon::fileDeleted(const QString &path, bool isDir)
@@ -555,46 +1095,140 @@ void SafeDaemon::fileDeleted(const QString &path, bool isDir)
 void SafeDaemon::fileMoved(const QString &path1, const QString &path2, bool isDir)
 {
     qDebug() << "File moved from" << path1 << "to" << path2;
-    QString relative1(relativeFilePath(path1));
-    QString relative2(relativeFilePath(path2));
-
-    if(this->localStateDb->existsFile(relative2)) {
-        fileModified(path2);
-    } else {
-        // XXX: proper moving without reuploading
-        fileDeleted(path2, isDir);
+    QFileInfo info1(path1);
+    QFileInfo info2(path2);
+    QString relative1(relativeFilePath(info1));
+    QString relative2(relativeFilePath(info2));
+
+    bool tracked1 = isDir ? this->localStateDb->existsDir(relative1)
+                          : this->localStateDb->existsFile(relative1);
+    bool tracked2 = isDir ? this->localStateDb->existsDir(relative2)
+                          : this->localStateDb->existsFile(relative2);
+    if(!tracked1) {
+        // renamed by a remote move already, or never synced
+        if(tracked2) {
+            if(!isDir) {
+                fileModified(path2);
+            }
+            return;
+        }
         fileAdded(path2, isDir);
+        return;
+    }
+    if(!isFileAllowed(info2)) {
+        fileDeleted(path1, isDir);
+        return;
+    }
+
+    // only what the server knows can be moved there; a move over another
+    // tracked file replaces its content, so that one is uploaded again.
+    // Offline the remote index lags behind, the log sorts it out instead
+    QString id(isDir ? this->dirs->idOf(relative1)
+                     : this->remoteStateDb->getFileId(relative1));
+    if((id.isEmpty() && this->reachable) || tracked2) {
+        this->transfers->cancel(path1);
+        fileDeleted(path1, isDir);
+        if(isDir) {
+            fileAdded(path2, true);
+        } else {
+            this->localStateDb->insertFile(relativePath(info2), relative2,
+                                           info2.fileName(), getMtime(info2));
+            queueUploadFile(info2);
+        }
+        return;
     }
 
+    // the local index follows the disk right away, the remote one once the
+    // server agrees. Changes on their way go to the new names: only uploads
+    // are taken along, a download or removal at the old name is cancelled
+    QStringList pending;
+    if(isDir) {
+        pending = this->transfers->jobsUnder(path1, SafeTransferScheduler::Upload);
+    } else if(this->transfers->hasJob(path1, SafeTransferScheduler::Upload)) {
+        pending.append(path1);
+    }
+    this->transfers->cancel(path1);
+    foreach(QString path, pending) {
+        this->transfers->cancel(path);
+    }
     if(isDir) {
-        this->localStateDb->removeDir(relative1);
+        this->localStateDb->moveDir(relative1, relative2);
     } else {
-        this->localStateDb->removeFile(relative1);
+        this->localStateDb->moveFile(relative1, relative2);
+    }
+    QMap<QString, PendingManifest> manifests;
+    for(auto it = this->pendingManifests.begin(); it != this->pendingManifests.end();) {
+        if(it.key() == path1 || (isDir && it.key().startsWith(path1 + "/"))) {
+            manifests.insert(path2 + it.key().mid(path1.length()), it.value());
+            it = this->pendingManifests.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for(auto it = manifests.constBegin(); it != manifests.constEnd(); ++it) {
+        this->pendingManifests.insert(it.key(), it.value());
+    }
+    remoteMove(relative1, info2, isDir);
+    // the moved directory's new name is expected by now, so these wait for it
+    foreach(QString path, pending) {
+        queueUploadFile(QFileInfo(path2 + path.mid(path1.length())));
     }
 }
 
 void SafeDaemon::fileCopied(const QString &path1, const QString &path2)
 {
+    // inotify has no copy event, so copies are told apart by content when
+    // they are uploaded; this is just a new file to the remote side
+    qDebug() << "File copied from" << path1 << "to" << path2;
+    fileAdded(path2, false);
+}
+
+void SafeDaemon::enqueueRemote(std::function<void(Next)> event)
+{
+    this->remoteEvents.enqueue(event);
+    runRemoteEvents();
+}
 
+void SafeDaemon::runRemoteEvents()
+{
+    // in order, each on the state the one before left; a loop rather than
+    // recursion for the events done right away
+    if(this->remoteDraining) {
+        return;
+    }
+    this->remoteDraining = true;
+    while(!this->remoteBusy && !this->remoteEvents.isEmpty()) {
+        this->remoteBusy = true;
+        this->remoteEvents.dequeue()([this](){
+            this->remoteBusy = false;
+            runRemoteEvents();
+        });
+    }
+    this->remoteDraining = false;
 }
 
-void SafeDaemon::remoteFileAdded(QString id, QString pid, QString name)
+void SafeDaemon::remoteFileAdded(QString id, QString pid, QString name, Next done)
 {
     qDebug() << "[REMOTE EVENT] file added:" << name;
     QString dir = this->remoteStateDb->getDirPathById(pid);
     QString path = (dir == QString(QDir::separator()))
             ? name : (dir + QString(QDir::separator()) + name);
-    SafeFile file(fetchFileInfo(id));
-
-    this->remoteStateDb->removeFile(path);
-    this->remoteStateDb->insertFile(dir, path, name, file.mtime, file.chksum, id);
-
-    if(this->localStateDb->existsFile(path)) {
-        return; // wait for cause (mtime, hash)
-    }
-
-    queueDownloadFile(id, getFilesystemPath() + QDir::separator() + path);
-}
+    fetchInfo(id, [=](const QJsonObject &props){
+        SafeFile file(props);
+        SafeFingerprint remote;
+        remote.size = props.value("size").toVariant().toLongLong();
+
+        accountRemote(path, remote.size);
+        this->remoteStateDb->removeFile(path);
+        this->remoteStateDb->insertFile(dir, path, name, file.mtime, file.chksum, id, remote);
+
+        // otherwise wait for cause (mtime, hash)
+        if(!this->localStateDb->existsFile(path)) {
+            queueDownloadFile(id, getFilesystemPath() + QDir::separator() + path);
+        }
+        done();
+    });
+}
 
 void SafeDaemon::remoteFileDeleted(QString id, QString pid, QString name)
 {
@@ -602,42 +1236,45 @@ void SafeDaemon::remoteFileDeleted(QString id, QString pid, QString name)
     QString dir = this->remoteStateDb->getDirPathById(pid);
     QString path = (dir == QString(QDir::separator()))
             ? name : (dir + QString(QDir::separator()) + name);
+    accountRemote(path, -1);
     this->remoteStateDb->removeFile(path);
 
     if(this->localStateDb->existsFile(path)) {
         this->localStateDb->removeFile(path);
-        QFile(getFilesystemPath() + QDir::separator() + path).remove();
+        moveToTrash(QFileInfo(getFilesystemPath() + QDir::separator() + path));
     }
 }
 
-void SafeDaemon::remoteDirectoryCreated(QString id, QString pid, QString name)
+void SafeDaemon::remoteDirectoryCreated(QString id, QString pid, QString name, Next done)
 {
     qDebug() << "[REMOTE EVENT] directory created:" << name;
     QString dir = this->remoteStateDb->getDirPathById(pid);
     QString path = (dir == QString(QDir::separator()))
             ? name : (dir + QString(QDir::separator()) + name);
-    SafeFile info(fetchDirInfo(id));
+    fetchInfo(id, [=](const QJsonObject &props){
+        SafeFile info(props);
 
-    this->remoteStateDb->removeDir(path);
-    this->remoteStateDb->insertDir(path, name, info.mtime, id);
+        this->remoteStateDb->removeDir(path);
+        this->remoteStateDb->insertDir(path, name, info.mtime, id);
 
-    if(this->localStateDb->existsDir(path)) {
-        return;
-    } else {
-        this->localStateDb->insertDir(path, name, info.mtime, id);
-    }
-
-    QString dirPath(getFilesystemPath() + QDir::separator() + path);
-    QDir().mkdir(dirPath);
-    this->watcher->addRecursiveWatch(dirPath);
+        if(!this->localStateDb->existsDir(path)) {
+            this->localStateDb->insertDir(path, name, info.mtime, id);
+            QString dirPath(getFilesystemPath() + QDir::separator() + path);
+            QDir().mkdir(dirPath);
+            this->watcher->addRecursiveWatch(dirPath);
+        }
+        done();
+    });
 }
 
 void SafeDaemon::remoteDirectoryDeleted(QString id, QString pid, QString name)
 {
     qDebug() << "[REMOTE EVENT] directory deleted:" << name;
     QString path(this->remoteStateDb->getDirPathById(id));
-    this->remoteStateDb->removeDirById(id);
-    this->remoteStateDb->removeDirByIdRecursively(id);
+    // by path, the id is gone once the directory row is
+    accountUsage(-this->remoteStateDb->getDirSize(path));
+    this->remoteStateDb->removeDir(path);
+    this->remoteStateDb->removeDirRecursively(path);
 
     if (this->localStateDb->existsDir(path)){
         this->localStateDb->removeDir(path);
@@ -647,12 +1284,20 @@ void SafeDaemon::remoteDirectoryDeleted(QString id, QString pid, QString name)
     if(path.length() > 1) {
         QDir dir(getFilesystemPath() + QDir::separator() + path);
         if (dir.exists()) {
+            QDirIterator it(dir.absolutePath(), QDir::Files, QDirIterator::Subdirectories);
+            while(it.hasNext()) {
+                it.next();
+                if(isFileAllowed(it.fileInfo())) {
+                    moveToTrash(it.fileInfo());
+                }
+            }
             dir.removeRecursively();
         }
     }
 }
 
-void SafeDaemon::remoteFileMoved(QString id, QString pid1, QString n1, QString pid2, QString n2)
+void SafeDaemon::remoteFileMoved(QString id, QString pid1, QString n1, QString pid2, QString n2,
+                                 Next done)
 {
     QString dir1 = this->remoteStateDb->getDirPathById(pid1);
     QString dir2 = this->remoteStateDb->getDirPathById(pid2);
@@ -663,20 +1308,40 @@ void SafeDaemon::remoteFileMoved(QString id, QString pid1, QString n1, QString p
 
     qDebug() << "[REMOTE EVENT] file moved:" << path1 << "to" << path2;
 
-    this->remoteStateDb->removeFileById(id);
+    // the web trash is not indexed, moving there or out of it is a delete
+    // or a restore
+    if(pid2 == TRASH_ID) {
+        remoteFileDeleted(id, pid1, n1);
+        done();
+        return;
+    }
+    if(pid1 == TRASH_ID) {
+        remoteFileAdded(id, pid2, n2, done);
+        return;
+    }
 
+    auto rename = [=](){
+        QDir().rename(getFilesystemPath() + QDir::separator() + path1,
+                      getFilesystemPath() + QDir::separator() + path2);
+        done();
+    };
+    // the id stays, only the path changes; our own moves are already there
+    this->remoteStateDb->moveFile(path1, path2);
     if (this->localStateDb->existsFile(path1)){
-        this->localStateDb->removeFile(path1);
+        this->localStateDb->moveFile(path1, path2);
+    } else if (!this->localStateDb->existsFile(path2)) {
+        fetchInfo(id, [=](const QJsonObject &props){
+            SafeFile file(props);
+            this->localStateDb->insertFile(dir2, path2, file.name, file.mtime, file.chksum, id);
+            rename();
+        });
+        return;
     }
-
-    SafeFile file(fetchFileInfo(id));
-    this->localStateDb->insertFile(dir2, path2, file.name, file.mtime, file.chksum, id);
-
-    QDir().rename(getFilesystemPath() + QDir::separator() + path1,
-                  getFilesystemPath() + QDir::separator() + path2);
+    rename();
 }
 
-void SafeDaemon::remoteDirectoryMoved(QString id, QString pid1, QString n1, QString pid2, QString n2)
+void SafeDaemon::remoteDirectoryMoved(QString id, QString pid1, QString n1, QString pid2, QString n2,
+                                      Next done)
 {
     QString dir1 = this->remoteStateDb->getDirPathById(pid1);
     QString dir2 = this->remoteStateDb->getDirPathById(pid2);
@@ -687,200 +1352,994 @@ void SafeDaemon::remoteDirectoryMoved(QString id, QString pid1, QString n1, QStr
 
     qDebug() << "[REMOTE EVENT] directory moved:" << path1 << "to" << path2;
 
-    this->remoteStateDb->removeDirById(id);
-
+    auto rename = [=](){
+        QDir().rename(getFilesystemPath() + QDir::separator() + path1,
+                      getFilesystemPath() + QDir::separator() + path2);
+        done();
+    };
+    // everything below keeps its id under the new path
+    this->remoteStateDb->moveDir(path1, path2);
     if (this->localStateDb->existsDir(path1)){
-        this->localStateDb->removeDir(path1);
+        this->localStateDb->moveDir(path1, path2);
+    } else if (!this->localStateDb->existsDir(path2)) {
+        fetchInfo(id, [=](const QJsonObject &props){
+            SafeDir info(props);
+            this->localStateDb->insertDir(path2, info.name, info.mtime, id);
+            rename();
+        });
+        return;
     }
-
-    SafeDir info(fetchDirInfo(id));
-    this->localStateDb->insertDir(path2, info.name, info.mtime, id);
-
-    QDir().rename(getFilesystemPath() + QDir::separator() + path1,
-                  getFilesystemPath() + QDir::separator() + path2);
-}
-
-QString SafeDaemon::createDir(const QString &parent_id, const QString &path)
-{
-    QEventLoop loop;
-    QString dirId;
-
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::makeDirComplete, [&](ulong id, ulong dir_id){
-        qDebug() << "Created remote directory:" << dir_id << "in" << parent_id;
-        dirId = dir_id;
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error creating dir:" << text << "(" << code << ")";
-        loop.exit();
-    });
-
-    api->makeDir(parent_id, QDir(path).dirName());
-    loop.exec();
-    return dirId;
+    rename();
 }
 
 void SafeDaemon::remoteRemoveDir(const QFileInfo &info)
 {
-    QEventLoop loop;
+    QString path(info.filePath());
     QString relative(relativeFilePath(info));
     QString id(this->remoteStateDb->getDirId(relative));
+    if(recordOffline(SafeOpEntry::Remove, relative, true, !id.isEmpty())) {
+        return;
+    }
     if(id.isEmpty()) {
         qWarning() << "Directory" << relative << "isn't exists in the remote index";
         return;
     }
 
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::removeDirComplete, [&](ulong id){
-        qDebug() << "Remote directory deleted:" << relative;
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error deleting remote dir:" << text << "(" << code << ")";
-        loop.exit();
-    });
+    // a job like any other removal, what is queued below it goes first
+    this->transfers->enqueue(path, SafeTransferScheduler::Remove, 0, [=](){
+        this->transfers->acquire(path, [=](SafeApi *api){
+            connect(api, &SafeApi::removeDirComplete, [=](ulong){
+                qDebug() << "Remote directory deleted:" << relative;
+                if(this->retries) {
+                    this->retries->succeeded(path);
+                }
+                finishTransfer(path);
+            });
+            connect(api, &SafeApi::errorRaised, [=](ulong, quint16 code, QString text){
+                qWarning() << "Error deleting remote dir:" << text << "(" << code << ")";
+                retryLater(SafeRetryEntry::Remove, path, id, code, text);
+                finishTransfer(path);
+            });
+            api->removeDir(id, true, true);
+        });
+    }, 0);
+}
 
-    api->removeDir(id, true, true);
-    loop.exec();
+void SafeDaemon::queueUploadFile(const QFileInfo &info)
+{
+    QString relativeF(relativeFilePath(info));
+    if(recordOffline(SafeOpEntry::Upload, relativeF, false,
+                     !this->remoteStateDb->getFileId(relativeF).isEmpty())) {
+        return;
+    }
+
+    // held back only by its own directory
+    this->dirs->ensure(relativePath(info), [=](const QString &dir_id){
+        // a job of its own would cancel the move to this path, so it follows it
+        if(this->transfers->hasJob(info.filePath(), SafeTransferScheduler::Move)) {
+            qDebug() << "Holding" << info.filePath() << "until it is moved there";
+            this->uploadsAfterMove.insert(info.filePath(), info);
+            return;
+        }
+        this->uploadsAfterMove.remove(info.filePath());
+        this->transfers->enqueue(info.filePath(), SafeTransferScheduler::Upload, info.size(), [=](){
+            uploadFile(dir_id, info);
+        });
+    });
 }
 
-void SafeDaemon::queueUploadFile(const QString &dir_id, const QFileInfo &info)
+void SafeDaemon::uploadFile(const QString &dir_id, const QFileInfo &info, bool reuse)
 {
-    QTimer *timer = new QTimer(this);
     QString path(info.filePath());
+    if(uploadDelta(info)) {
+        return;
+    }
+    // certain to be refused, so it waits for space instead
+    if(!fitsQuota(info)) {
+        qWarning() << "Not enough quota for" << path << ", holding it back";
+        this->quotaHeld.insert(path, info);
+        return;
+    }
 
-    timer->setInterval(2000);
-    timer->setSingleShot(true);
-    timer->setTimerType(Qt::VeryCoarseTimer);
+    // content the server already has is copied there. The file is only
+    // read for that here when the server has something of its size,
+    // otherwise the upload hashes it on the way. A file of the size of one
+    // on its way from another path waits for it, it is likely a copy
+    SafeFingerprint fp(SafeFingerprint::fromPath(path));
+    bool dedupe = reuse && fp.size >= COPY_THRESHOLD;
+    if(dedupe) {
+        QString hash(SafeHashCache::lookup(path, "md5", fp));
+        if(hash.isEmpty() && this->remoteStateDb->existsHashedFile(fp.size, relativeFilePath(info))) {
+            hash = makeHash(info, &fp);
+        }
+        if(!hash.isEmpty() && uploadCopy(dir_id, info, hash, fp)) {
+            return;
+        }
+        QString other(this->uploadingSizes.value(fp.size));
+        if(!other.isEmpty() && other != path) {
+            qDebug() << "Holding" << path << "until" << other << "is up";
+            this->parkedUploads.insert(fp.size, info);
+            return;
+        }
+    }
 
-    bool active = this->activeTransfers.contains(path);
-    if(active) {
-        finishTransfer(path);
+    // a target taking ranges lets an interrupted upload go on where it was
+    if(this->resumeTarget) {
+        SafeChunkedTransfer *upload = uploadResumable(info);
+        if(upload && dedupe) {
+            trackUploading(upload, fp.size, path);
+        }
+        return;
     }
 
-    connect(timer, &QTimer::timeout, [=](){
-        uploadFile(dir_id, info);
-    });
+    auto source = new SafeUploadSource(path, this);
+    source->setRateLimiter(this->uploadLimiter);
+    if(!source->open(QIODevice::ReadOnly)) {
+        qWarning() << "Unable to read" << path << "for upload";
+        delete source;
+        return;
+    }
 
-    bool queued = this->pendingTransfers.contains(path);
-    if(queued) {
-        this->pendingTransfers[path]->stop();
-        this->pendingTransfers.take(path)->deleteLater();
+    if(dedupe) {
+        trackUploading(source, fp.size, path);
     }
-    this->pendingTransfers.insert(path, timer);
-    timer->start();
+
+    // pushFile has no resume, an interrupted upload is only restarted
+    SafeJournalEntry entry;
+    entry.path = relativeFilePath(info);
+    entry.direction = SafeJournalEntry::Upload;
+    entry.size = source->size();
+    entry.mtime = getMtime(info);
+    this->localStateDb->journalTransfer(entry);
+
+    // goes with the job if it is cancelled while waiting for a client
+    storeTransfer(path, 0, source);
+    this->transfers->acquire(path, [=](SafeApi *api){
+        connect(api, &SafeApi::pushFileProgress, [=](ulong id, ulong bytes, ulong totalBytes){
+            qDebug() << "U/Progress:" << bytes << "/" << totalBytes;
+        });
+        connect(api, &SafeApi::pushFileComplete, [=, this](ulong id, SafeFile fileInfo) {
+            qDebug() << "New file uploaded:" << fileInfo.name;
+            this->localStateDb->removeTransfer(relativeFilePath(info));
+            QString hash(source->hash());
+            if(hash.isEmpty() || (!fileInfo.chksum.isEmpty() && fileInfo.chksum != hash)) {
+                // changed while uploading; the next close event queues it again
+                qWarning() << "File changed during upload, not indexing:" << path;
+            } else {
+                SafeFingerprint fp(SafeHashCache::store(path, "md5", hash, source->fingerprint()));
+                fp = SafeHashCache::store(path, "xxh3", source->fastHash(), fp);
+                this->localStateDb->insertFile(relativePath(info), relativeFilePath(info),
+                                               info.fileName(), getMtime(info), hash,
+                                               fileInfo.id, fp);
+                this->localStateDb->setFileFastHash(relativeFilePath(info), source->fastHash());
+                this->localStateDb->setFileChunks(relativeFilePath(info), source->chunks());
+                this->localStateDb->updateDirHash(relativePath(info));
+                // known to the server now, copies need not wait for the remote event
+                SafeFingerprint remote;
+                remote.size = source->size();
+                accountRemote(relativeFilePath(info), remote.size);
+                this->remoteStateDb->insertFile(relativePath(info), relativeFilePath(info),
+                                                info.fileName(), getMtime(info), hash, fileInfo.id,
+                                                remote);
+                if(this->deltaTarget && !source->chunks().isEmpty()) {
+                    this->deltaTarget->seed(relativeFilePath(info), path);
+                }
+            }
+            this->pendingManifests.remove(path);
+            if(this->retries) {
+                this->retries->succeeded(path);
+            }
+            finishTransfer(path);
+        });
+        connect(api, &SafeApi::errorRaised, [=](ulong id, quint16 code, QString text){
+            qWarning() << "Error uploading:" << text << "(" << code << ")";
+            retryLater(SafeRetryEntry::Upload, path, QString(), code, text);
+            finishTransfer(path);
+        });
+
+        api->pushFile(dir_id, source, info.fileName(), true);
+    });
 }
 
-void SafeDaemon::uploadFile(const QString &dir_id, const QFileInfo &info)
+void SafeDaemon::trackUploading(QObject *transfer, qint64 size, const QString &path)
 {
-    QString path(info.filePath());
-    auto api = this->apiFactory->newApi();
-
-    connect(api, &SafeApi::pushFileProgress, [=](ulong id, ulong bytes, ulong totalBytes){
-        qDebug() << "U/Progress:" << bytes << "/" << totalBytes;
+    this->uploadingSizes.insert(size, path);
+    // however the upload ends, the scheduler deletes its transfer; once it
+    // is indexed remotely the waiting ones are hashed against it
+    connect(transfer, &QObject::destroyed, this, [=](){
+        if(this->uploadingSizes.value(size) == path) {
+            this->uploadingSizes.remove(size);
+        }
+        foreach(QFileInfo parked, this->parkedUploads.values(size)) {
+            queueUploadFile(parked);
+        }
+        this->parkedUploads.remove(size);
     });
-    connect(api, &SafeApi::pushFileComplete, [=, this](ulong id, SafeFile fileInfo) {
-        qDebug() << "New file uploaded:" << fileInfo.name;
-        finishTransfer(path);
+}
+
+SafeChunkedTransfer *SafeDaemon::uploadResumable(const QFileInfo &info)
+{
+    QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    auto upload = new SafeChunkedTransfer(this->resumeTarget, relativeF, path, this);
+    upload->setRateLimiter(this->uploadLimiter);
+
+    // the same version of the file goes on from what both sides agree on
+    SafeJournalEntry entry(this->localStateDb->getTransfer(relativeF));
+    qint64 offset = 0;
+    if(entry.direction == SafeJournalEntry::Upload && entry.size == info.size()
+            && entry.mtime == getMtime(info)) {
+        offset = qMin(entry.offset, this->resumeTarget->offset(relativeF));
+    }
+    if(!upload->start(offset)) {
+        qWarning() << "Unable to read" << path << "for upload";
+        delete upload;
+        return 0;
+    }
+    entry = SafeJournalEntry();
+    entry.path = relativeF;
+    entry.direction = SafeJournalEntry::Upload;
+    entry.size = info.size();
+    entry.mtime = getMtime(info);
+    entry.offset = upload->startedAt();
+    this->localStateDb->journalTransfer(entry);
+
+    connect(upload, &SafeChunkedTransfer::progress, this, [=](qint64 offset){
+        this->localStateDb->setTransferOffset(relativeF, offset);
     });
-    connect(api, &SafeApi::errorRaised, [=](ulong id, quint16 code, QString text){
-        qWarning() << "Error uploading:" << text << "(" << code << ")";
+    connect(upload, &SafeChunkedTransfer::finished, this, [=](bool ok){
+        if(!ok) {
+            // the journal keeps where it was for the next attempt
+            qWarning() << "Upload of" << path << "broken off";
+            retryLater(SafeRetryEntry::Upload, path, QString(), 0, "Upload broken off");
+            finishTransfer(path);
+            return;
+        }
+        qDebug() << "File uploaded:" << path;
+        this->localStateDb->removeTransfer(relativeF);
+        SafeUploadSource *source = upload->uploadSource();
+        QString hash(source->hash());
+        SafeFingerprint fp(SafeHashCache::store(path, "md5", hash, source->fingerprint()));
+        fp = SafeHashCache::store(path, "xxh3", source->fastHash(), fp);
+        this->localStateDb->insertFile(relativePath(info), relativeF, info.fileName(),
+                                       getMtime(info), hash,
+                                       this->remoteStateDb->getFileId(relativeF), fp);
+        this->localStateDb->setFileFastHash(relativeF, source->fastHash());
+        this->localStateDb->setFileChunks(relativeF, source->chunks());
+        this->localStateDb->updateDirHash(relativePath(info));
+        this->pendingManifests.remove(path);
+        if(this->retries) {
+            this->retries->succeeded(path);
+        }
         finishTransfer(path);
     });
-
-    this->activeTransfers[path] = api;
-    api->pushFile(dir_id, path, info.fileName(), true);
+    storeTransfer(path, 0, upload);
+    return upload;
 }
 
-void SafeDaemon::queueDownloadFile(const QString &id, const QFileInfo &info)
+bool SafeDaemon::uploadCopy(const QString &dir_id, const QFileInfo &info, const QString &hash,
+                            const SafeFingerprint &fp)
 {
-    QTimer *timer = new QTimer(this);
     QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    // a copy lands next to an object of the same name instead of replacing it
+    if(!this->remoteStateDb->getFileId(relativeF).isEmpty()) {
+        return false;
+    }
+    QString other(this->remoteStateDb->findFile(hash, relativeF));
+    if(other.isEmpty()) {
+        return false;
+    }
+    QString id(this->remoteStateDb->getFileId(other));
+
+    this->transfers->acquire(path, [=](SafeApi *api){
+        connect(api, &SafeApi::copyFileComplete, [=, this](ulong, SafeFile fileInfo) {
+            qDebug() << "Copied" << other << "to" << relativeF << "on the server";
+            ++this->remoteCopies;
+            this->remoteCopyBytes += fp.size;
+            SafeFingerprint remote;
+            remote.size = fp.size;
+            accountRemote(relativeF, remote.size);
+            this->remoteStateDb->insertFile(relativePath(info), relativeF, info.fileName(),
+                                            getMtime(info), hash, fileInfo.id, remote);
+            // the hash was taken before the copy; if the file changed since,
+            // its next close event queues it again
+            if(SafeFingerprint::fromPath(path) == fp) {
+                this->localStateDb->insertFile(relativePath(info), relativeF, info.fileName(),
+                                               getMtime(info), hash, fileInfo.id, fp);
+                this->localStateDb->setFileFastHash(relativeF,
+                                                    SafeHashCache::lookup(path, "xxh3", fp));
+                this->localStateDb->updateDirHash(relativePath(info));
+            } else {
+                qWarning() << "File changed during copy, not indexing:" << path;
+            }
+            if(this->retries) {
+                this->retries->succeeded(path);
+            }
+            finishTransfer(path);
+        });
+        connect(api, &SafeApi::errorRaised, [=](ulong, quint16 code, QString text){
+            // the bytes are here, so the copy is only a shortcut
+            qWarning() << "Error copying:" << text << "(" << code << "), uploading instead";
+            finishTransfer(path);
+            this->transfers->enqueue(path, SafeTransferScheduler::Upload, info.size(), [=](){
+                uploadFile(dir_id, info, false);
+            }, 0);
+        });
+
+        api->copyFile(id, dir_id, info.fileName());
+    });
+    return true;
+}
 
-    timer->setInterval(2000);
-    timer->setSingleShot(true);
-    timer->setTimerType(Qt::VeryCoarseTimer);
+bool SafeDaemon::uploadDelta(const QFileInfo &info)
+{
+    QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    if(!this->deltaTarget || !this->pendingManifests.contains(path)) {
+        return false;
+    }
 
-    bool active = this->activeTransfers.contains(path);
-    if(active) {
-        finishTransfer(path);
+    PendingManifest pending(this->pendingManifests.take(path));
+    QList<SafeChunk> old(this->localStateDb->getFileChunks(relativeF));
+    SafeFingerprint now(SafeFingerprint::fromPath(path));
+    if(old.isEmpty() || now.size != pending.fp.size || now.mtime_ns != pending.fp.mtime_ns) {
+        return false;
+    }
+    if(!this->deltaTarget->push(relativeF, path, old, pending.chunks)) {
+        return false;
     }
 
-    connect(timer, &QTimer::timeout, [=](){
+    this->localStateDb->insertFile(relativePath(info), relativeF, info.fileName(),
+                                   getMtime(info), QString(),
+                                   this->remoteStateDb->getFileId(relativeF), now);
+    this->localStateDb->setFileFastHash(relativeF, pending.fhash);
+    this->localStateDb->setFileChunks(relativeF, pending.chunks);
+    this->localStateDb->updateDirHash(relativePath(info));
+    return true;
+}
+
+void SafeDaemon::queueDownloadFile(const QString &id, const QFileInfo &info)
+{
+    qint64 size = this->remoteStateDb->getFileFingerprint(relativeFilePath(info)).size;
+    this->transfers->enqueue(info.filePath(), SafeTransferScheduler::Download, size, [=](){
         downloadFile(id, info);
     });
+}
+
+void SafeDaemon::downloadFile(const QString &id, const QFileInfo &info)
+{
+    QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    QString chksum(this->remoteStateDb->getFileHashById(id));
+    ulong mtime(this->remoteStateDb->getFileMtimeById(id));
+    qint64 size(this->remoteStateDb->getFileFingerprint(relativeF).size);
+    auto sink = new SafeDownloadSink(path, size, this);
+
+    // only what isn't here already is downloaded
+    if(takeFromTrash(sink, chksum, mtime) || cloneLocalCopy(sink, chksum, mtime, info)) {
+        indexDownload(sink, id, mtime, info);
+        if(this->retries) {
+            this->retries->succeeded(path);
+        }
+        delete sink;
+        return;
+    }
 
-    bool queued = this->pendingTransfers.contains(path);
-    if(queued) {
-        this->pendingTransfers[path]->stop();
-        this->pendingTransfers.take(path)->deleteLater();
+    // then from a daemon of this account nearby, unless a download is half
+    // way through already
+    SafeJournalEntry entry(this->localStateDb->getTransfer(relativeF));
+    bool partial = entry.direction == SafeJournalEntry::Download && entry.id == id
+            && entry.offset > 0;
+    if(this->peers && !partial && !chksum.isEmpty() && this->peers->hasPeers()
+            && sink->open(QIODevice::WriteOnly)) {
+        QObject *fetch = this->peers->fetch(chksum, size, sink, [=](bool ok){
+            if(ok && sink->commit(chksum, mtime)) {
+                this->peerBytes += QFileInfo(path).size();
+                indexDownload(sink, id, mtime, info);
+                if(this->retries) {
+                    this->retries->succeeded(path);
+                }
+                finishTransfer(path);
+                return;
+            }
+            qDebug() << "No peer had" << path << "intact, downloading it";
+            sink->abort();
+            // the attempt deletes itself
+            storeTransfer(path, 0);
+            downloadFromServer(id, info);
+        });
+        // goes with the attempt if the transfer is cancelled
+        sink->setParent(fetch);
+        storeTransfer(path, 0, fetch);
+        return;
     }
-    this->pendingTransfers.insert(path, timer);
-    timer->start();
+    delete sink;
+    downloadFromServer(id, info);
 }
 
-void SafeDaemon::downloadFile(const QString &id, const QFileInfo &info)
+void SafeDaemon::downloadFromServer(const QString &id, const QFileInfo &info)
 {
     QString path(info.filePath());
-    auto api = this->apiFactory->newApi();
+    QString relativeF(relativeFilePath(info));
+    QString chksum(this->remoteStateDb->getFileHashById(id));
+    ulong mtime(this->remoteStateDb->getFileMtimeById(id));
+    qint64 size(this->remoteStateDb->getFileFingerprint(relativeF).size);
+    if(this->resumeTarget && downloadResumable(id, info)) {
+        return;
+    }
+    auto sink = new SafeDownloadSink(path, size, this);
 
-    connect(api, &SafeApi::pullFileProgress, [=](ulong id, ulong bytes, ulong totalBytes){
-        qDebug() << "D/Progress:" << bytes << "/" << totalBytes;
-    });
-    connect(api, &SafeApi::pullFileComplete, [=, this](ulong id) {
-        qDebug() << "File downloaded:" << path;
+    if(!sink->open(QIODevice::WriteOnly)) {
+        delete sink;
+        // after a peer attempt the job is still waiting for it
         finishTransfer(path);
-        QString file_id = this->remoteStateDb->getFileId(relativeFilePath(info));
-        this->localStateDb->insertFile(relativePath(info), relativeFilePath(info),
-                                       info.fileName(), getMtime(info), makeHash(info), file_id);
+        return;
+    }
+    // pullFile has no range, an interrupted download is only restarted
+    SafeJournalEntry entry;
+    entry.path = relativeF;
+    entry.direction = SafeJournalEntry::Download;
+    entry.id = id;
+    entry.hash = chksum;
+    entry.size = size;
+    entry.mtime = mtime;
+    this->localStateDb->journalTransfer(entry);
+
+    storeTransfer(path, 0, sink);
+    this->transfers->acquire(path, [=](SafeApi *api){
+        connect(api, &SafeApi::pullFileProgress, [=](ulong id, ulong bytes, ulong totalBytes){
+            qDebug() << "D/Progress:" << bytes << "/" << totalBytes;
+        });
+        connect(api, &SafeApi::pullFileComplete, [=, this](ulong) {
+            qDebug() << "File downloaded:" << path;
+            // verified, stamped with the remote mtime and moved into place
+            this->localStateDb->removeTransfer(relativeF);
+            if(!sink->commit(chksum, mtime)) {
+                finishTransfer(path);
+                return;
+            }
+            if(this->retries) {
+                this->retries->succeeded(path);
+            }
+            indexDownload(sink, id, mtime, info);
+            finishTransfer(path);
+        });
+        connect(api, &SafeApi::errorRaised, [=](ulong, quint16 code, QString text){
+            qWarning() << "Error downloading:" << text << "(" << code << ")";
+            sink->abort();
+            retryLater(SafeRetryEntry::Download, path, id, code, text);
+            finishTransfer(path);
+        });
+
+        api->pullFile(id, sink);
+        // the client has this one request in flight
+        foreach(QNetworkReply *reply, api->findChildren<QNetworkReply *>()) {
+            if(!reply->isFinished()) {
+                new SafeReplyThrottle(reply, this->downloadLimiter);
+            }
+        }
+    });
+}
+
+bool SafeDaemon::downloadResumable(const QString &id, const QFileInfo &info)
+{
+    QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    QString chksum(this->remoteStateDb->getFileHashById(id));
+    ulong mtime(this->remoteStateDb->getFileMtimeById(id));
+    qint64 size(this->remoteStateDb->getFileFingerprint(relativeF).size);
+    if(size < 0 || this->resumeTarget->size(relativeF) != size) {
+        return false; // not the version the target has
+    }
+    auto download = new SafeChunkedTransfer(this->resumeTarget, relativeF,
+                                            new SafeDownloadSink(path, size), this);
+    download->setRateLimiter(this->downloadLimiter);
+
+    // a part file of the same remote version is continued
+    SafeJournalEntry entry(this->localStateDb->getTransfer(relativeF));
+    bool same = entry.direction == SafeJournalEntry::Download
+            && entry.id == id && entry.hash == chksum;
+    if(!download->start(same ? entry.offset : 0)) {
+        delete download;
+        return false;
+    }
+    entry = SafeJournalEntry();
+    entry.path = relativeF;
+    entry.direction = SafeJournalEntry::Download;
+    entry.id = id;
+    entry.hash = chksum;
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.offset = download->startedAt();
+    this->localStateDb->journalTransfer(entry);
+
+    connect(download, &SafeChunkedTransfer::progress, this, [=](qint64 offset){
+        this->localStateDb->setTransferOffset(relativeF, offset);
     });
-    connect(api, &SafeApi::errorRaised, [=](ulong id, quint16 code, QString text){
-        qWarning() << "Error downloading:" << text << "(" << code << ")";
+    connect(download, &SafeChunkedTransfer::finished, this, [=](bool ok){
+        if(!ok) {
+            // the part file and the journal are kept for the next attempt
+            retryLater(SafeRetryEntry::Download, path, id, 0, "Download broken off");
+            finishTransfer(path);
+            return;
+        }
+        qDebug() << "File downloaded:" << path;
+        // the whole file is verified, not only what came after a resume
+        this->localStateDb->removeTransfer(relativeF);
+        SafeDownloadSink *sink = download->downloadSink();
+        if(!sink->commit(chksum, mtime)) {
+            finishTransfer(path);
+            return;
+        }
+        if(this->retries) {
+            this->retries->succeeded(path);
+        }
+        indexDownload(sink, id, mtime, info);
         finishTransfer(path);
     });
+    storeTransfer(path, 0, download);
+    return true;
+}
+
+bool SafeDaemon::cloneLocalCopy(SafeDownloadSink *sink, const QString &chksum, ulong mtime,
+                                const QFileInfo &info)
+{
+    QString relativeF(relativeFilePath(info));
+    QString other(chksum.isEmpty() ? QString()
+                                   : findLocalContent(chksum,
+                                                      this->remoteStateDb->getFileFingerprint(relativeF).size,
+                                                      relativeF));
+    if(other.isEmpty()) {
+        return false;
+    }
+    QString source(getFilesystemPath() + QDir::separator() + other);
+    if(!sink->cloneFrom(source) || !sink->commit(chksum, mtime)) {
+        return false;
+    }
+
+    ++this->localCopies;
+    this->localCopyBytes += QFileInfo(info.filePath()).size();
+    qDebug() << "Took" << relativeF << "from local" << other;
+    return true;
+}
+
+bool SafeDaemon::takeFromTrash(SafeDownloadSink *sink, const QString &chksum, ulong mtime)
+{
+    QString source(this->trash && !chksum.isEmpty() ? this->trash->take(chksum) : QString());
+    if(source.isEmpty()) {
+        return false;
+    }
+    if(!sink->adopt(source) || !sink->commit(chksum, mtime)) {
+        QFile(source).remove();
+        return false;
+    }
+    return true;
+}
 
-    this->activeTransfers[path] = api;
-    api->pullFile(id, path);
+void SafeDaemon::moveToTrash(const QFileInfo &info)
+{
+    QString path(info.filePath());
+    if(!info.exists()) {
+        return;
+    }
+    QString hash(makeHash(info));
+    if(!this->trash || !this->trash->put(path, hash)) {
+        QFile(path).remove();
+    }
+}
+
+void SafeDaemon::indexDownload(SafeDownloadSink *sink, const QString &id, ulong mtime,
+                               const QFileInfo &info)
+{
+    QString path(info.filePath());
+    QString relativeF(relativeFilePath(info));
+    SafeFingerprint fp(SafeHashCache::store(path, "md5", sink->hash(),
+                                            SafeFingerprint::fromPath(path)));
+    fp = SafeHashCache::store(path, "xxh3", sink->fastHash(), fp);
+    this->localStateDb->insertFile(relativePath(info), relativeF,
+                                   info.fileName(), mtime, sink->hash(), id, fp);
+    this->localStateDb->setFileFastHash(relativeF, sink->fastHash());
+    this->localStateDb->updateDirHash(relativePath(info));
 }
 
 void SafeDaemon::remoteRemoveFile(const QFileInfo &info)
 {
     QString path(info.filePath());
-    finishTransfer(path);
     QString id(this->remoteStateDb->getFileId(relativeFilePath(info)));
+    if(recordOffline(SafeOpEntry::Remove, relativeFilePath(info), false, !id.isEmpty())) {
+        this->transfers->cancel(path);
+        return;
+    }
     if(id.isEmpty()) {
+        // never uploaded, just drop what is queued for it
+        this->transfers->cancel(path);
         qWarning() << "File" << relativeFilePath(info) << "isn't exists in the remote index";
         return;
     }
 
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::removeFileComplete, [=, this](ulong id){
-        qDebug() << "Remote file deleted" << path;
-        finishTransfer(path);
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error deleting:" << text << "(" << code << ")";
-        finishTransfer(path);
+    this->transfers->enqueue(path, SafeTransferScheduler::Remove, 0, [=](){
+        this->transfers->acquire(path, [=](SafeApi *api){
+            connect(api, &SafeApi::removeFileComplete, [=, this](ulong id){
+                qDebug() << "Remote file deleted" << path;
+                if(this->retries) {
+                    this->retries->succeeded(path);
+                }
+                finishTransfer(path);
+            });
+            connect(api, &SafeApi::errorRaised, [=](ulong, quint16 code, QString text){
+                qWarning() << "Error deleting:" << text << "(" << code << ")";
+                retryLater(SafeRetryEntry::Remove, path, id, code, text);
+                finishTransfer(path);
+            });
+            api->removeFile(id, true);
+        });
+    }, 0);
+}
+
+void SafeDaemon::remoteMove(const QString &from, const QFileInfo &info, bool isDir)
+{
+    QString path(info.filePath());
+    QString to(relativeFilePath(info));
+    QString id(isDir ? this->dirs->idOf(from)
+                     : this->remoteStateDb->getFileId(from));
+    if(recordOffline(SafeOpEntry::Move, to, isDir, !id.isEmpty(), from)) {
+        return;
+    }
+    if(id.isEmpty()) {
+        qWarning() << from << "isn't exists in the remote index";
+        return;
+    }
+    if(isDir) {
+        // what goes into it meanwhile must not make a new one
+        this->dirs->expectMove(from, to);
+    }
+
+    this->dirs->ensure(relativePath(info), [=](const QString &dir_id){
+        // an upload to the new path is cancelled by the move and goes after it
+        if(this->transfers->hasJob(path, SafeTransferScheduler::Upload)) {
+            this->uploadsAfterMove.insert(path, info);
+        }
+        this->transfers->enqueue(path, SafeTransferScheduler::Move, 0, [=](){
+            this->transfers->acquire(path, [=](SafeApi *api){
+                auto next = [=](){
+                    finishTransfer(path);
+                    if(this->uploadsAfterMove.contains(path)) {
+                        queueUploadFile(this->uploadsAfterMove.take(path));
+                    }
+                };
+                auto complete = [=](ulong) {
+                    qDebug() << "Remote object moved:" << from << "to" << to;
+                    if(isDir) {
+                        this->remoteStateDb->moveDir(from, to);
+                    } else {
+                        this->remoteStateDb->moveFile(from, to);
+                    }
+                    if(this->retries) {
+                        this->retries->succeeded(path);
+                    }
+                    next();
+                };
+                connect(api, &SafeApi::moveFileComplete, complete);
+                connect(api, &SafeApi::moveDirComplete, complete);
+                connect(api, &SafeApi::errorRaised, [=](ulong, quint16 code, QString text){
+                    qWarning() << "Error moving:" << text << "(" << code << ")";
+                    retryLater(SafeRetryEntry::Move, path, from, code, text);
+                    next();
+                });
+                if(isDir) {
+                    api->moveDir(id, dir_id, info.fileName());
+                } else {
+                    api->moveFile(id, dir_id, info.fileName());
+                }
+            });
+        }, 0);
     });
+}
+
+void SafeDaemon::resumeTransfers()
+{
+    foreach(SafeJournalEntry entry, this->localStateDb->getTransfers()) {
+        QFileInfo info(getFilesystemPath() + QDir::separator() + entry.path);
+        if(entry.direction == SafeJournalEntry::Download) {
+            if(!this->remoteStateDb->existsFileById(entry.id)) {
+                QFile(SafeDownloadSink::partPathFor(info.filePath())).remove();
+                this->localStateDb->removeTransfer(entry.path);
+                continue;
+            }
+            qDebug() << "Resuming download of" << entry.path << "at" << entry.offset;
+            queueDownloadFile(entry.id, info);
+        } else {
+            if(!info.exists()) {
+                this->localStateDb->removeTransfer(entry.path);
+                continue;
+            }
+            qDebug() << "Resuming upload of" << entry.path << "at" << entry.offset;
+            queueUploadFile(info);
+        }
+    }
+}
+
+void SafeDaemon::restoreFile(const QString &path)
+{
+    // the index is what was synced, so the server copy is the good one
+    QFileInfo info(path);
+    QString id(this->remoteStateDb->getFileId(relativeFilePath(info)));
+    if(id.isEmpty()) {
+        qWarning() << "No remote copy to restore" << path << "from";
+        return;
+    }
+    qDebug() << "Restoring" << path;
+    queueDownloadFile(id, info);
+}
+
+void SafeDaemon::reconcileFile(const QString &path)
+{
+    QFileInfo info(path);
+    QString relativeF(relativeFilePath(info));
+    QString id(this->remoteStateDb->getFileId(relativeF));
+    if(!id.isEmpty() && this->remoteStateDb->getFileMtime(relativeF)
+            > this->localStateDb->getFileMtime(relativeF)) {
+        queueDownloadFile(id, info);
+    } else {
+        queueUploadFile(info);
+    }
+}
 
-    this->activeTransfers.insert(path, api);
-    api->removeFile(id, true);
+void SafeDaemon::retryOperation(const SafeRetryEntry &entry)
+{
+    QFileInfo info(entry.path);
+    QString relativeF(relativeFilePath(info));
+    if(this->transfers->isActive(entry.path)) {
+        // whatever runs now reports back to the queue itself
+        return;
+    }
+
+    // the world may have moved on since the failure, so each operation is
+    // only repeated while it still makes sense
+    switch(entry.operation) {
+    case SafeRetryEntry::Upload:
+        if(info.exists()) {
+            queueUploadFile(info);
+            return;
+        }
+        break;
+    case SafeRetryEntry::Download:
+        if(this->remoteStateDb->existsFileById(entry.arg)) {
+            queueDownloadFile(entry.arg, info);
+            return;
+        }
+        break;
+    case SafeRetryEntry::Remove:
+        if(!info.exists() && !this->remoteStateDb->getFileId(relativeF).isEmpty()) {
+            remoteRemoveFile(info);
+            return;
+        }
+        if(!info.exists() && !this->remoteStateDb->getDirId(relativeF).isEmpty()) {
+            remoteRemoveDir(info);
+            return;
+        }
+        break;
+    case SafeRetryEntry::Move:
+        if(info.exists() && !(info.isDir() ? this->remoteStateDb->getDirId(entry.arg)
+                                          : this->remoteStateDb->getFileId(entry.arg)).isEmpty()) {
+            remoteMove(entry.arg, info, info.isDir());
+            return;
+        }
+        break;
+    case SafeRetryEntry::CreateDir:
+        if(info.isDir()) {
+            // also hands a directory made meanwhile to what waited for it
+            this->dirs->ensure(relativeF);
+            if(!this->dirs->idOf(relativeF).isEmpty() && this->retries) {
+                this->retries->succeeded(entry.path);
+            }
+            return;
+        }
+        break;
+    }
+    qDebug() << "Nothing left to retry for" << entry.path;
+    if(this->retries) {
+        this->retries->succeeded(entry.path);
+    }
 }
 
 bool SafeDaemon::isFileAllowed(const QFileInfo &info) {
     return !info.isHidden();
 }
 
-QString SafeDaemon::makeHash(const QFileInfo &info)
+QString SafeDaemon::makeHash(const QFileInfo &info, SafeFingerprint *fp)
+{
+    SafeFingerprint current(SafeFingerprint::fromPath(info.filePath()));
+    QString result(SafeHashCache::lookup(info.filePath(), "md5", current));
+
+    if(result.isEmpty()) {
+        QFile file(info.filePath());
+        if(!file.open(QFile::ReadOnly)) {
+            return QString();
+        }
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        hash.addData(&file);
+        result = hash.result().toHex();
+        current = SafeHashCache::store(info.filePath(), "md5", result, current);
+    }
+
+    if(fp) {
+        *fp = current;
+    }
+    return result;
+}
+
+QString SafeDaemon::makeFastHash(const QFileInfo &info, SafeFingerprint *fp, QString *md5)
 {
-    QFile file(info.filePath());
-    if(!file.open(QFile::ReadOnly)) {
+    SafeFingerprint current(SafeFingerprint::fromPath(info.filePath()));
+    QString result(SafeHashCache::lookup(info.filePath(), "xxh3", current));
+    QString digest(md5 ? SafeHashCache::lookup(info.filePath(), "md5", current) : QString());
+
+    if(result.isEmpty() || (md5 && digest.isEmpty())) {
+        QFile file(info.filePath());
+        if(!file.open(QFile::ReadOnly)) {
+            return QString();
+        }
+        SafeFastHash hash;
+        QCryptographicHash md5Hash(QCryptographicHash::Md5);
+        char buffer[64 * 1024];
+        qint64 length;
+        while((length = file.read(buffer, sizeof(buffer))) > 0) {
+            hash.addData(buffer, int(length));
+            if(md5) {
+                md5Hash.addData(buffer, int(length));
+            }
+        }
+        if(length < 0) {
+            return QString();
+        }
+        result = hash.result().toHex();
+        current = SafeHashCache::store(info.filePath(), "xxh3", result, current);
+        if(md5) {
+            digest = md5Hash.result().toHex();
+            current = SafeHashCache::store(info.filePath(), "md5", digest, current);
+        }
+    }
+
+    if(fp) {
+        *fp = current;
+    }
+    if(md5) {
+        *md5 = digest;
+    }
+    return result;
+}
+
+QString SafeDaemon::makeManifest(const QFileInfo &info, SafeFingerprint *fp,
+                                 QList<SafeChunk> *chunks, QString *md5)
+{
+    SafeFingerprint current(SafeFingerprint::fromPath(info.filePath()));
+    QString result(SafeHashCache::lookup(info.filePath(), "xxh3", current));
+    QString digest(md5 ? SafeHashCache::lookup(info.filePath(), "md5", current) : QString());
+
+    // a cached hash means the content is known, no need to rechunk it
+    if(result.isEmpty() || (md5 && digest.isEmpty())) {
+        QFile file(info.filePath());
+        if(!file.open(QFile::ReadOnly)) {
+            return QString();
+        }
+        SafeChunker chunker;
+        QCryptographicHash md5Hash(QCryptographicHash::Md5);
+        char buffer[64 * 1024];
+        qint64 length;
+        while((length = file.read(buffer, sizeof(buffer))) > 0) {
+            chunker.addData(buffer, int(length));
+            if(md5) {
+                md5Hash.addData(buffer, int(length));
+            }
+        }
+        if(length < 0) {
+            return QString();
+        }
+        *chunks = chunker.result();
+        result = chunker.fastHash();
+        current = SafeHashCache::store(info.filePath(), "xxh3", result, current);
+        if(md5) {
+            digest = md5Hash.result().toHex();
+            current = SafeHashCache::store(info.filePath(), "md5", digest, current);
+        }
+    }
+
+    if(fp) {
+        *fp = current;
+    }
+    if(md5) {
+        *md5 = digest;
+    }
+    return result;
+}
+
+bool SafeDaemon::mayBeUnchanged(const QString &relativeF, qint64 size)
+{
+    // a remote file of unknown size can't be ruled out
+    SafeFileRecord remote(this->remoteStateDb->getFile(relativeF));
+    return !remote.id.isEmpty() && !remote.hash.isEmpty()
+            && (remote.fingerprint.isNull() || remote.fingerprint.size == size);
+}
+
+bool SafeDaemon::skipUnchanged(const QFileInfo &info, const SafeFingerprint &fp,
+                               const QString &fhash, const QString &hash)
+{
+    QString relativeF(relativeFilePath(info));
+    SafeFileRecord remote(this->remoteStateDb->getFile(relativeF));
+    if(hash.isEmpty() || fp.isNull() || remote.id.isEmpty()
+            || hash.compare(remote.hash, Qt::CaseInsensitive) != 0) {
+        return false;
+    }
+
+    // only the mtime moved (touch, checkout, a restored backup); the server
+    // keeps its own, so the local index is all there is to update
+    qDebug() << "Content unchanged, not uploading:" << info.filePath();
+    this->transfers->cancel(info.filePath());
+    this->pendingManifests.remove(info.filePath());
+    this->localStateDb->insertFile(relativePath(info), relativeF, info.fileName(),
+                                   getMtime(info), hash, remote.id, fp);
+    this->localStateDb->setFileFastHash(relativeF, fhash);
+    this->localStateDb->updateDirHash(relativePath(info));
+    ++this->unchangedFiles;
+    this->unchangedBytes += fp.size;
+    return true;
+}
+
+QString SafeDaemon::indexFile(const QFileInfo &info)
+{
+    // MD5 is what the server speaks; locally the fast hash is enough unless
+    // it is already cached or "md5" hash mode was asked for
+    SafeFingerprint fp;
+    QString fhash(makeFastHash(info, &fp));
+    QString hash(SafeHashCache::lookup(info.filePath(), "md5", fp));
+    if(hash.isEmpty() && this->settings->value("hash_mode", "fast").toString() == "md5") {
+        hash = makeHash(info, &fp);
+    }
+
+    QString relative(relativePath(info));
+    QString relativeF(relativeFilePath(info));
+    // the id marks it as synced, the scrubber re-uploads files without one
+    this->localStateDb->insertFile(relative, relativeF, info.fileName(), getMtime(info), hash,
+                                   this->remoteStateDb->getFileId(relativeF), fp);
+    this->localStateDb->setFileFastHash(relativeF, fhash);
+    this->localStateDb->updateDirHash(relative);
+    return fhash;
+}
+
+QString SafeDaemon::findLocalContent(const QString &hash, qint64 size, const QString &except)
+{
+    // the stored hash only holds while the file is as it was indexed
+    auto intact = [this](const QString &relativeF){
+        return SafeFingerprint::fromPath(getFilesystemPath() + QDir::separator() + relativeF)
+                == this->localStateDb->getFileFingerprint(relativeF);
+    };
+    QString other(this->localStateDb->findFile(hash, except));
+    if(!other.isEmpty()) {
+        return intact(other) ? other : QString();
+    }
+
+    // files indexed in "fast" hash mode have no MD5 until something asks
+    // for their content; only those of the right size are worth reading
+    if(size <= 0) {
         return QString();
     }
-    QCryptographicHash hash(QCryptographicHash::Md5);
-    hash.addData(&file);
-    return hash.result().toHex();
+    foreach(QString candidate, this->localStateDb->findUnhashedFiles(size, except, LOOKUP_HASH_LIMIT)) {
+        QFileInfo info(getFilesystemPath() + QDir::separator() + candidate);
+        if(!intact(candidate)) {
+            continue;
+        }
+        QString md5(makeHash(info));
+        if(md5.isEmpty()) {
+            continue;
+        }
+        this->localStateDb->setFileHash(candidate, md5);
+        if(md5 == hash) {
+            return candidate;
+        }
+    }
+    return QString();
 }
 
 QString SafeDaemon::makeHash(const QString &str)
@@ -904,44 +2363,35 @@ ulong SafeDaemon::getMtime(const QFileInfo &info)
 void SafeDaemon::fullIndex(const QDir &dir)
 {
     qDebug() << "Doing full local index";
+    QElapsedTimer timer;
+    timer.start();
     QMap<QString, QPair<QString, ulong> > dir_index;
-    QDirIterator iterator(dir.absolutePath(), QDirIterator::Subdirectories);
+    SafeDirWalker walker(dir.absolutePath());
+    SafeDirEntry entry;
+    QString root(dir.absolutePath() + QDir::separator());
     struct s {
         ulong space = 0;
         ulong files = 0;
         ulong dirs = 0;
     } stats;
 
-    while (iterator.hasNext()) {
-        iterator.next();
-        if(iterator.fileName() == "." || iterator.fileName() == "..") {
-            continue;
-        }
-        auto info = iterator.fileInfo();
-        if(info.isSymLink()) {
-            continue;
-        }
+    while (walker.next(entry)) {
+        QFileInfo info(root + entry.path);
         QString relative(relativeFilePath(info));
-        if (!info.isDir()) {
-            stats.space += info.size();
-            auto hash = makeHash(info);
-            auto mtime = getMtime(info);
+        if (!entry.isDir) {
+            stats.space += entry.fingerprint.size;
+            ulong mtime = entry.fingerprint.mtime_ns / 1000000000LL;
             auto dirPath = info.absolutePath();
+            QString hash;
             //index file
             stats.files++;
             if(!this->remoteStateDb->existsFile(relative)
                     && !this->localStateDb->existsFile(relative)){
-                if(!remoteStateDb->existsDir(relativePath(info))) {
-                    prepareTree(info, relativeFilePath(dir.path()));
-                }
-
+                // indexed and hashed on upload, once its directory exists
                 emit fileAdded(info.filePath(), false);
+            } else {
+                hash = indexFile(info);
             }
-            this->localStateDb->insertFile(
-                        relativePath(info),
-                        relative,
-                        info.fileName(),
-                        mtime, hash);
 
             if(!dir_index.contains(dirPath)){
                 // push dir
@@ -953,7 +2403,7 @@ void SafeDaemon::fullIndex(const QDir &dir)
             if(mtime > dir_index[dirPath].second) {
                 dir_index[dirPath].second = mtime;
             }
-        } else if (QDir(info.filePath()).count() < 3) {
+        } else if (entry.children == 0) {
             // index empty dir
             stats.dirs++;
             if(!this->remoteStateDb->existsDir(relative)
@@ -962,7 +2412,7 @@ void SafeDaemon::fullIndex(const QDir &dir)
             }
             this->localStateDb->insertDir(relativeFilePath(info),
                                           info.dir().dirName(),
-                                          getMtime(info));
+                                          entry.fingerprint.mtime_ns / 1000000000LL);
         }
     }
 
@@ -982,77 +2432,161 @@ void SafeDaemon::fullIndex(const QDir &dir)
         localStateDb->insertDir(relative, QDir(k).dirName(),
                                 dir_index[k].second, makeHash(dir_index[k].first));
     }
+    // bench/hashmodes compares the hash modes on a generated tree
+    double seconds = qMax<qint64>(timer.elapsed(), 1) / 1000.0;
     qDebug() << "MBs:" << stats.space / (1024.0 * 1024.0)
              << "\nFiles:" << stats.files <<
-                "\nDirs:" << stats.dirs;
+                "\nDirs:" << stats.dirs <<
+                "\nHash mode:" << this->settings->value("hash_mode", "fast").toString() <<
+                "\nSeconds:" << seconds <<
+                "\nMB/s:" << stats.space / (1024.0 * 1024.0) / seconds;
 }
 
-void SafeDaemon::fullRemoteIndex()
+void SafeDaemon::fullRemoteIndex(std::function<void()> done)
 {
-    QEventLoop loop;
-    auto api = this->apiFactory->newApi();
-    uint counter = 0;
-
-    connect(api, &SafeApi::listDirComplete, [&](ulong id, QList<SafeDir> dirs,
-            QList<SafeFile> files, QJsonObject root_info){
-        bool root = false;
-        QString tree = root_info.value("tree").toString();
-        tree.remove(0, 1);
-        tree.chop(1);
-        if(tree.isEmpty()){
-            root = true;
-            tree = QString(QDir::separator());
-        }
+    SAFE_ASSERT_NOT_NESTED();
+    this->apiFactory->acquire([=](SafeApi *api){
+        // listings in flight; all of them go out at once on the one client
+        QSharedPointer<uint> counter(new uint(0));
+        auto finish = [=](){
+            this->apiFactory->release(api);
+            qDebug() << "Finished remote indexing";
+            done();
+        };
+
+        connect(api, &SafeApi::listDirComplete, [=](ulong id, QList<SafeDir> dirs,
+                QList<SafeFile> files, QJsonObject root_info){
+            bool root = false;
+            QString tree = root_info.value("tree").toString();
+            tree.remove(0, 1);
+            tree.chop(1);
+            if(tree.isEmpty()){
+                root = true;
+                tree = QString(QDir::separator());
+            }
 
-        // index root
-        if(root)
-            remoteStateDb->insertDir(tree, tree, 0, root_info.value("id").toString());
+            // index root
+            if(root)
+                remoteStateDb->insertDir(tree, tree, 0, root_info.value("id").toString());
 
-        foreach(SafeFile file, files) {
-            if(file.is_trash) {
-                continue;
+            foreach(SafeFile file, files) {
+                if(file.is_trash) {
+                    continue;
+                }
+                // index file; the size is what copies, quota and unchanged
+                // content are matched on before anything is read
+                SafeFingerprint remote;
+                remote.size = file.size;
+                remoteStateDb->insertFile(tree, root ? file.name : (tree + QDir::separator() + file.name),
+                                          file.name, file.mtime, file.chksum, file.id, remote);
             }
-            // index file
-            remoteStateDb->insertFile(tree, root ? file.name : (tree + QDir::separator() + file.name),
-                                      file.name, file.mtime, file.chksum, file.id);
-        }
 
-        foreach(SafeDir dir, dirs) {
-            if(dir.is_trash || !dir.special_dir.isEmpty()) {
-                continue;
+            foreach(SafeDir dir, dirs) {
+                if(dir.is_trash || !dir.special_dir.isEmpty()) {
+                    continue;
+                }
+                ++*counter;
+                // index dir
+                remoteStateDb->insertDir(root ? dir.name : (tree + QDir::separator() + dir.name),
+                                         dir.name, dir.mtime, dir.id);
+                api->listDir(dir.id);
             }
-            ++counter;
-            // index dir
-            remoteStateDb->insertDir(root ? dir.name : (tree + QDir::separator() + dir.name),
-                                     dir.name, dir.mtime, dir.id);
-            api->listDir(dir.id);
-        }
 
-        --counter; // dir parsed
-        if(counter < 1) {
-            // no more recursion
-            loop.exit();
-            return;
-        }
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error remote indexing:" << text << "(" << code << ")";
-        --counter;
-        if(counter < 1)
-            loop.exit();
+            --*counter; // dir parsed
+            if(*counter < 1) {
+                // no more recursion
+                finish();
+            }
+        });
+        connect(api, &SafeApi::errorRaised, [=](ulong id, quint16 code, QString text){
+            qWarning() << "Error remote indexing:" << text << "(" << code << ")";
+            --*counter;
+            if(*counter < 1) {
+                finish();
+            }
+        });
 
+        fetchDirId("/", [=](const QString &rootId){
+            ++*counter;
+            api->listDir(rootId);
+        });
     });
-
-    ++counter;
-    api->listDir(fetchDirId("/"));
-    loop.exec();
-
-    qDebug() << "Finished remote indexing";
 }
 
 void SafeDaemon::checkIndex(const QDir &dir)
 {
+    qDebug() << "Doing local index check";
+    QElapsedTimer timer;
+    timer.start();
+    SafeDirWalker walker(dir.absolutePath());
+    SafeIndexCursor cursor(this->localStateDb->scanIndex());
+    QList<SafeDirEntry> added, modified, deleted;
+    ulong unchanged = 0;
+
+    // both sides are sorted by key, so a single merge pass finds the difference
+    SafeDirEntry entry;
+    bool hasEntry = walker.next(entry);
+    bool hasRow = cursor.next();
+    while(hasEntry || hasRow) {
+        int cmp = !hasEntry ? 1 : (!hasRow ? -1 : qstrcmp(entry.key, cursor.entry().key));
+        if(cmp < 0) {
+            added.append(entry);
+            hasEntry = walker.next(entry);
+        } else if(cmp > 0) {
+            deleted.append(cursor.entry());
+            hasRow = cursor.next();
+        } else {
+            if(!entry.isDir && entry.fingerprint != cursor.entry().fingerprint) {
+                modified.append(entry);
+            } else {
+                ++unchanged;
+            }
+            hasEntry = walker.next(entry);
+            hasRow = cursor.next();
+        }
+    }
 
+    qDebug() << "Unchanged:" << unchanged
+             << "\nAdded:" << added.size()
+             << "\nModified:" << modified.size()
+             << "\nDeleted:" << deleted.size()
+             << "\nSeconds:" << timer.elapsed() / 1000.0;
+
+    QString root(dir.absolutePath() + QDir::separator());
+    QByteArray deletedDir;
+    foreach(SafeDirEntry e, deleted) {
+        // children of a deleted directory go away with it
+        bool orphan = !deletedDir.isEmpty() && e.key.startsWith(deletedDir);
+        if(orphan || !isFileAllowed(QFileInfo(root + e.path))) {
+            if(e.isDir) {
+                this->localStateDb->removeDir(e.path);
+            } else {
+                this->localStateDb->removeFile(e.path);
+            }
+            continue;
+        }
+        if(e.isDir) {
+            deletedDir = e.key;
+        }
+        fileDeleted(root + e.path, e.isDir);
+    }
+
+    foreach(SafeDirEntry e, added) {
+        QFileInfo info(root + e.path);
+        if(e.isDir) {
+            if(e.children == 0 && !this->remoteStateDb->existsDir(e.path)) {
+                emit fileAdded(info.filePath(), true);
+            } else {
+                this->localStateDb->insertDir(e.path, info.fileName(), getMtime(info));
+            }
+            continue;
+        }
+        emit fileAdded(info.filePath(), false);
+    }
+
+    foreach(SafeDirEntry e, modified) {
+        emit fileModified(root + e.path);
+    }
 }
 
 QString SafeDaemon::relativeFilePath(const QFileInfo &info)
@@ -1061,24 +2595,32 @@ QString SafeDaemon::relativeFilePath(const QFileInfo &info)
     return relative.isEmpty() ? "/" : relative;
 }
 
-QString SafeDaemon::fetchDirId(const QString &path)
+void SafeDaemon::fetchDirId(const QString &path, std::function<void(const QString &id)> done)
 {
-    QString dirId;
-    QEventLoop loop;
-    auto api = this->apiFactory->newApi();
-    connect(api, &SafeApi::getPropsComplete, [&](ulong id, QJsonObject props){
-        auto info = props.value("object").toObject();
-        dirId = SafeDir(info).id;
-        loop.exit();
-    });
-    connect(api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
+    // the remote index follows remote events, so the server is only asked
+    // about directories it has not seen
+    QString dirId(path == "/" ? this->rootDirId : this->remoteStateDb->getDirId(path));
+    if(!dirId.isEmpty()) {
+        ++this->dirIdHits;
+        done(dirId);
+        return;
+    }
+    ++this->dirIdMisses;
+
+    this->apiFactory->call(&SafeApi::getPropsComplete, [=](SafeApi *api){
+        api->getProps(path, true);
+    }, [=](ulong, QJsonObject props){
+        SafeDir info(props.value("object").toObject());
+        if(path == "/") {
+            this->rootDirId = info.id;
+        } else if(!info.id.isEmpty()) {
+            this->remoteStateDb->insertDir(path, info.name, info.mtime, info.id);
+        }
+        done(info.id);
+    }, [=](quint16 code, const QString &text){
         qWarning() << "Error getting props:" << text << "(" << code << ")";
-        loop.exit();
+        done(QString());
     });
-
-    api->getProps(path, true);
-    loop.exec();
-    return dirId;
 }
 
 QString SafeDaemon::relativePath(const QFileInfo &info)
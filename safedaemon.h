@@ -23,12 +23,34 @@
 #include <QDateTime>
 #include <QCryptographicHash>
 #include <QMap>
-#include <QEventLoop>
+#include <QQueue>
+#include <QPointer>
+#include <QSharedPointer>
 #include <QMutex>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <lib2safe/safeapi.h>
 
 #include "safeapifactory.h"
 #include "safestatedb.h"
+#include "safedirwalker.h"
+#include "safefingerprint.h"
+#include "safeuploadsource.h"
+#include "safedownloadsink.h"
+#include "safehashcache.h"
+#include "safefasthash.h"
+#include "safechunker.h"
+#include "safedeltatarget.h"
+#include "saferesumabletarget.h"
+#include "safechunkedtransfer.h"
+#include "safescrubber.h"
+#include "safetransferscheduler.h"
+#include "saferatelimiter.h"
+#include "saferetryqueue.h"
+#include "safedirplanner.h"
+#include "safeoplog.h"
+#include "safecontentcache.h"
+#include "safepeerservice.h"
 #include "fswatcher.h"
 #include "safewatcher.h"
 #include "safecommon.h"
@@ -55,15 +77,73 @@ private:
     SafeWatcher *swatcher;
     SafeStateDb *localStateDb;
     SafeStateDb *remoteStateDb;
+    SafeScrubber *scrubber;
+    SafeRetryQueue *retries;
+    SafeDirPlanner *dirs;
+    // changes made while the server can't be reached
+    SafeOpLog *oplog;
+    bool reachable;
+    QTimer *probe;
+    SafeContentCache *trash;
+    SafePeerService *peers;
+    quint64 peerBytes; // verified content from peers, not downloaded
+    // used_bytes follows what we and the remote events change, the server
+    // is only asked every "quota_interval" minutes
+    QTimer *quotaTimer;
+    QTimer *usageRefresh;
+    qint64 quotaDrift;
+    QHash<QString, QFileInfo> quotaHeld;
+    // remote events one after the other, some wait on the server
+    typedef std::function<void()> Next;
+    QQueue<std::function<void(Next)> > remoteEvents;
+    bool remoteBusy;
+    bool remoteDraining;
+    QString rootDirId;
+    quint64 localCopies;
+    quint64 localCopyBytes;
+    quint64 remoteCopies;
+    quint64 remoteCopyBytes;
+    // modifications that turned out to be the content the server has
+    quint64 unchangedFiles;
+    quint64 unchangedBytes;
+    // uploads under way by size, and the paths of that size waiting for them
+    QHash<qint64, QString> uploadingSizes;
+    QMultiHash<qint64, QFileInfo> parkedUploads;
+    // uploads to a path a move is still on its way to, sent once it is there
+    QHash<QString, QFileInfo> uploadsAfterMove;
+    quint64 dirIdHits;
+    quint64 dirIdMisses;
 
-    QMap<QString, QTimer *> pendingTransfers;
-    QMap<QString, SafeApi *> activeTransfers;
+    struct PendingManifest {
+        QList<SafeChunk> chunks;
+        QString fhash;
+        SafeFingerprint fp;
+    };
+
+    SafeDeltaTarget *deltaTarget;
+    SafeResumableTarget *resumeTarget;
+    QMap<QString, PendingManifest> pendingManifests;
+    SafeTransferScheduler *transfers;
+    SafeRateLimiter *uploadLimiter;
+    SafeRateLimiter *downloadLimiter;
     QList<QJsonObject> messagesQueue;
     void finishTransfer(const QString& path);
-    void storeTransfer(const QString& path, SafeApi *api);
+    void accountRemote(const QString &path, qint64 size);
+    void accountUsage(qint64 delta);
+    void refreshUsage();
+    bool fitsQuota(const QFileInfo &info);
+    void releaseHeldUploads();
+    void storeTransfer(const QString& path, SafeApi *api, QObject *device = 0);
+    void retryLater(SafeRetryEntry::Operation operation, const QString &path,
+                    const QString &arg, quint16 code, const QString &text);
+    bool recordOffline(SafeOpEntry::Operation operation, const QString &path, bool isDir,
+                       bool known, const QString &from = QString());
+    void setReachable(bool reachable);
+    void replayOpLog();
 
-    bool authUser();
+    void authUser(std::function<void(bool ok)> done);
     void init();
+    void initIndexed();
     void bindServer(QLocalServer *server, QString path);
     void initWatcher(const QString &path);
 
@@ -71,25 +151,35 @@ private:
     QString getFilesystemPath();
 
     bool isFileAllowed(const QFileInfo &info);
-    QString makeHash(const QFileInfo &info);
+    QString makeHash(const QFileInfo &info, SafeFingerprint *fp = 0);
+    // with md5 given, the MD5 is taken in the same pass over the file
+    QString makeFastHash(const QFileInfo &info, SafeFingerprint *fp = 0, QString *md5 = 0);
+    QString makeManifest(const QFileInfo &info, SafeFingerprint *fp, QList<SafeChunk> *chunks,
+                         QString *md5 = 0);
+    QString indexFile(const QFileInfo &info);
+    QString findLocalContent(const QString &hash, qint64 size, const QString &except = QString());
+    bool mayBeUnchanged(const QString &relativeF, qint64 size);
+    bool skipUnchanged(const QFileInfo &info, const SafeFingerprint &fp, const QString &fhash,
+                       const QString &hash);
     QString makeHash(const QString &str);
     void updateDirHash(const QDir &dir);
     ulong getMtime(const QFileInfo &info);
     QString relativePath(const QFileInfo &info);
     QString relativeFilePath(const QFileInfo &info);
-    QString fetchDirId(const QString &path);
+    void fetchDirId(const QString &path, std::function<void(const QString &id)> done);
 
-    void fullRemoteIndex();
+    void fullRemoteIndex(std::function<void()> done);
     void fullIndex(const QDir &dir);
     void checkIndex(const QDir &dir);
 
-    QJsonObject fetchFileInfo(const QString &id);
-    QJsonObject fetchDirInfo(const QString &id);
-    void prepareTree(const QFileInfo &info, const QString &root);
+    // "object" of the props, empty if they couldn't be fetched
+    void fetchInfo(const QString &id, std::function<void(const QJsonObject &info)> done);
 
-    // Helpers
-    QString getPublicLink(const QFileInfo &info);
-    QString getFolderLink(const QFileInfo &info);
+    // Helpers, empty links on failure
+    void getPublicLink(const QFileInfo &info, std::function<void(const QString &link)> done);
+    void getFolderLink(const QFileInfo &info, std::function<void(const QString &link)> done);
+    void enqueueRemote(std::function<void(Next)> event);
+    void runRemoteEvents();
 
 private slots:
     // FS handlers
@@ -99,39 +189,71 @@ private slots:
     void fileMoved(const QString &path1, const QString &path2, bool isDir);
     void fileCopied(const QString &path1, const QString &path2);
 
-    // Remote handlers
-    void remoteFileAdded(QString id, QString pid, QString name);
+    // Remote handlers, done is called once the next event may be handled
+    void remoteFileAdded(QString id, QString pid, QString name, Next done);
     void remoteFileDeleted(QString id, QString pid, QString name);
-    void remoteDirectoryCreated(QString id, QString pid, QString name);
+    void remoteDirectoryCreated(QString id, QString pid, QString name, Next done);
     void remoteDirectoryDeleted(QString id, QString pid, QString name);
     // from /d1/n1 to /d2/n2
     // pid1 = id of d1, pid2 = id of d2
-    void remoteFileMoved(QString id, QString pid1, QString n1, QString pid2, QString n2);
-    void remoteDirectoryMoved(QString id, QString pid1, QString n1, QString pid2, QString n2);
+    void remoteFileMoved(QString id, QString pid1, QString n1, QString pid2, QString n2, Next done);
+    void remoteDirectoryMoved(QString id, QString pid1, QString n1, QString pid2, QString n2,
+                              Next done);
 
     // Instant actions
-    QString createDir(const QString &parent_id, const QString &path);
     void remoteRemoveDir(const QFileInfo &info);
     void remoteRemoveFile(const QFileInfo &info);
     //void remoteCopyFile(const QString &path1, const QString &path2);
-    //void remoteMoveFile(const QString &path1, const QString &path2);
+    void remoteMove(const QString &from, const QFileInfo &info, bool isDir);
 
     // Queued
-    void queueUploadFile(const QString &dir_id, const QFileInfo &info);
-    void uploadFile(const QString &dir_id, const QFileInfo &info);
+    void queueUploadFile(const QFileInfo &info);
+    void uploadFile(const QString &dir_id, const QFileInfo &info, bool reuse = true);
+    bool uploadCopy(const QString &dir_id, const QFileInfo &info, const QString &hash,
+                    const SafeFingerprint &fp);
+    bool uploadDelta(const QFileInfo &info);
+    SafeChunkedTransfer *uploadResumable(const QFileInfo &info);
+    void trackUploading(QObject *transfer, qint64 size, const QString &path);
     void queueDownloadFile(const QString &id, const QFileInfo &info);
     void downloadFile(const QString &id, const QFileInfo &info);
+    void downloadFromServer(const QString &id, const QFileInfo &info);
+    bool downloadResumable(const QString &id, const QFileInfo &info);
+    bool cloneLocalCopy(SafeDownloadSink *sink, const QString &chksum, ulong mtime,
+                        const QFileInfo &info);
+    bool takeFromTrash(SafeDownloadSink *sink, const QString &chksum, ulong mtime);
+    void moveToTrash(const QFileInfo &info);
+    void indexDownload(SafeDownloadSink *sink, const QString &id, ulong mtime,
+                       const QFileInfo &info);
+    void resumeTransfers();
+
+    // Scrubber findings
+    void restoreFile(const QString &path);
+    void reconcileFile(const QString &path);
+
+    // Failed operations
+    void retryOperation(const SafeRetryEntry &entry);
 
     // Misc
     void deauthUser();
     void purgeDb(const QString &name);
+    void applyRateLimits();
     void handleClientConnection();
     void fetchUsage();
+    void probeServer();
 
     // Notifications for client
     void notifyEventQuota(ulong used, ulong total);
     void notifyEventAuth(bool auth, QString login = QString());
     void notifyEventSync(ulong count);
+    void notifyEventScrub();
+    void notifyEventTransfers();
+    void notifyEventApiPool();
+    void notifyEventRetries();
+    void notifyEventDirs();
+    void notifyEventOffline();
+    void notifyEventTrash();
+    void notifyEventPeers();
+    void notifyEventError(const SafeRetryEntry &entry);
 
 };
 
@@ -0,0 +1,80 @@
+#include "safedeltatarget.h"
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QDebug>
+
+SafeMirrorDeltaTarget::SafeMirrorDeltaTarget(const QString &root) :
+    root(root)
+{
+}
+
+bool SafeMirrorDeltaTarget::push(const QString &relative, const QString &path,
+                                 const QList<SafeChunk> &old, const QList<SafeChunk> &current)
+{
+    QString mirrorPath(QDir(this->root).filePath(relative));
+    QFile source(path);
+    QFile mirror(mirrorPath);
+    QFile rebuilt(mirrorPath + ".delta");
+    if(!mirror.exists()) {
+        return false; // nothing to apply a delta to
+    }
+    if(!source.open(QIODevice::ReadOnly) || !mirror.open(QIODevice::ReadOnly)
+            || !rebuilt.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+
+    QHash<QString, SafeChunk> known;
+    foreach(SafeChunk chunk, old) {
+        known.insert(chunk.digest, chunk);
+    }
+
+    qint64 sent = 0;
+    foreach(SafeChunk chunk, current) {
+        bool ok;
+        if(known.contains(chunk.digest)) {
+            ok = copy(mirror, rebuilt, known.value(chunk.digest).offset, chunk.length);
+        } else {
+            ok = copy(source, rebuilt, chunk.offset, chunk.length);
+            sent += chunk.length;
+        }
+        if(!ok) {
+            rebuilt.remove();
+            return false;
+        }
+    }
+
+    rebuilt.close();
+    mirror.close();
+    QFile::remove(mirrorPath);
+    if(!rebuilt.rename(mirrorPath)) {
+        return false;
+    }
+    qDebug() << "Delta applied to" << relative << ":" << sent << "bytes sent";
+    return true;
+}
+
+void SafeMirrorDeltaTarget::seed(const QString &relative, const QString &path)
+{
+    QString mirrorPath(QDir(this->root).filePath(relative));
+    QDir().mkpath(QFileInfo(mirrorPath).path());
+    QFile::remove(mirrorPath);
+    QFile::copy(path, mirrorPath);
+}
+
+bool SafeMirrorDeltaTarget::copy(QFile &from, QFile &to, qint64 offset, qint64 length)
+{
+    char buffer[64 * 1024];
+    if(!from.seek(offset)) {
+        return false;
+    }
+    while(length > 0) {
+        qint64 len = from.read(buffer, qMin<qint64>(length, sizeof(buffer)));
+        if(len <= 0 || to.write(buffer, len) != len) {
+            return false;
+        }
+        length -= len;
+    }
+    return true;
+}
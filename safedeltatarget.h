@@ -0,0 +1,37 @@
+#ifndef SAFEDELTATARGET_H
+#define SAFEDELTATARGET_H
+
+#include <QString>
+#include <QList>
+#include <QFile>
+#include "safechunker.h"
+
+// Backend able to rebuild a file it already has from the chunks it keeps
+// plus the changed ranges we send. The 2safe API has no such call yet, so
+// uploads go through pushFile unless a target is configured.
+class SafeDeltaTarget
+{
+public:
+    virtual ~SafeDeltaTarget() {}
+    virtual bool push(const QString &relative, const QString &path,
+                      const QList<SafeChunk> &old, const QList<SafeChunk> &current) = 0;
+    // called after a regular full upload of path
+    virtual void seed(const QString &relative, const QString &path) {}
+};
+
+// Local stand-in keeping a mirror of the tree in a directory ("delta_mirror"
+// setting), for exercising the delta path without server support.
+class SafeMirrorDeltaTarget : public SafeDeltaTarget
+{
+public:
+    explicit SafeMirrorDeltaTarget(const QString &root);
+    bool push(const QString &relative, const QString &path,
+              const QList<SafeChunk> &old, const QList<SafeChunk> &current);
+    void seed(const QString &relative, const QString &path);
+
+private:
+    QString root;
+    bool copy(QFile &from, QFile &to, qint64 offset, qint64 length);
+};
+
+#endif // SAFEDELTATARGET_H
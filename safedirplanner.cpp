@@ -0,0 +1,217 @@
+#include "safedirplanner.h"
+#include <QDir>
+#include <QDateTime>
+#include <QDebug>
+
+SafeDirPlanner::SafeDirPlanner(SafeStateDb *remote, SafeApiFactory *factory,
+                               QSettings *settings, QObject *parent) :
+    QObject(parent),
+    remote(remote),
+    factory(factory),
+    settings(settings),
+    running(0),
+    made(0),
+    resolved(0),
+    failures(0),
+    maxRunning(0)
+{
+}
+
+SafeDirPlanner::~SafeDirPlanner()
+{
+    foreach(Node node, this->nodes) {
+        if(node.api) {
+            this->factory->discard(node.api);
+        }
+    }
+}
+
+void SafeDirPlanner::ensure(const QString &dir, Callback ready)
+{
+    QString id(lookup(dir));
+    if(!id.isEmpty()) {
+        foreach(Callback waiter, this->parked.take(dir)) {
+            waiter(id);
+        }
+        if(ready) {
+            ready(id);
+        }
+        return;
+    }
+
+    plan(dir);
+    this->nodes[dir].waiters.append(this->parked.take(dir));
+    if(ready) {
+        this->nodes[dir].waiters.append(ready);
+    }
+    pump();
+}
+
+void SafeDirPlanner::plan(const QString &dir)
+{
+    if(this->nodes.contains(dir)) {
+        return;
+    }
+
+    Node node;
+    if(dir == "/") {
+        node.exists = true;
+    } else {
+        node.parent = parentOf(dir);
+        node.exists = this->remote->existsDir(dir);
+    }
+    this->nodes.insert(dir, node);
+    if(node.exists || !lookup(node.parent).isEmpty()) {
+        this->runnable.append(dir);
+        return;
+    }
+
+    // released by the parent once it has an id
+    plan(node.parent);
+    this->nodes[node.parent].children.append(dir);
+}
+
+void SafeDirPlanner::pump()
+{
+    int limit = qMax(this->settings->value("dir_slots", 8).toInt(), 1);
+    while(this->running < limit && !this->runnable.isEmpty()) {
+        start(this->runnable.takeFirst());
+    }
+}
+
+void SafeDirPlanner::start(const QString &dir)
+{
+    ++this->running;
+    this->maxRunning = qMax(this->maxRunning, this->running);
+    this->factory->acquire([=](SafeApi *api){
+        Node &node = this->nodes[dir];
+        node.api = api;
+
+        if(node.exists) {
+            connect(api, &SafeApi::getPropsComplete, this, [=](ulong id, QJsonObject props){
+                ++this->resolved;
+                done(dir, SafeDir(props.value("object").toObject()).id);
+            });
+            connect(api, &SafeApi::errorRaised, this, [=](ulong id, quint16 code, QString text){
+                fail(dir, code, text);
+            });
+            api->getProps(dir, true);
+            return;
+        }
+
+        connect(api, &SafeApi::makeDirComplete, this, [=](ulong id, ulong dir_id){
+            qDebug() << "Created remote directory:" << dir << "(" << dir_id << ")";
+            ++this->made;
+            done(dir, QString::number(dir_id));
+        });
+        connect(api, &SafeApi::errorRaised, this, [=](ulong id, quint16 code, QString text){
+            // may have been created meanwhile; look it up once before giving up
+            qWarning() << "Error creating dir:" << text << "(" << code << ")";
+            Node &node = this->nodes[dir];
+            this->factory->release(node.api);
+            node.api = 0;
+            node.exists = true;
+            --this->running;
+            this->runnable.prepend(dir);
+            pump();
+        });
+        api->makeDir(lookup(node.parent), QDir(dir).dirName());
+    });
+}
+
+void SafeDirPlanner::done(const QString &dir, const QString &id)
+{
+    if(id.isEmpty()) {
+        fail(dir, 404, "No such directory");
+        return;
+    }
+
+    Node node(this->nodes.take(dir));
+    this->factory->release(node.api);
+    --this->running;
+    if(dir == "/") {
+        this->rootId = id;
+    } else {
+        // the remote event would only confirm it
+        this->remote->insertDir(dir, QDir(dir).dirName(),
+                                QDateTime::currentDateTime().toTime_t(), id);
+    }
+
+    emit created(dir, id);
+    foreach(QString child, node.children) {
+        this->runnable.append(child);
+    }
+    node.waiters.append(this->parked.take(dir));
+    foreach(Callback ready, node.waiters) {
+        ready(id);
+    }
+    pump();
+}
+
+void SafeDirPlanner::fail(const QString &dir, quint16 code, const QString &text)
+{
+    Node node(this->nodes.take(dir));
+    if(node.api) {
+        this->factory->release(node.api);
+        --this->running;
+    }
+    ++this->failures;
+    qWarning() << "Unable to create remote directory" << dir << ":" << text;
+    // what waits for it goes on once it is ensured again
+    if(!node.waiters.isEmpty()) {
+        this->parked[dir].append(node.waiters);
+    }
+    emit failed(dir, code, text);
+
+    // nothing below can be created either
+    foreach(QString child, node.children) {
+        fail(child, code, text);
+    }
+    pump();
+}
+
+void SafeDirPlanner::expectMove(const QString &from, const QString &to)
+{
+    this->moving.insert(to, from);
+}
+
+QString SafeDirPlanner::lookup(const QString &dir) const
+{
+    if(dir == "/") {
+        return this->rootId;
+    }
+    QString id(this->remote->getDirId(dir));
+    if(!id.isEmpty()) {
+        return id;
+    }
+
+    // once the index has caught up the old path is simply gone
+    for(auto it = this->moving.constBegin(); it != this->moving.constEnd(); ++it) {
+        if(dir == it.key() || dir.startsWith(it.key() + '/')) {
+            id = this->remote->getDirId(it.value() + dir.mid(it.key().length()));
+            if(!id.isEmpty()) {
+                return id;
+            }
+        }
+    }
+    return id;
+}
+
+QString SafeDirPlanner::parentOf(const QString &dir)
+{
+    int i = dir.lastIndexOf('/');
+    return i <= 0 ? QString("/") : dir.left(i);
+}
+
+QJsonObject SafeDirPlanner::stats() const
+{
+    QJsonObject values;
+    values.insert("pending", this->nodes.size());
+    values.insert("running", this->running);
+    values.insert("max_running", this->maxRunning);
+    values.insert("created", (qint64)this->made);
+    values.insert("resolved", (qint64)this->resolved);
+    values.insert("failed", (qint64)this->failures);
+    values.insert("parked", this->parked.size());
+    return values;
+}
@@ -0,0 +1,79 @@
+#ifndef SAFEDIRPLANNER_H
+#define SAFEDIRPLANNER_H
+
+#include <QObject>
+#include <QHash>
+#include <QStringList>
+#include <QSettings>
+#include <QJsonObject>
+#include <functional>
+#include <lib2safe/safeapi.h>
+#include "safeapifactory.h"
+#include "safestatedb.h"
+
+// Creates missing remote directories as a dependency graph rather than one
+// ancestor at a time. Every directory waits only for its parent's id, so
+// siblings are created in parallel (up to "dir_slots" requests) and a
+// directory is released as soon as its parent exists. Paths are relative
+// to the sync root, "/" is the root itself.
+//
+// What the server has is read from and written to the remote index, so a
+// directory created here is known before its remote event arrives.
+class SafeDirPlanner : public QObject
+{
+    Q_OBJECT
+public:
+    typedef std::function<void(const QString &id)> Callback;
+
+    explicit SafeDirPlanner(SafeStateDb *remote, SafeApiFactory *factory,
+                            QSettings *settings, QObject *parent = 0);
+    ~SafeDirPlanner();
+
+    // calls ready with the remote id of dir once it exists, right away when
+    // it is known. If it can't be created ready is kept until the next
+    // ensure() of dir, e.g. the retry of the failed creation
+    void ensure(const QString &dir, Callback ready = Callback());
+    // a directory is on its way from one path to another on the server;
+    // it and what is below it are found under the new path meanwhile
+    void expectMove(const QString &from, const QString &to);
+    QString idOf(const QString &dir) const { return lookup(dir); }
+    QJsonObject stats() const;
+
+signals:
+    void created(const QString &dir, const QString &id);
+    void failed(const QString &dir, quint16 code, const QString &text);
+
+private:
+    struct Node {
+        QString parent;
+        bool exists = false;   // only the id has to be looked up
+        SafeApi *api = 0;
+        QList<Callback> waiters;
+        QStringList children;
+    };
+
+    SafeStateDb *remote;
+    SafeApiFactory *factory;
+    QSettings *settings;
+    QString rootId;
+    QHash<QString, Node> nodes;
+    QHash<QString, QString> moving; // new path -> old path
+    QHash<QString, QList<Callback> > parked; // waiters of dirs that failed
+    QStringList runnable;
+    int running;
+    quint64 made;
+    quint64 resolved;
+    quint64 failures;
+    int maxRunning;
+
+    void plan(const QString &dir);
+    void pump();
+    void start(const QString &dir);
+    void done(const QString &dir, const QString &id);
+    void fail(const QString &dir, quint16 code, const QString &text);
+    QString lookup(const QString &dir) const;
+
+    static QString parentOf(const QString &dir);
+};
+
+#endif // SAFEDIRPLANNER_H
@@ -0,0 +1,287 @@
+#include "safedirwalker.h"
+#include <QFile>
+#include <QDir>
+#include <QAtomicInt>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+namespace {
+
+struct linux_dirent64 {
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+bool statEntry(int dirfd, const char *name, SafeFingerprint &fp, mode_t &mode)
+{
+    static QAtomicInt haveStatx(1);
+    if(haveStatx.load()) {
+        struct statx stx;
+        int rc = ::statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                         STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME
+                         | STATX_CTIME | STATX_INO, &stx);
+        if(rc == 0) {
+            fp = SafeFingerprint::fromStatx(stx);
+            mode = stx.stx_mode;
+            return true;
+        }
+        if(errno != ENOSYS) {
+            return false;
+        }
+        haveStatx.store(0); // old kernel
+    }
+
+    struct stat st;
+    if(::fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return false;
+    }
+    fp = SafeFingerprint::fromStat(st);
+    mode = st.st_mode;
+    return true;
+}
+
+}
+
+class SafeDirWalker::Worker : public QThread
+{
+public:
+    Worker(SafeDirWalker *walker, int id) : walker(walker), id(id) {}
+
+protected:
+    void run() { this->walker->work(this->id); }
+
+private:
+    SafeDirWalker *walker;
+    int id;
+};
+
+SafeDirWalker::SafeDirWalker(const QString &root, int threads) :
+    root(QDir::cleanPath(root)),
+    cached(0),
+    nextQueue(0),
+    stopping(false)
+{
+    for(int i = 0; i < qMax(threads, 1); ++i) {
+        this->queues.append(new Queue());
+    }
+    for(int i = 0; i < this->queues.size(); ++i) {
+        Worker *worker = new Worker(this, i);
+        this->workers.append(worker);
+        worker->start();
+    }
+
+    Frame top;
+    top.entries = list(this->root, QString());
+    this->mutex.lock();
+    QStringList jobs(mark(top.entries));
+    this->mutex.unlock();
+    push(jobs, 0);
+    this->stack.push(top);
+}
+
+SafeDirWalker::~SafeDirWalker()
+{
+    this->mutex.lock();
+    this->stopping = true;
+    this->wakeup.wakeAll();
+    this->mutex.unlock();
+
+    foreach(Worker *worker, this->workers) {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(this->queues);
+}
+
+bool SafeDirWalker::next(SafeDirEntry &entry)
+{
+    while(!this->stack.isEmpty()) {
+        Frame &top = this->stack.top();
+        if(top.pos >= top.entries.size()) {
+            this->stack.pop();
+            continue;
+        }
+
+        entry = top.entries.at(top.pos++);
+        if(entry.isDir) {
+            Frame frame;
+            frame.entries = take(entry.path);
+            entry.children = frame.entries.size();
+            this->mutex.lock();
+            QStringList jobs(mark(frame.entries));
+            this->mutex.unlock();
+            push(jobs, this->nextQueue++ % this->queues.size());
+            this->stack.push(frame);
+        }
+        return true;
+    }
+    return false;
+}
+
+QList<SafeDirEntry> SafeDirWalker::take(const QString &relative)
+{
+    QMutexLocker locker(&this->mutex);
+    forever {
+        if(this->listings.contains(relative)) {
+            QList<SafeDirEntry> entries(this->listings.take(relative));
+            this->cached -= entries.size();
+            this->scheduled.remove(relative);
+            return entries;
+        }
+        if(this->scheduled.value(relative, false)) {
+            this->ready.wait(&this->mutex); // a worker is on it
+            continue;
+        }
+        // not picked up yet, cheaper to read it here than to wait
+        this->scheduled.remove(relative);
+        locker.unlock();
+        return list(this->root, relative);
+    }
+}
+
+QStringList SafeDirWalker::mark(const QList<SafeDirEntry> &entries)
+{
+    QStringList jobs;
+    // reversed, so popping from the back reads the first directory first
+    for(int i = entries.size() - 1; i >= 0; --i) {
+        const SafeDirEntry &entry = entries.at(i);
+        if(entry.isDir && !this->scheduled.contains(entry.path)
+                && !this->listings.contains(entry.path)) {
+            this->scheduled.insert(entry.path, false);
+            jobs.append(entry.path);
+        }
+    }
+    return jobs;
+}
+
+void SafeDirWalker::push(const QStringList &jobs, int queue)
+{
+    if(jobs.isEmpty()) {
+        return;
+    }
+    Queue *q = this->queues.at(queue);
+    q->lock.lock();
+    q->jobs.append(jobs);
+    q->lock.unlock();
+
+    this->mutex.lock();
+    this->wakeup.wakeAll();
+    this->mutex.unlock();
+}
+
+bool SafeDirWalker::grab(int worker, QString &job)
+{
+    // own jobs newest first (depth first), others' oldest first (big subtrees)
+    for(int i = 0; i < this->queues.size(); ++i) {
+        Queue *q = this->queues.at((worker + i) % this->queues.size());
+        QMutexLocker locker(&q->lock);
+        if(!q->jobs.isEmpty()) {
+            job = (i == 0) ? q->jobs.takeLast() : q->jobs.takeFirst();
+            return true;
+        }
+    }
+    return false;
+}
+
+void SafeDirWalker::work(int worker)
+{
+    forever {
+        QString job;
+        if(!grab(worker, job)) {
+            QMutexLocker locker(&this->mutex);
+            if(this->stopping) {
+                return;
+            }
+            this->wakeup.wait(&this->mutex, 50);
+            continue;
+        }
+
+        this->mutex.lock();
+        if(this->stopping) {
+            this->mutex.unlock();
+            return;
+        }
+        // the consumer may have read it itself meanwhile
+        bool claimed = this->scheduled.contains(job) && !this->scheduled.value(job);
+        if(claimed) {
+            this->scheduled[job] = true;
+        }
+        this->mutex.unlock();
+        if(!claimed) {
+            continue;
+        }
+
+        QList<SafeDirEntry> entries(list(this->root, job));
+
+        // children are marked before the listing is published, so the
+        // consumer never sees a directory it could list twice
+        this->mutex.lock();
+        QStringList jobs;
+        if(this->cached < WALKER_PREFETCH_LIMIT) {
+            jobs = mark(entries);
+        }
+        this->listings.insert(job, entries);
+        this->cached += entries.size();
+        this->ready.wakeAll();
+        this->mutex.unlock();
+
+        push(jobs, worker);
+    }
+}
+
+QList<SafeDirEntry> SafeDirWalker::list(const QString &root, const QString &relative)
+{
+    QList<SafeDirEntry> entries;
+    QString path = relative.isEmpty() ? root : (root + QDir::separator() + relative);
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0) {
+        return entries;
+    }
+
+    char buffer[64 * 1024];
+    long len;
+    while((len = ::syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for(long pos = 0; pos < len;) {
+            struct linux_dirent64 *ent = reinterpret_cast<struct linux_dirent64 *>(buffer + pos);
+            pos += ent->d_reclen;
+
+            if(ent->d_name[0] == '.') {
+                continue; // ".", ".." and hidden objects
+            }
+            if(ent->d_type != DT_REG && ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN) {
+                continue; // symlinks, devices, sockets...
+            }
+
+            SafeDirEntry entry;
+            mode_t mode;
+            if(!statEntry(fd, ent->d_name, entry.fingerprint, mode)) {
+                continue;
+            }
+            if(!S_ISREG(mode) && !S_ISDIR(mode)) {
+                continue;
+            }
+
+            QString name = QFile::decodeName(ent->d_name);
+            entry.path = relative.isEmpty() ? name : (relative + QDir::separator() + name);
+            entry.isDir = S_ISDIR(mode);
+            entry.key = entry.path.toUtf8();
+            if(entry.isDir) {
+                entry.key.append('/');
+            }
+            entries.append(entry);
+        }
+    }
+    ::close(fd);
+
+    std::sort(entries.begin(), entries.end(), [](const SafeDirEntry &a, const SafeDirEntry &b){
+        return qstrcmp(a.key, b.key) < 0;
+    });
+    return entries;
+}
@@ -0,0 +1,76 @@
+#ifndef SAFEDIRWALKER_H
+#define SAFEDIRWALKER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QStringList>
+#include <QHash>
+#include <QStack>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include "safefingerprint.h"
+
+#define WALKER_PREFETCH_LIMIT 65536 // listed but not yet consumed entries
+
+struct SafeDirEntry
+{
+    QString path;       // relative to the walker root, no leading separator
+    QByteArray key;     // utf-8 path, directories end with '/'
+    bool isDir = false;
+    uint children = 0;  // directories only
+    SafeFingerprint fingerprint;
+};
+
+// Pre-order walk yielding entries sorted by key, the same order the state
+// database returns for SafeStateDb::scanIndex(). Hidden entries and symlinks
+// are skipped.
+//
+// Directories are read with getdents64 and stat'ed with statx by a pool of
+// work-stealing threads that list ahead of the consumer; next() only blocks
+// when the directory it needs is still being read.
+class SafeDirWalker
+{
+public:
+    explicit SafeDirWalker(const QString &root, int threads = QThread::idealThreadCount());
+    ~SafeDirWalker();
+    bool next(SafeDirEntry &entry);
+
+    static QList<SafeDirEntry> list(const QString &root, const QString &relative);
+
+private:
+    Q_DISABLE_COPY(SafeDirWalker)
+
+    struct Frame {
+        QList<SafeDirEntry> entries;
+        int pos = 0;
+    };
+    struct Queue {
+        QMutex lock;
+        QList<QString> jobs;
+    };
+    class Worker;
+
+    QString root;
+    QStack<Frame> stack;
+
+    QList<Queue *> queues;
+    QList<Worker *> workers;
+    QMutex mutex;
+    QWaitCondition ready;
+    QWaitCondition wakeup;
+    QHash<QString, bool> scheduled; // dir -> is being read
+    QHash<QString, QList<SafeDirEntry> > listings;
+    int cached;
+    int nextQueue;
+    bool stopping;
+
+    QList<SafeDirEntry> take(const QString &relative);
+    QStringList mark(const QList<SafeDirEntry> &entries); // mutex held
+    void push(const QStringList &jobs, int queue);
+    bool grab(int worker, QString &job);
+    void work(int worker);
+};
+
+#endif // SAFEDIRWALKER_H
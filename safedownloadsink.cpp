@@ -0,0 +1,244 @@
+#include "safedownloadsink.h"
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+
+SafeDownloadSink::SafeDownloadSink(const QString &path, qint64 expectedSize, QObject *parent) :
+    QIODevice(parent),
+    path(path),
+    expectedSize(expectedSize),
+    part(partPathFor(path)),
+    md5(QCryptographicHash::Md5),
+    written(0)
+{
+}
+
+SafeDownloadSink::~SafeDownloadSink()
+{
+    if(this->part.isOpen()) {
+        abort();
+    }
+}
+
+QString SafeDownloadSink::partPathFor(const QString &path)
+{
+    QFileInfo info(path);
+    // hidden, so the daemon ignores watcher events on it
+    return info.dir().filePath("." + info.fileName() + ".2safe-part");
+}
+
+bool SafeDownloadSink::open(OpenMode mode)
+{
+    if(mode != QIODevice::WriteOnly) {
+        return false;
+    }
+    if(!this->part.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Unable to create" << this->part.fileName();
+        return false;
+    }
+
+    preallocate();
+    this->md5.reset();
+    this->xxh.reset();
+    this->written = 0;
+    return QIODevice::open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+bool SafeDownloadSink::cloneFrom(const QString &source)
+{
+    QFile in(source);
+    if(!in.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    if(!this->part.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+        qWarning() << "Unable to create" << this->part.fileName();
+        return false;
+    }
+
+    this->md5.reset();
+    this->xxh.reset();
+    QByteArray buffer(TRANSFER_CHUNK, Qt::Uninitialized);
+    qint64 len;
+    bool cloned = ::ioctl(this->part.handle(), FICLONE, in.handle()) == 0;
+    if(cloned) {
+        // the blocks are shared, they are only read for the hash
+        while((len = this->part.read(buffer.data(), buffer.size())) > 0) {
+            this->md5.addData(buffer.constData(), len);
+            this->xxh.addData(buffer.constData(), len);
+        }
+    } else {
+        preallocate();
+        while((len = in.read(buffer.data(), buffer.size())) > 0) {
+            if(this->part.write(buffer.constData(), len) != len) {
+                len = -1;
+                break;
+            }
+            this->md5.addData(buffer.constData(), len);
+            this->xxh.addData(buffer.constData(), len);
+        }
+    }
+    if(len < 0) {
+        qWarning() << "Unable to copy" << source << "to" << this->part.fileName();
+        this->part.close();
+        this->part.remove();
+        return false;
+    }
+
+    qDebug() << (cloned ? "Cloned" : "Copied") << source << "to" << this->path;
+    this->written = this->part.size();
+    return QIODevice::open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+bool SafeDownloadSink::adopt(const QString &source)
+{
+    if(::rename(QFile::encodeName(source).constData(),
+                QFile::encodeName(this->part.fileName()).constData()) != 0) {
+        return false;
+    }
+    if(!this->part.open(QIODevice::ReadWrite)) {
+        this->part.remove();
+        return false;
+    }
+
+    this->md5.reset();
+    this->xxh.reset();
+    QByteArray buffer(TRANSFER_CHUNK, Qt::Uninitialized);
+    qint64 len;
+    while((len = this->part.read(buffer.data(), buffer.size())) > 0) {
+        this->md5.addData(buffer.constData(), len);
+        this->xxh.addData(buffer.constData(), len);
+    }
+    if(len < 0) {
+        this->part.close();
+        this->part.remove();
+        return false;
+    }
+
+    qDebug() << "Moved" << source << "to" << this->path;
+    this->written = this->part.size();
+    return QIODevice::open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+bool SafeDownloadSink::resume(qint64 offset)
+{
+    if(offset <= 0 || QFileInfo(this->part.fileName()).size() < offset) {
+        return false;
+    }
+    if(!this->part.open(QIODevice::ReadWrite) || !this->part.resize(offset)) {
+        this->part.close();
+        return false;
+    }
+
+    this->md5.reset();
+    this->xxh.reset();
+    QByteArray buffer(TRANSFER_CHUNK, Qt::Uninitialized);
+    qint64 len;
+    while((len = this->part.read(buffer.data(), buffer.size())) > 0) {
+        this->md5.addData(buffer.constData(), len);
+        this->xxh.addData(buffer.constData(), len);
+    }
+    if(len < 0 || this->part.pos() != offset) {
+        this->part.close();
+        return false;
+    }
+
+    qDebug() << "Resuming" << this->path << "at" << offset;
+    preallocate();
+    this->written = offset;
+    return QIODevice::open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+bool SafeDownloadSink::sync()
+{
+    return this->part.flush() && ::fdatasync(this->part.handle()) == 0;
+}
+
+void SafeDownloadSink::suspend()
+{
+    this->part.close();
+    QIODevice::close();
+}
+
+void SafeDownloadSink::preallocate()
+{
+    // reserve the blocks up front but keep the size at what was received
+    if(this->expectedSize > 0
+            && ::fallocate(this->part.handle(), FALLOC_FL_KEEP_SIZE, 0, this->expectedSize) != 0) {
+        qDebug() << "Preallocation is not supported for" << this->part.fileName();
+    }
+}
+
+bool SafeDownloadSink::commit(const QString &expectedHash, ulong mtime)
+{
+    if(!this->part.isOpen()) {
+        return false;
+    }
+    this->part.flush();
+
+    // nothing unverified goes into place
+    if(expectedHash.isEmpty()) {
+        qWarning() << "No checksum to verify" << this->path << "against";
+        abort();
+        return false;
+    }
+    if(this->expectedSize >= 0 && this->written != this->expectedSize) {
+        qWarning() << "Size mismatch for" << this->path << ":"
+                   << this->written << "!=" << this->expectedSize;
+        abort();
+        return false;
+    }
+    if(hash() != expectedHash) {
+        qWarning() << "Checksum mismatch for" << this->path << ":"
+                   << hash() << "!=" << expectedHash;
+        abort();
+        return false;
+    }
+
+    struct timespec times[2];
+    times[0].tv_sec = mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+    ::futimens(this->part.handle(), times);
+    ::fdatasync(this->part.handle());
+    this->part.close();
+    QIODevice::close();
+
+    if(::rename(QFile::encodeName(this->part.fileName()).constData(),
+                QFile::encodeName(this->path).constData()) != 0) {
+        qWarning() << "Unable to move" << this->part.fileName() << "to" << this->path;
+        this->part.remove();
+        return false;
+    }
+    return true;
+}
+
+void SafeDownloadSink::abort()
+{
+    this->part.close();
+    this->part.remove();
+    QIODevice::close();
+}
+
+qint64 SafeDownloadSink::readData(char *data, qint64 maxlen)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxlen);
+    return -1;
+}
+
+qint64 SafeDownloadSink::writeData(const char *data, qint64 len)
+{
+    qint64 count = this->part.write(data, len);
+    if(count > 0) {
+        this->md5.addData(data, count);
+        this->xxh.addData(data, count);
+        this->written += count;
+    }
+    return count;
+}
@@ -0,0 +1,65 @@
+#ifndef SAFEDOWNLOADSINK_H
+#define SAFEDOWNLOADSINK_H
+
+#include <QIODevice>
+#include <QFile>
+#include <QCryptographicHash>
+#include "safefasthash.h"
+
+#define TRANSFER_CHUNK (4 * 1024 * 1024) // read buffer when hashing local content
+
+// Download target that hashes data as it arrives. Data goes into a hidden,
+// preallocated part file next to the destination, which is renamed over the
+// destination only after the hash was verified.
+class SafeDownloadSink : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit SafeDownloadSink(const QString &path, qint64 expectedSize = -1,
+                              QObject *parent = 0);
+    // a part file that was never committed goes with it
+    ~SafeDownloadSink();
+
+    bool open(OpenMode mode);
+    // fills the part file from a local file that should have the same
+    // content, sharing its blocks (FICLONE) where the filesystem can and
+    // copying otherwise; it is hashed like a download, so commit() checks it
+    bool cloneFrom(const QString &source);
+    // makes source the part file by renaming it, which has to stay on the
+    // same filesystem; it is hashed like a download as well
+    bool adopt(const QString &source);
+    // continues the part file an interrupted download left: it is cut to
+    // offset and hashed again, so further data is appended after it
+    bool resume(qint64 offset);
+    // everything written so far is on disk once this returns true
+    bool sync();
+    // stops writing but keeps the part file for a later resume()
+    void suspend();
+    bool isSequential() const { return true; }
+
+    QString hash() const { return md5.result().toHex(); }
+    QString fastHash() const { return xxh.result().toHex(); }
+    QString partPath() const { return part.fileName(); }
+    // false without an expected hash, or when the content or the expected
+    // size (if known) doesn't match; the part file is removed then
+    bool commit(const QString &expectedHash, ulong mtime);
+    void abort();
+
+    static QString partPathFor(const QString &path);
+
+protected:
+    qint64 readData(char *data, qint64 maxlen);
+    qint64 writeData(const char *data, qint64 len);
+
+private:
+    QString path;
+    qint64 expectedSize;
+    QFile part;
+    QCryptographicHash md5;
+    SafeFastHash xxh;
+    qint64 written;
+
+    void preallocate();
+};
+
+#endif // SAFEDOWNLOADSINK_H
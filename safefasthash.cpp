@@ -0,0 +1,51 @@
+#include "safefasthash.h"
+
+SafeFastHash::SafeFastHash() :
+    state(XXH3_createState())
+{
+    reset();
+}
+
+SafeFastHash::~SafeFastHash()
+{
+    XXH3_freeState(this->state);
+}
+
+void SafeFastHash::reset()
+{
+    XXH3_128bits_reset(this->state);
+}
+
+void SafeFastHash::addData(const char *data, int length)
+{
+    XXH3_128bits_update(this->state, data, length);
+}
+
+bool SafeFastHash::addData(QIODevice *device)
+{
+    if(!device->isReadable()) {
+        return false;
+    }
+
+    char buffer[64 * 1024];
+    qint64 length;
+    while((length = device->read(buffer, sizeof(buffer))) > 0) {
+        addData(buffer, int(length));
+    }
+    return device->atEnd();
+}
+
+QByteArray SafeFastHash::result() const
+{
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(this->state));
+    return QByteArray(reinterpret_cast<const char *>(canonical.digest),
+                      sizeof(canonical.digest));
+}
+
+QByteArray SafeFastHash::hash(const QByteArray &data)
+{
+    SafeFastHash h;
+    h.addData(data.constData(), data.size());
+    return h.result();
+}
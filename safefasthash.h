@@ -0,0 +1,28 @@
+#ifndef SAFEFASTHASH_H
+#define SAFEFASTHASH_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <xxhash.h>
+
+// XXH3-128, used to detect local changes. Same interface as
+// QCryptographicHash; MD5 is only needed where the server's chksum is involved.
+class SafeFastHash
+{
+public:
+    SafeFastHash();
+    ~SafeFastHash();
+
+    void reset();
+    void addData(const char *data, int length);
+    bool addData(QIODevice *device);
+    QByteArray result() const;
+
+    static QByteArray hash(const QByteArray &data);
+
+private:
+    Q_DISABLE_COPY(SafeFastHash)
+    XXH3_state_t *state;
+};
+
+#endif // SAFEFASTHASH_H
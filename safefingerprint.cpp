@@ -0,0 +1,40 @@
+#include "safefingerprint.h"
+#include <QFile>
+
+bool SafeFingerprint::operator==(const SafeFingerprint &other) const
+{
+    return !isNull()
+            && this->size == other.size
+            && this->mtime_ns == other.mtime_ns
+            && this->ctime_ns == other.ctime_ns
+            && this->inode == other.inode;
+}
+
+SafeFingerprint SafeFingerprint::fromStat(const struct stat &st)
+{
+    SafeFingerprint fp;
+    fp.size = st.st_size;
+    fp.mtime_ns = qint64(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    fp.ctime_ns = qint64(st.st_ctim.tv_sec) * 1000000000LL + st.st_ctim.tv_nsec;
+    fp.inode = st.st_ino;
+    return fp;
+}
+
+SafeFingerprint SafeFingerprint::fromStatx(const struct statx &stx)
+{
+    SafeFingerprint fp;
+    fp.size = stx.stx_size;
+    fp.mtime_ns = qint64(stx.stx_mtime.tv_sec) * 1000000000LL + stx.stx_mtime.tv_nsec;
+    fp.ctime_ns = qint64(stx.stx_ctime.tv_sec) * 1000000000LL + stx.stx_ctime.tv_nsec;
+    fp.inode = stx.stx_ino;
+    return fp;
+}
+
+SafeFingerprint SafeFingerprint::fromPath(const QString &path)
+{
+    struct stat st;
+    if(::lstat(QFile::encodeName(path).constData(), &st) != 0) {
+        return SafeFingerprint();
+    }
+    return fromStat(st);
+}
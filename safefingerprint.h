@@ -0,0 +1,26 @@
+#ifndef SAFEFINGERPRINT_H
+#define SAFEFINGERPRINT_H
+
+#include <QString>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Cheap identity of a file's content: if none of these changed since the
+// last hash, the file is assumed to be unchanged and is not read again.
+struct SafeFingerprint
+{
+    qint64 size = -1;
+    qint64 mtime_ns = 0;
+    qint64 ctime_ns = 0;
+    quint64 inode = 0;
+
+    bool isNull() const { return size < 0; }
+    bool operator==(const SafeFingerprint &other) const;
+    bool operator!=(const SafeFingerprint &other) const { return !(*this == other); }
+
+    static SafeFingerprint fromStat(const struct stat &st);
+    static SafeFingerprint fromStatx(const struct statx &stx);
+    static SafeFingerprint fromPath(const QString &path);
+};
+
+#endif // SAFEFINGERPRINT_H
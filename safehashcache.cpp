@@ -0,0 +1,59 @@
+#include "safehashcache.h"
+#include <QFile>
+#include <QStringList>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+QString SafeHashCache::lookup(const QString &path, const QString &algorithm,
+                              const SafeFingerprint &fp)
+{
+    if(fp.isNull()) {
+        return QString();
+    }
+
+    char value[256];
+    QByteArray name(QByteArray(HASH_XATTR_PREFIX) + algorithm.toLatin1());
+    ssize_t len = ::getxattr(QFile::encodeName(path).constData(), name.constData(),
+                             value, sizeof(value) - 1);
+    if(len <= 0) {
+        return QString();
+    }
+    value[len] = '\0';
+
+    // <algorithm>:<hash>:<size>:<mtime_ns>
+    QStringList fields(QString::fromLatin1(value).split(':'));
+    if(fields.size() != 4 || fields.at(0) != algorithm
+            || fields.at(2).toLongLong() != fp.size
+            || fields.at(3).toLongLong() != fp.mtime_ns) {
+        return QString();
+    }
+    return fields.at(1);
+}
+
+SafeFingerprint SafeHashCache::store(const QString &path, const QString &algorithm,
+                                     const QString &hash, const SafeFingerprint &fp)
+{
+    if(fp.isNull() || hash.isEmpty()) {
+        return SafeFingerprint();
+    }
+
+    QByteArray name(QByteArray(HASH_XATTR_PREFIX) + algorithm.toLatin1());
+    QByteArray value(QString("%1:%2:%3:%4").arg(algorithm).arg(hash)
+                     .arg(fp.size).arg(fp.mtime_ns).toLatin1());
+    QByteArray file(QFile::encodeName(path));
+
+    // make sure the hash still describes what is on disk
+    SafeFingerprint now(SafeFingerprint::fromPath(path));
+    if(now.size != fp.size || now.mtime_ns != fp.mtime_ns) {
+        return SafeFingerprint();
+    }
+    if(::setxattr(file.constData(), name.constData(), value.constData(), value.size(), 0) != 0) {
+        return now; // no xattr support here, index as is
+    }
+    // setxattr bumps ctime
+    now = SafeFingerprint::fromPath(path);
+    if(now.size != fp.size || now.mtime_ns != fp.mtime_ns) {
+        return SafeFingerprint();
+    }
+    return now;
+}
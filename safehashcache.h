@@ -0,0 +1,23 @@
+#ifndef SAFEHASHCACHE_H
+#define SAFEHASHCACHE_H
+
+#include <QString>
+#include "safefingerprint.h"
+
+#define HASH_XATTR_PREFIX "user.2safe."
+
+// Content hashes kept in extended attributes of the files themselves, so
+// they survive the loss of the state databases. An entry is only trusted
+// while the file's size and mtime are the ones it was computed for.
+class SafeHashCache
+{
+public:
+    static QString lookup(const QString &path, const QString &algorithm,
+                          const SafeFingerprint &fp);
+    // returns the fingerprint after the attribute was written, or a null
+    // one if the file was changed since fp was taken
+    static SafeFingerprint store(const QString &path, const QString &algorithm,
+                                 const QString &hash, const SafeFingerprint &fp);
+};
+
+#endif // SAFEHASHCACHE_H
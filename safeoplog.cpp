@@ -0,0 +1,166 @@
+#include "safeoplog.h"
+#include <algorithm>
+
+namespace {
+
+struct State {
+    QString origin;     // where the server has it, empty if it is new
+    bool isDir = false;
+    bool own = false;   // moved by itself, not only along with a directory
+    bool upload = false;
+    bool makeDir = false;
+    qint64 seq = 0;
+    qint64 moveSeq = 0;
+};
+
+bool under(const QString &path, const QString &dir)
+{
+    return path.startsWith(dir + '/');
+}
+
+SafeOpEntry makeOp(SafeOpEntry::Operation operation, const QString &path, bool isDir,
+                   qint64 seq, const QString &from = QString())
+{
+    SafeOpEntry entry;
+    entry.seq = seq;
+    entry.operation = operation;
+    entry.path = path;
+    entry.from = from;
+    entry.isDir = isDir;
+    entry.known = !from.isEmpty() || operation == SafeOpEntry::Remove;
+    return entry;
+}
+
+}
+
+SafeOpLog::SafeOpLog(SafeStateDb *db) :
+    db(db)
+{
+    this->count = this->db->getOps().size();
+}
+
+void SafeOpLog::record(SafeOpEntry::Operation operation, const QString &path, bool isDir,
+                       bool known, const QString &from)
+{
+    SafeOpEntry entry;
+    entry.operation = operation;
+    entry.path = path;
+    entry.from = from;
+    entry.isDir = isDir;
+    entry.known = known;
+    this->db->appendOp(entry);
+    ++this->count;
+}
+
+QList<SafeOpEntry> SafeOpLog::take()
+{
+    QList<SafeOpEntry> ops(this->db->getOps());
+    this->db->clearOps();
+    this->count = 0;
+    return compact(ops);
+}
+
+QList<SafeOpEntry> SafeOpLog::compact(const QList<SafeOpEntry> &ops)
+{
+    QMap<QString, State> states; // by local path
+    QList<SafeOpEntry> result;
+
+    // state of path so far, or what the server has if it wasn't touched
+    auto take = [&](const QString &path, bool isDir, bool known) {
+        if(states.contains(path)) {
+            return states.take(path);
+        }
+        State s;
+        s.isDir = isDir;
+        if(known) {
+            s.origin = path;
+        }
+        return s;
+    };
+    auto takeChildren = [&](const QString &dir) {
+        QList<QPair<QString, State> > children;
+        auto it = states.lowerBound(dir + '/');
+        while(it != states.end() && under(it.key(), dir)) {
+            children.append(qMakePair(it.key(), it.value()));
+            it = states.erase(it);
+        }
+        return children;
+    };
+
+    foreach(SafeOpEntry op, ops) {
+        switch(op.operation) {
+        case SafeOpEntry::Upload:
+        case SafeOpEntry::MakeDir: {
+            State s(take(op.path, op.isDir, op.known));
+            s.upload |= op.operation == SafeOpEntry::Upload;
+            s.makeDir |= op.operation == SafeOpEntry::MakeDir;
+            s.seq = op.seq;
+            states.insert(op.path, s);
+            break;
+        }
+        case SafeOpEntry::Remove: {
+            State s(take(op.path, op.isDir, op.known));
+            if(op.isDir) {
+                typedef QPair<QString, State> Child;
+                foreach(Child child, takeChildren(op.path)) {
+                    // moved in from elsewhere, so not gone with the directory
+                    const State &c = child.second;
+                    if(!c.origin.isEmpty() && (s.origin.isEmpty() || !under(c.origin, s.origin))) {
+                        result.append(makeOp(SafeOpEntry::Remove, c.origin, c.isDir, op.seq));
+                    }
+                }
+            }
+            if(!s.origin.isEmpty()) {
+                result.append(makeOp(SafeOpEntry::Remove, s.origin, s.isDir, op.seq));
+            }
+            break;
+        }
+        case SafeOpEntry::Move: {
+            bool fresh = !states.contains(op.from);
+            State s(take(op.from, op.isDir, op.known));
+            if(fresh && !op.known) {
+                // never made it to the server, so it goes up under its new name
+                s.upload = !op.isDir;
+                s.makeDir = op.isDir;
+            }
+            s.own = true;
+            s.seq = qMax(s.seq, op.seq);
+            s.moveSeq = op.seq;
+            if(op.isDir) {
+                // carried along on the server; whatever they do next has
+                // to wait for the directory to get there
+                typedef QPair<QString, State> Child;
+                foreach(Child child, takeChildren(op.from)) {
+                    State c(child.second);
+                    c.seq = qMax(c.seq, op.seq);
+                    c.moveSeq = qMax(c.moveSeq, op.seq);
+                    states.insert(op.path + child.first.mid(op.from.length()), c);
+                }
+            }
+            states.insert(op.path, s);
+            break;
+        }
+        }
+    }
+
+    for(auto it = states.constBegin(); it != states.constEnd(); ++it) {
+        const State &s = it.value();
+        if(s.own && !s.origin.isEmpty() && s.origin != it.key()) {
+            result.append(makeOp(SafeOpEntry::Move, it.key(), s.isDir, s.moveSeq, s.origin));
+        }
+        if(s.isDir && s.makeDir && s.origin.isEmpty()) {
+            result.append(makeOp(SafeOpEntry::MakeDir, it.key(), true, s.seq));
+        } else if(!s.isDir && s.upload) {
+            result.append(makeOp(SafeOpEntry::Upload, it.key(), false, s.seq));
+        }
+    }
+
+    // log order, parents before their children
+    std::stable_sort(result.begin(), result.end(), [](const SafeOpEntry &a, const SafeOpEntry &b){
+        if(a.seq != b.seq) {
+            return a.seq < b.seq;
+        }
+        return a.path.count('/') < b.path.count('/');
+    });
+    return result;
+}
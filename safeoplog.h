@@ -0,0 +1,33 @@
+#ifndef SAFEOPLOG_H
+#define SAFEOPLOG_H
+
+#include <QList>
+#include <QMap>
+#include "safestatedb.h"
+
+// Durable log of what changed locally while the server was out of reach.
+// It is replayed in compacted form: every path ends up with its net
+// effect, so create-modify-modify is one upload, create-then-delete is
+// nothing and a chain of renames is one move from where the server has it.
+class SafeOpLog
+{
+public:
+    explicit SafeOpLog(SafeStateDb *db);
+
+    void record(SafeOpEntry::Operation operation, const QString &path, bool isDir,
+                bool known, const QString &from = QString());
+    bool isEmpty() const { return count == 0; }
+    int size() const { return count; }
+    // the compacted log, which is cleared
+    QList<SafeOpEntry> take();
+
+    // net effect of ops, in the order it has to be replayed: log order,
+    // with everything a path did kept where its last step happened
+    static QList<SafeOpEntry> compact(const QList<SafeOpEntry> &ops);
+
+private:
+    SafeStateDb *db;
+    int count;
+};
+
+#endif // SAFEOPLOG_H
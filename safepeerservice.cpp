@@ -0,0 +1,423 @@
+#include "safepeerservice.h"
+#include <QStringList>
+#include <QFile>
+#include <QUuid>
+#include <QDateTime>
+#include <QJsonDocument>
+#include <QMessageAuthenticationCode>
+#include <QNetworkInterface>
+#include <QSslCipher>
+#include <QSslConfiguration>
+#include <QSslPreSharedKeyAuthenticator>
+#include <QDebug>
+
+#define PEER_BLOCK (256 * 1024)
+#define PEER_IDENTITY "2safe-peer"
+
+namespace {
+
+// hands accepted sockets over before anything is read from them, so they
+// can be wrapped in TLS
+class SafePeerServer : public QTcpServer
+{
+public:
+    SafePeerServer(std::function<void(qintptr)> accept, QObject *parent) :
+        QTcpServer(parent),
+        accept(accept)
+    {
+    }
+
+protected:
+    void incomingConnection(qintptr descriptor) override
+    {
+        this->accept(descriptor);
+    }
+
+private:
+    std::function<void(qintptr)> accept;
+};
+
+}
+
+// One fetch, trying candidates in turn until one answers OK; after that it
+// either gets all of the content or fails as a whole
+class SafePeerFetch : public QObject
+{
+public:
+    SafePeerFetch(SafePeerService *service, const QString &hash, qint64 size,
+                  QIODevice *device, SafePeerService::Callback done) :
+        QObject(service),
+        service(service),
+        hash(hash.toLatin1()),
+        size(size),
+        device(device),
+        done(done),
+        socket(0),
+        state(Idle),
+        received(0)
+    {
+        this->candidates = service->candidates();
+        this->timer = new QTimer(this);
+        this->timer->setSingleShot(true);
+        connect(this->timer, &QTimer::timeout, this, [this](){
+            qDebug() << "Peer" << this->peer << "timed out";
+            next();
+        });
+        // done is never called from within fetch()
+        QTimer::singleShot(0, this, [this](){ next(); });
+    }
+
+private:
+    enum State { Idle, Handshake, Header, Body };
+
+    SafePeerService *service;
+    QByteArray hash;
+    qint64 size;
+    QIODevice *device;
+    SafePeerService::Callback done;
+    QStringList candidates;
+    QString peer;
+    QSslSocket *socket;
+    QTimer *timer;
+    State state;
+    qint64 received;
+
+    void next()
+    {
+        if(this->state == Body) {
+            // content was partly written, another peer can't continue it
+            finish(false);
+            return;
+        }
+        if(this->socket) {
+            this->socket->disconnect(this);
+            this->socket->abort();
+            this->socket->deleteLater();
+            this->socket = 0;
+        }
+        if(this->candidates.isEmpty()) {
+            finish(false);
+            return;
+        }
+
+        this->peer = this->candidates.takeFirst();
+        int colon = this->peer.lastIndexOf(':');
+        this->socket = new QSslSocket(this);
+        this->service->secure(this->socket);
+        this->state = Handshake;
+        connect(this->socket, &QSslSocket::encrypted, this, [this](){
+            this->timer->start(PEER_TIMEOUT);
+            this->socket->write("GET " + this->hash + " " + QByteArray::number(this->size) + "\n");
+            this->state = Header;
+        });
+        connect(this->socket, &QSslSocket::readyRead, this, [this](){ read(); });
+        connect(this->socket, &QSslSocket::disconnected, this, [this](){
+            if(this->state != Idle) {
+                next();
+            }
+        });
+        connect(this->socket, static_cast<void(QAbstractSocket::*)(QAbstractSocket::SocketError)>(
+                    &QAbstractSocket::error), this, [this](QAbstractSocket::SocketError){
+            if(this->state != Idle) {
+                next();
+            }
+        });
+        this->timer->start(PEER_TIMEOUT);
+        this->socket->connectToHostEncrypted(this->peer.left(colon),
+                                             this->peer.mid(colon + 1).toUShort());
+    }
+
+    void read()
+    {
+        this->timer->start(PEER_TIMEOUT);
+        if(this->state == Header && this->socket->canReadLine()) {
+            QList<QByteArray> words(this->socket->readLine().trimmed().split(' '));
+            qint64 length = words.size() == 2 ? words.at(1).toLongLong() : -1;
+            if(words.at(0) != "OK" || length < 0 || (this->size > 0 && length != this->size)) {
+                next();
+                return;
+            }
+            qDebug() << "Fetching" << this->hash << "from peer" << this->peer;
+            this->size = length;
+            this->state = Body;
+        }
+        if(this->state == Body) {
+            QByteArray data(this->socket->read(this->size - this->received));
+            if(!data.isEmpty() && this->device->write(data) != data.size()) {
+                finish(false);
+                return;
+            }
+            this->received += data.size();
+            if(this->received == this->size) {
+                finish(true);
+            }
+        }
+    }
+
+    void finish(bool ok)
+    {
+        this->state = Idle;
+        this->timer->stop();
+        if(this->socket) {
+            this->socket->disconnect(this);
+            this->socket->abort();
+        }
+        if(ok) {
+            ++this->service->fetchedFiles;
+            this->service->fetchedBytes += this->size;
+        } else {
+            ++this->service->failures;
+        }
+        deleteLater();
+        this->done(ok);
+    }
+};
+
+SafePeerService::SafePeerService(const QByteArray &key, QSettings *settings, Locator locate,
+                                 QObject *parent) :
+    QObject(parent),
+    key(key),
+    settings(settings),
+    locate(locate),
+    servedFiles(0),
+    servedBytes(0),
+    fetchedFiles(0),
+    fetchedBytes(0),
+    failures(0),
+    rejected(0)
+{
+    this->tag = QMessageAuthenticationCode::hash("2safe-peer-announce", this->key,
+                                                 QCryptographicHash::Sha256).toHex().left(16);
+    this->instance = QUuid::createUuid().toString();
+
+    this->server = new SafePeerServer([this](qintptr descriptor){
+        serve(descriptor);
+    }, this);
+    quint16 port = this->settings->value("peer_port", PEER_PORT).toUInt();
+    if(!QSslSocket::supportsSsl()) {
+        // nothing goes over the network in the clear
+        qWarning() << "No TLS support, not exchanging content with peers";
+    } else if(!this->server->listen(QHostAddress::Any, port)) {
+        qWarning() << "Unable to serve peers on port" << port << ":" << this->server->errorString();
+    }
+
+    // several daemons on one host share the discovery port
+    this->udp = new QUdpSocket(this);
+    connect(this->udp, &QUdpSocket::readyRead, this, &SafePeerService::readDatagrams);
+    quint16 discovery = this->settings->value("peer_discovery_port", PEER_DISCOVERY_PORT).toUInt();
+    if(!this->udp->bind(QHostAddress::AnyIPv4, discovery,
+                        QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+        qWarning() << "Unable to listen for peers on port" << discovery;
+    }
+
+    this->announcer = new QTimer(this);
+    this->announcer->setTimerType(Qt::VeryCoarseTimer);
+    connect(this->announcer, &QTimer::timeout, this, &SafePeerService::announce);
+    this->announcer->start(PEER_ANNOUNCE_INTERVAL);
+    announce();
+}
+
+QByteArray SafePeerService::newKey()
+{
+    QFile random("/dev/urandom");
+    if(!random.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    QByteArray key(random.read(PEER_KEY_SIZE));
+    return key.size() == PEER_KEY_SIZE ? key : QByteArray();
+}
+
+bool SafePeerService::isLocal(const QHostAddress &address)
+{
+    // IPv4 peers of a dual stack server come as mapped IPv6 addresses
+    QHostAddress peer(address);
+    bool v4 = false;
+    quint32 ip = address.toIPv4Address(&v4);
+    if(v4) {
+        peer = QHostAddress(ip);
+    }
+    // on a network of one of our interfaces, loopback included
+    foreach(QNetworkInterface interface, QNetworkInterface::allInterfaces()) {
+        if(!(interface.flags() & QNetworkInterface::IsUp)) {
+            continue;
+        }
+        foreach(QNetworkAddressEntry entry, interface.addressEntries()) {
+            if(entry.prefixLength() >= 0 && peer.isInSubnet(entry.ip(), entry.prefixLength())) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void SafePeerService::secure(QSslSocket *socket)
+{
+    // no certificates: both sides prove they have the key in the handshake
+    QSslConfiguration config(socket->sslConfiguration());
+    QList<QSslCipher> ciphers;
+    foreach(QString name, QStringList() << "PSK-AES256-GCM-SHA384" << "PSK-AES128-GCM-SHA256"
+            << "PSK-AES256-CBC-SHA" << "PSK-AES128-CBC-SHA") {
+        QSslCipher cipher(name);
+        if(!cipher.isNull()) {
+            ciphers.append(cipher);
+        }
+    }
+    config.setCiphers(ciphers);
+    config.setPeerVerifyMode(QSslSocket::VerifyNone);
+    config.setProtocol(QSsl::TlsV1_2OrLater);
+    socket->setSslConfiguration(config);
+    connect(socket, &QSslSocket::preSharedKeyAuthenticationRequired, socket,
+            [this](QSslPreSharedKeyAuthenticator *authenticator){
+        authenticator->setIdentity(PEER_IDENTITY);
+        authenticator->setPreSharedKey(this->key);
+    });
+}
+
+void SafePeerService::announce()
+{
+    if(!this->server->isListening()) {
+        return;
+    }
+    QJsonObject obj;
+    obj.insert("tag", QString(this->tag));
+    obj.insert("instance", this->instance);
+    obj.insert("port", this->server->serverPort());
+    quint16 discovery = this->settings->value("peer_discovery_port", PEER_DISCOVERY_PORT).toUInt();
+    this->udp->writeDatagram(QJsonDocument(obj).toJson(QJsonDocument::Compact),
+                             QHostAddress::Broadcast, discovery);
+}
+
+void SafePeerService::readDatagrams()
+{
+    while(this->udp->hasPendingDatagrams()) {
+        QByteArray datagram(int(this->udp->pendingDatagramSize()), Qt::Uninitialized);
+        QHostAddress sender;
+        this->udp->readDatagram(datagram.data(), datagram.size(), &sender);
+
+        if(!isLocal(sender)) {
+            continue;
+        }
+        QJsonObject obj(QJsonDocument::fromJson(datagram).object());
+        if(obj.value("tag").toString().toLatin1() != this->tag
+                || obj.value("instance").toString() == this->instance) {
+            continue; // another account, or our own
+        }
+        QString peer(sender.toString() + ":" + QString::number(obj.value("port").toInt()));
+        if(!this->peers.contains(peer)) {
+            qDebug() << "Found peer" << peer;
+        }
+        this->peers.insert(peer, QDateTime::currentMSecsSinceEpoch());
+    }
+}
+
+QStringList SafePeerService::candidates() const
+{
+    QStringList result(this->settings->value("peers", "").toString()
+                       .split(',', QString::SkipEmptyParts));
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for(auto it = this->peers.constBegin(); it != this->peers.constEnd(); ++it) {
+        if(now - it.value() < PEER_EXPIRY && !result.contains(it.key())) {
+            result.append(it.key());
+        }
+    }
+    return result;
+}
+
+bool SafePeerService::hasPeers() const
+{
+    return QSslSocket::supportsSsl() && !candidates().isEmpty();
+}
+
+QObject *SafePeerService::fetch(const QString &hash, qint64 size, QIODevice *device,
+                                Callback done)
+{
+    return new SafePeerFetch(this, hash, size, device, done);
+}
+
+void SafePeerService::serve(qintptr descriptor)
+{
+    QSslSocket *socket = new QSslSocket(this);
+    if(!socket->setSocketDescriptor(descriptor)) {
+        delete socket;
+        return;
+    }
+    if(!isLocal(socket->peerAddress())) {
+        qWarning() << "Rejected peer connection from" << socket->peerAddress().toString();
+        ++this->rejected;
+        socket->abort();
+        socket->deleteLater();
+        return;
+    }
+
+    connect(socket, &QSslSocket::disconnected, socket, &QObject::deleteLater);
+    connect(socket, &QSslSocket::readyRead, this, [=](){
+        if(socket->canReadLine() && !socket->property("answered").toBool()) {
+            socket->setProperty("answered", true);
+            answer(socket);
+        }
+    });
+    // a peer that doesn't ask in time is dropped, as is one with another
+    // key, whose handshake fails
+    QTimer::singleShot(PEER_TIMEOUT, socket, [socket](){
+        if(!socket->property("answered").toBool()) {
+            socket->abort();
+        }
+    });
+    secure(socket);
+    socket->startServerEncryption();
+}
+
+void SafePeerService::answer(QSslSocket *socket)
+{
+    QList<QByteArray> words(socket->readLine().trimmed().split(' '));
+    if(words.size() != 3 || words.at(0) != "GET") {
+        ++this->rejected;
+        socket->write("NO\n");
+        socket->disconnectFromHost();
+        return;
+    }
+
+    qint64 size = words.at(2).toLongLong();
+    QString path(this->locate(QString::fromLatin1(words.at(1)), size > 0 ? size : -1));
+    QFile *file = new QFile(path, socket);
+    if(path.isEmpty() || !file->open(QIODevice::ReadOnly)) {
+        socket->write("NO\n");
+        socket->disconnectFromHost();
+        return;
+    }
+
+    qDebug() << "Serving" << path << "to peer" << socket->peerAddress().toString();
+    ++this->servedFiles;
+    socket->write("OK " + QByteArray::number(file->size()) + "\n");
+    auto pump = [=](){
+        // a few blocks in flight, not the whole file in memory
+        while(socket->bytesToWrite() < 4 * PEER_BLOCK && !file->atEnd()) {
+            QByteArray block(file->read(PEER_BLOCK));
+            if(block.isEmpty()) {
+                socket->abort();
+                return;
+            }
+            this->servedBytes += block.size();
+            socket->write(block);
+        }
+        if(file->atEnd() && socket->bytesToWrite() == 0) {
+            socket->disconnectFromHost();
+        }
+    };
+    connect(socket, &QSslSocket::bytesWritten, file, pump);
+    pump();
+}
+
+QJsonObject SafePeerService::stats() const
+{
+    QJsonObject values;
+    values.insert("peers", candidates().size());
+    values.insert("listening", this->server->isListening());
+    values.insert("served_files", (qint64)this->servedFiles);
+    values.insert("served_bytes", (qint64)this->servedBytes);
+    values.insert("fetched_files", (qint64)this->fetchedFiles);
+    values.insert("fetched_bytes", (qint64)this->fetchedBytes);
+    values.insert("failed", (qint64)this->failures);
+    values.insert("rejected", (qint64)this->rejected);
+    return values;
+}
@@ -0,0 +1,86 @@
+#ifndef SAFEPEERSERVICE_H
+#define SAFEPEERSERVICE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QHash>
+#include <QSettings>
+#include <QJsonObject>
+#include <QUdpSocket>
+#include <QTcpServer>
+#include <QSslSocket>
+#include <functional>
+
+#define PEER_DISCOVERY_PORT 47616
+#define PEER_PORT 47617
+#define PEER_ANNOUNCE_INTERVAL (30 * 1000)
+#define PEER_EXPIRY (3 * PEER_ANNOUNCE_INTERVAL)
+#define PEER_TIMEOUT (10 * 1000) // ms without progress from a peer
+#define PEER_KEY_SIZE 32
+
+// Content exchange with other daemons of the same account on the local
+// network. Daemons announce themselves by UDP broadcast on
+// "peer_discovery_port" and serve files by MD5 over TCP on "peer_port";
+// "peers" adds fixed "host:port" entries, e.g. two daemons on loopback.
+// Connections and announcements from outside the networks of the local
+// interfaces are ignored.
+//
+// Everything is keyed by a random key the daemons of an account share.
+// Announcements carry a tag derived from it, so other accounts are
+// ignored, and connections are TLS with the key as pre-shared key, so
+// nothing is served to or read by anyone without it. What arrives is only
+// trusted once its MD5 was checked by the caller against the remote index.
+class SafePeerService : public QObject
+{
+    Q_OBJECT
+public:
+    // absolute path of an indexed local file with that MD5 and size (-1
+    // if unknown), or empty
+    typedef std::function<QString(const QString &hash, qint64 size)> Locator;
+    typedef std::function<void(bool ok)> Callback;
+
+    SafePeerService(const QByteArray &key, QSettings *settings, Locator locate,
+                    QObject *parent = 0);
+
+    // PEER_KEY_SIZE random bytes, empty if there is no source for them
+    static QByteArray newKey();
+    static bool isLocal(const QHostAddress &address);
+
+    bool hasPeers() const;
+    // writes the content of hash, size bytes of it (0 if unknown), to device
+    // from the first peer that has it; done is called later, false if no peer had
+    // it or a transfer broke off. The returned object is the attempt,
+    // deleting it cancels without a call to done
+    QObject *fetch(const QString &hash, qint64 size, QIODevice *device, Callback done);
+    QJsonObject stats() const;
+
+private slots:
+    void announce();
+    void readDatagrams();
+
+private:
+    QByteArray key;
+    QByteArray tag;
+    QString instance;
+    QSettings *settings;
+    Locator locate;
+    QUdpSocket *udp;
+    QTcpServer *server;
+    QTimer *announcer;
+    QHash<QString, qint64> peers; // "host:port" -> last seen
+    quint64 servedFiles;
+    quint64 servedBytes;
+    quint64 fetchedFiles;
+    quint64 fetchedBytes;
+    quint64 failures;
+    quint64 rejected;
+
+    QStringList candidates() const;
+    void secure(QSslSocket *socket);
+    void serve(qintptr descriptor);
+    void answer(QSslSocket *socket);
+
+    friend class SafePeerFetch;
+};
+
+#endif // SAFEPEERSERVICE_H
@@ -0,0 +1,151 @@
+#include "saferatelimiter.h"
+#include <QStringList>
+#include <QDebug>
+
+SafeRateLimiter::SafeRateLimiter(QObject *parent) :
+    QObject(parent),
+    bytesPerSecond(0),
+    tokens(0)
+{
+    this->clock.start();
+    this->timer = new QTimer(this);
+    this->timer->setSingleShot(true);
+    connect(this->timer, &QTimer::timeout, this, &SafeRateLimiter::refilled);
+}
+
+void SafeRateLimiter::setRate(qint64 rate)
+{
+    rate = qMax<qint64>(rate, 0);
+    if(rate == this->bytesPerSecond) {
+        return;
+    }
+    refill();
+    qDebug() << "Rate limit changed from" << this->bytesPerSecond << "to" << rate << "B/s";
+    bool wasUnlimited = (this->bytesPerSecond == 0);
+    this->bytesPerSecond = rate;
+    this->tokens = wasUnlimited ? burst() : qMin<double>(this->tokens, burst());
+    // waiters recompute their wait against the new rate
+    this->timer->stop();
+    emit refilled();
+}
+
+qint64 SafeRateLimiter::take(qint64 wanted)
+{
+    if(this->bytesPerSecond == 0 || wanted <= 0) {
+        return wanted;
+    }
+
+    refill();
+    // one transfer must not drain what the others are waiting for
+    qint64 grant = qMin<qint64>(wanted, qMax<qint64>(burst() / 4, RATE_MIN_GRANT));
+    grant = qMin<qint64>(grant, qint64(this->tokens));
+    if(grant <= 0) {
+        if(!this->timer->isActive()) {
+            qint64 need = qMin<qint64>(RATE_MIN_GRANT, burst()) - qint64(this->tokens);
+            this->timer->start(int(qMax<qint64>(need * 1000 / this->bytesPerSecond, 1)));
+        }
+        return 0;
+    }
+    this->tokens -= grant;
+    return grant;
+}
+
+qint64 SafeRateLimiter::burst() const
+{
+    return qMax<qint64>(this->bytesPerSecond, RATE_MIN_GRANT);
+}
+
+void SafeRateLimiter::refill()
+{
+    qint64 elapsed = this->clock.restart();
+    this->tokens = qMin<double>(this->tokens + elapsed * this->bytesPerSecond / 1000.0,
+                                burst());
+}
+
+bool SafeRateLimiter::scheduledRates(const QString &schedule, const QTime &now,
+                                     qint64 *up, qint64 *down)
+{
+    foreach(QString window, schedule.split(';', QString::SkipEmptyParts)) {
+        QStringList parts(window.trimmed().split('='));
+        QStringList span(parts.value(0).split('-'));
+        QStringList rates(parts.value(1).split('/'));
+        QTime from(QTime::fromString(span.value(0).trimmed(), "HH:mm"));
+        QTime to(QTime::fromString(span.value(1).trimmed(), "HH:mm"));
+        if(parts.size() != 2 || rates.size() != 2 || !from.isValid() || !to.isValid()) {
+            qWarning() << "Ignoring malformed rate schedule entry" << window;
+            continue;
+        }
+
+        bool inside = (from <= to) ? (now >= from && now < to)
+                                   : (now >= from || now < to);
+        if(inside) {
+            *up = rates.at(0).trimmed().toLongLong() * 1024;
+            *down = rates.at(1).trimmed().toLongLong() * 1024;
+            return true;
+        }
+    }
+    return false;
+}
+
+SafeReplyThrottle::SafeReplyThrottle(QNetworkReply *reply, SafeRateLimiter *limiter) :
+    QObject(reply),
+    reply(reply),
+    limiter(limiter),
+    received(0),
+    owed(0),
+    finishedBefore(false),
+    errorBefore(QNetworkReply::NoError)
+{
+    this->reply->setReadBufferSize(4 * RATE_MIN_GRANT);
+    connect(this->reply, &QNetworkReply::downloadProgress, this, [this](qint64 bytesReceived, qint64){
+        charge(bytesReceived);
+    });
+    connect(this->limiter, &SafeRateLimiter::refilled, this, &SafeReplyThrottle::pay);
+}
+
+void SafeReplyThrottle::charge(qint64 bytesReceived)
+{
+    this->owed += bytesReceived - this->received;
+    this->received = bytesReceived;
+    if(this->owed <= 0 || this->reply->signalsBlocked()) {
+        return;
+    }
+    this->owed -= this->limiter->take(this->owed);
+    if(this->owed > 0) {
+        // only a reply that delivers its body is held, its handshake (and
+        // with it any sslErrors) is over by then
+        this->finishedBefore = this->reply->isFinished();
+        this->errorBefore = this->reply->error();
+        this->reply->blockSignals(true);
+        // take() starts the refill timer when it runs dry
+        pay();
+    }
+}
+
+void SafeReplyThrottle::pay()
+{
+    if(!this->reply->signalsBlocked()) {
+        return;
+    }
+    qint64 granted;
+    while(this->owed > 0 && (granted = this->limiter->take(this->owed)) > 0) {
+        this->owed -= granted;
+    }
+    if(this->owed > 0) {
+        return;
+    }
+
+    // what was held back is told now; a reader must not take a body cut
+    // short by an error for a complete one
+    this->reply->blockSignals(false);
+    if(this->reply->bytesAvailable() > 0) {
+        emit this->reply->readyRead();
+    }
+    QNetworkReply::NetworkError code = this->reply->error();
+    if(code != QNetworkReply::NoError && code != this->errorBefore) {
+        emit this->reply->error(code);
+    }
+    if(this->reply->isFinished() && !this->finishedBefore) {
+        emit this->reply->finished();
+    }
+}
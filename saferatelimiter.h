@@ -0,0 +1,71 @@
+#ifndef SAFERATELIMITER_H
+#define SAFERATELIMITER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QTime>
+#include <QElapsedTimer>
+#include <QNetworkReply>
+
+#define RATE_MIN_GRANT (16 * 1024) // smallest refill worth waking a transfer for
+
+// Token bucket shared by every transfer in one direction. Devices take()
+// tokens before moving data and wait for refilled() when they get none, so
+// a new rate applies to running transfers on their next read or write.
+class SafeRateLimiter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SafeRateLimiter(QObject *parent = 0);
+
+    // bytes per second, 0 means unlimited
+    void setRate(qint64 rate);
+    qint64 rate() const { return bytesPerSecond; }
+    // grants up to wanted bytes, 0 when the bucket is empty
+    qint64 take(qint64 wanted);
+
+    // "HH:MM-HH:MM=UP/DOWN;..." in KB/s, first matching window wins;
+    // windows may wrap around midnight
+    static bool scheduledRates(const QString &schedule, const QTime &now,
+                               qint64 *up, qint64 *down);
+
+signals:
+    void refilled();
+
+private:
+    qint64 bytesPerSecond;
+    double tokens;
+    QElapsedTimer clock;
+    QTimer *timer;
+
+    qint64 burst() const;
+    void refill();
+};
+
+// Paces a download at its source, since whoever reads the reply expects
+// every write to be taken whole. The reply buffers at most a few grants,
+// so the socket stops reading once that is full; while what was received
+// is not paid for, the reply's signals are held back and nothing drains
+// the buffer. Whatever the reply reported meanwhile (data, an error, its
+// end) is told again once it is paid for, in the order the reply would
+// have. Goes with the reply.
+class SafeReplyThrottle : public QObject
+{
+    Q_OBJECT
+public:
+    SafeReplyThrottle(QNetworkReply *reply, SafeRateLimiter *limiter);
+
+private:
+    QNetworkReply *reply;
+    SafeRateLimiter *limiter;
+    qint64 received;
+    qint64 owed;
+    // when the signals were held back
+    bool finishedBefore;
+    QNetworkReply::NetworkError errorBefore;
+
+    void charge(qint64 bytesReceived);
+    void pay();
+};
+
+#endif // SAFERATELIMITER_H
@@ -0,0 +1,70 @@
+#include "saferesumabletarget.h"
+#include <QFile>
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+#include <unistd.h>
+
+SafeMirrorResumableTarget::SafeMirrorResumableTarget(const QString &root) :
+    root(root)
+{
+}
+
+QString SafeMirrorResumableTarget::filePath(const QString &relative) const
+{
+    return QDir(this->root).filePath(relative);
+}
+
+QString SafeMirrorResumableTarget::uploadPath(const QString &relative) const
+{
+    return filePath(relative) + ".upload";
+}
+
+qint64 SafeMirrorResumableTarget::offset(const QString &relative)
+{
+    QFileInfo upload(uploadPath(relative));
+    return upload.exists() ? upload.size() : 0;
+}
+
+bool SafeMirrorResumableTarget::append(const QString &relative, qint64 offset,
+                                       const QByteArray &data)
+{
+    QString path(uploadPath(relative));
+    QDir().mkpath(QFileInfo(path).path());
+    QFile upload(path);
+    if(!upload.open(QIODevice::ReadWrite) || upload.size() < offset
+            || !upload.resize(offset) || !upload.seek(offset)) {
+        return false;
+    }
+    if(upload.write(data) != data.size() || !upload.flush()) {
+        return false;
+    }
+    // acknowledged means it survives a crash, as a server's would
+    return ::fdatasync(upload.handle()) == 0;
+}
+
+bool SafeMirrorResumableTarget::finish(const QString &relative)
+{
+    QString path(filePath(relative));
+    QFile::remove(path);
+    if(!QFile::rename(uploadPath(relative), path)) {
+        return false;
+    }
+    qDebug() << "Upload of" << relative << "complete";
+    return true;
+}
+
+qint64 SafeMirrorResumableTarget::size(const QString &relative)
+{
+    QFileInfo file(filePath(relative));
+    return file.isFile() ? file.size() : -1;
+}
+
+QByteArray SafeMirrorResumableTarget::read(const QString &relative, qint64 offset, qint64 length)
+{
+    QFile file(filePath(relative));
+    if(!file.open(QIODevice::ReadOnly) || !file.seek(offset)) {
+        return QByteArray();
+    }
+    return file.read(length);
+}
@@ -0,0 +1,45 @@
+#ifndef SAFERESUMABLETARGET_H
+#define SAFERESUMABLETARGET_H
+
+#include <QString>
+#include <QByteArray>
+
+// Backend taking uploads and handing out files a range at a time, so a
+// transfer that was broken off goes on from the last range it acknowledged.
+// The 2safe API has neither ranged pulls nor resumable pushes yet, so
+// transfers go through pushFile/pullFile unless a target is configured.
+class SafeResumableTarget
+{
+public:
+    virtual ~SafeResumableTarget() {}
+    // bytes of an unfinished upload of relative the target holds, 0 if none
+    virtual qint64 offset(const QString &relative) = 0;
+    // stores data at offset, dropping whatever the upload held past it;
+    // refused when offset is beyond what it holds
+    virtual bool append(const QString &relative, qint64 offset, const QByteArray &data) = 0;
+    // the complete upload replaces the file
+    virtual bool finish(const QString &relative) = 0;
+    // size of the file, -1 if the target has none
+    virtual qint64 size(const QString &relative) = 0;
+    virtual QByteArray read(const QString &relative, qint64 offset, qint64 length) = 0;
+};
+
+// Local stand-in keeping the files in a directory ("transfer_mirror"
+// setting), for exercising resumed transfers without server support.
+class SafeMirrorResumableTarget : public SafeResumableTarget
+{
+public:
+    explicit SafeMirrorResumableTarget(const QString &root);
+    qint64 offset(const QString &relative);
+    bool append(const QString &relative, qint64 offset, const QByteArray &data);
+    bool finish(const QString &relative);
+    qint64 size(const QString &relative);
+    QByteArray read(const QString &relative, qint64 offset, qint64 length);
+
+private:
+    QString root;
+    QString filePath(const QString &relative) const;
+    QString uploadPath(const QString &relative) const;
+};
+
+#endif // SAFERESUMABLETARGET_H
@@ -0,0 +1,160 @@
+#include "saferetryqueue.h"
+#include <QDateTime>
+#include <QDebug>
+
+SafeRetryQueue::SafeRetryQueue(SafeStateDb *db, QSettings *settings, QObject *parent) :
+    QObject(parent),
+    db(db),
+    settings(settings),
+    tokens(1),
+    lastReauth(0),
+    retried(0),
+    gaveUp(0)
+{
+    qsrand(uint(QDateTime::currentMSecsSinceEpoch()));
+    this->refill.start();
+    this->timer = new QTimer(this);
+    this->timer->setSingleShot(true);
+    this->timer->setTimerType(Qt::CoarseTimer);
+    connect(this->timer, &QTimer::timeout, this, &SafeRetryQueue::dispatch);
+
+    // left over from the last run
+    foreach(SafeRetryEntry entry, this->db->getRetries()) {
+        this->entries.insert(entry.path, entry);
+        this->due.insert(entry.due, entry.path);
+    }
+    if(!this->entries.isEmpty()) {
+        qDebug() << "Loaded" << this->entries.size() << "operations to retry";
+    }
+    arm();
+}
+
+SafeRetryQueue::ErrorClass SafeRetryQueue::classify(int code)
+{
+    // lib2safe reports HTTP statuses, or the QNetworkReply error below 100
+    // when there was no response at all
+    if(code == 401 || code == 403) {
+        return Auth;
+    }
+    if(code < 100 || code == 408 || code == 429 || code >= 500) {
+        return Transient;
+    }
+    return Permanent;
+}
+
+void SafeRetryQueue::add(SafeRetryEntry::Operation operation, const QString &path,
+                         const QString &arg, int code, const QString &message)
+{
+    SafeRetryEntry entry(this->entries.value(path));
+    if(entry.path.isEmpty() || entry.operation != operation) {
+        entry = SafeRetryEntry();
+        entry.path = path;
+        entry.operation = operation;
+    }
+    entry.arg = arg;
+    entry.code = code;
+    entry.message = message;
+    entry.attempts++;
+
+    ErrorClass cls = classify(code);
+    if(cls == Permanent || entry.attempts > RETRY_MAX_ATTEMPTS) {
+        qWarning() << "Giving up on" << path << "after" << entry.attempts << "attempts:" << message;
+        unschedule(path);
+        ++this->gaveUp;
+        emit failed(entry);
+        return;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if(cls == Auth && now - this->lastReauth > RETRY_REAUTH_INTERVAL) {
+        this->lastReauth = now;
+        emit reauthenticate();
+    }
+
+    // full jitter over the upper half, so failures from one outage spread out
+    qint64 delay = qMin<qint64>(qint64(RETRY_BASE_DELAY) << qMin(entry.attempts - 1, 20),
+                                RETRY_MAX_DELAY);
+    delay = delay / 2 + qrand() % (delay / 2 + 1);
+    entry.due = now + delay;
+    qDebug() << "Retrying" << path << "in" << delay << "ms, attempt" << entry.attempts;
+    schedule(entry);
+}
+
+void SafeRetryQueue::succeeded(const QString &path)
+{
+    if(this->entries.contains(path)) {
+        unschedule(path);
+    }
+}
+
+void SafeRetryQueue::dispatch()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    while(!this->due.isEmpty() && this->due.firstKey() <= now) {
+        if(!takeToken()) {
+            break;
+        }
+        QString path(this->due.begin().value());
+        this->due.erase(this->due.begin());
+        // stays in entries until it went through, so attempts keep counting
+        ++this->retried;
+        emit retry(this->entries.value(path));
+    }
+    arm();
+}
+
+void SafeRetryQueue::schedule(const SafeRetryEntry &entry)
+{
+    if(this->entries.contains(entry.path)) {
+        this->due.remove(this->entries.value(entry.path).due, entry.path);
+    }
+    this->entries.insert(entry.path, entry);
+    this->due.insert(entry.due, entry.path);
+    this->db->putRetry(entry);
+    arm();
+}
+
+void SafeRetryQueue::unschedule(const QString &path)
+{
+    if(this->entries.contains(path)) {
+        this->due.remove(this->entries.take(path).due, path);
+    }
+    this->db->removeRetry(path);
+    arm();
+}
+
+bool SafeRetryQueue::takeToken()
+{
+    double rate = qMax(this->settings->value("retry_rate", 30).toDouble(), 1.0); // per minute
+    double burst = qMax(rate / 4, 1.0);
+    this->tokens = qMin(burst, this->tokens + this->refill.restart() * rate / 60000.0);
+    if(this->tokens < 1) {
+        return false;
+    }
+    this->tokens -= 1;
+    return true;
+}
+
+void SafeRetryQueue::arm()
+{
+    if(this->due.isEmpty()) {
+        this->timer->stop();
+        return;
+    }
+    qint64 next = this->due.firstKey() - QDateTime::currentMSecsSinceEpoch();
+    if(this->tokens < 1) {
+        double rate = qMax(this->settings->value("retry_rate", 30).toDouble(), 1.0);
+        next = qMax<qint64>(next, qint64((1 - this->tokens) * 60000 / rate));
+    }
+    this->timer->start(int(qBound<qint64>(0, next, RETRY_MAX_DELAY)));
+}
+
+QJsonObject SafeRetryQueue::stats() const
+{
+    QJsonObject values;
+    values.insert("pending", this->entries.size());
+    values.insert("scheduled", this->due.size());
+    values.insert("retried", (qint64)this->retried);
+    values.insert("gave_up", (qint64)this->gaveUp);
+    return values;
+}
@@ -0,0 +1,66 @@
+#ifndef SAFERETRYQUEUE_H
+#define SAFERETRYQUEUE_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMap>
+#include <QSettings>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include "safestatedb.h"
+
+#define RETRY_BASE_DELAY 2000          // ms, doubled per attempt
+#define RETRY_MAX_DELAY (60 * 60 * 1000)
+#define RETRY_MAX_ATTEMPTS 12
+#define RETRY_REAUTH_INTERVAL (60 * 1000)
+
+// Failed remote operations, kept in the state database until they went
+// through or were given up on. One entry per path, the latest failure wins.
+//
+// Transient errors (network, timeouts, 408, 429, 5xx) are retried with
+// exponential backoff and jitter, auth errors ask for a new login first,
+// anything else is reported through failed(). Retries leave at no more
+// than "retry_rate" per minute, so a recovered network is not flooded.
+class SafeRetryQueue : public QObject
+{
+    Q_OBJECT
+public:
+    enum ErrorClass { Transient, Auth, Permanent };
+
+    explicit SafeRetryQueue(SafeStateDb *db, QSettings *settings, QObject *parent = 0);
+
+    void add(SafeRetryEntry::Operation operation, const QString &path,
+             const QString &arg, int code, const QString &message);
+    // the operation on path went through, by retry or otherwise
+    void succeeded(const QString &path);
+    QJsonObject stats() const;
+
+    static ErrorClass classify(int code);
+
+signals:
+    void retry(const SafeRetryEntry &entry);
+    void failed(const SafeRetryEntry &entry);
+    void reauthenticate();
+
+private slots:
+    void dispatch();
+
+private:
+    SafeStateDb *db;
+    QSettings *settings;
+    QTimer *timer;
+    QMap<QString, SafeRetryEntry> entries;
+    QMultiMap<qint64, QString> due;
+    double tokens;
+    QElapsedTimer refill;
+    qint64 lastReauth;
+    quint64 retried;
+    quint64 gaveUp;
+
+    void schedule(const SafeRetryEntry &entry);
+    void unschedule(const QString &path);
+    bool takeToken();
+    void arm();
+};
+
+#endif // SAFERETRYQUEUE_H
@@ -0,0 +1,211 @@
+#include "safescrubber.h"
+#include <QDir>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QDebug>
+
+SafeScrubber::SafeScrubber(const QString &root, SafeStateDb *local, SafeStateDb *remote,
+                           QSettings *settings, QObject *parent) :
+    QObject(parent),
+    root(QDir::cleanPath(root)),
+    local(local),
+    remote(remote),
+    settings(settings)
+{
+    this->ticker = new QTimer(this);
+    this->ticker->setTimerType(Qt::VeryCoarseTimer);
+    connect(this->ticker, &QTimer::timeout, this, &SafeScrubber::tick);
+
+    if(!this->settings->contains("scrub_cycle_start")) {
+        this->settings->setValue("scrub_cycle_start",
+                                 (quint32)QDateTime::currentDateTime().toTime_t());
+    }
+}
+
+SafeScrubber::~SafeScrubber()
+{
+    this->ticker->stop();
+}
+
+void SafeScrubber::start()
+{
+    int interval = this->settings->value("scrub_interval", 60).toInt();
+    if(interval <= 0) {
+        qDebug() << "Scrubber disabled";
+        return;
+    }
+    qDebug() << "Started scrubber, position:" << this->settings->value("scrub_position").toString();
+    this->ticker->start(interval * 1000);
+}
+
+void SafeScrubber::tick()
+{
+    // settings may change at runtime
+    int interval = this->settings->value("scrub_interval", 60).toInt();
+    if(interval <= 0) {
+        this->ticker->stop();
+        if(this->file.isOpen()) {
+            this->file.close();
+        }
+        return;
+    }
+    this->ticker->setInterval(interval * 1000);
+
+    this->bytesLeft = this->settings->value("scrub_bytes", 32 * 1024 * 1024).toLongLong();
+    this->timeLimit = this->settings->value("scrub_time", 200).toLongLong();
+    this->clock.start();
+
+    if(this->file.isOpen() && !hashStep()) {
+        return; // still on the same file
+    }
+
+    QString position(this->settings->value("scrub_position").toString());
+    while(!exhausted()) {
+        QList<SafeFileRecord> records(this->local->getFilesAfter(position, SCRUB_BATCH));
+        if(records.isEmpty()) {
+            finishPass();
+            position.clear();
+            break;
+        }
+        foreach(SafeFileRecord record, records) {
+            if(exhausted()) {
+                break;
+            }
+            position = record.path;
+            if(!check(record)) {
+                continue;
+            }
+            this->current = record;
+            this->file.setFileName(this->root + QDir::separator() + record.path);
+            if(!this->file.open(QFile::ReadOnly)) {
+                continue;
+            }
+            this->hash.reset();
+            if(!hashStep()) {
+                break;
+            }
+        }
+    }
+    this->settings->setValue("scrub_position", position);
+}
+
+bool SafeScrubber::exhausted() const
+{
+    return this->bytesLeft <= 0 || this->clock.elapsed() >= this->timeLimit;
+}
+
+bool SafeScrubber::check(const SafeFileRecord &record)
+{
+    if(record.fingerprint.isNull()) {
+        return false; // not indexed yet, a transfer is pending
+    }
+
+    QString path(this->root + QDir::separator() + record.path);
+    SafeFingerprint fp(SafeFingerprint::fromPath(path));
+    if(fp.isNull()) {
+        qDebug() << "Scrub: missing on disk" << record.path;
+        emit localMissing(path);
+        return false;
+    }
+    if(fp != record.fingerprint) {
+        qDebug() << "Scrub: changed on disk" << record.path;
+        emit localChanged(path);
+        return false;
+    }
+
+    SafeFileRecord other(this->remote->getFile(record.path));
+    if(other.path.isEmpty()) {
+        if(record.id.isEmpty()) {
+            // the upload never completed
+            qDebug() << "Scrub: not uploaded" << record.path;
+            emit remoteDiffers(path);
+        } else {
+            // could as well be a missed remote delete, leave the file alone
+            qWarning() << "Scrub: uploaded file missing from the remote index" << record.path;
+        }
+        return false;
+    }
+    if((!record.hash.isEmpty() && !other.hash.isEmpty() && record.hash != other.hash)
+            || (!other.fingerprint.isNull() && other.fingerprint.size != fp.size)) {
+        qDebug() << "Scrub: differs from remote" << record.path;
+        emit remoteDiffers(path);
+        return false;
+    }
+
+    if(record.fhash.isEmpty()) {
+        verified(record);
+        return false;
+    }
+    return true;
+}
+
+bool SafeScrubber::hashStep()
+{
+    QByteArray buffer(SCRUB_BLOCK, Qt::Uninitialized);
+    while(!exhausted()) {
+        qint64 len = this->file.read(buffer.data(), qMin<qint64>(buffer.size(), this->bytesLeft));
+        if(len < 0) {
+            qWarning() << "Scrub: unable to read" << this->file.fileName();
+            this->file.close();
+            return true;
+        }
+        if(len > 0) {
+            this->hash.addData(buffer.constData(), len);
+            this->bytesLeft -= len;
+            continue;
+        }
+
+        this->file.close();
+        QString path(this->file.fileName());
+        SafeFingerprint fp(SafeFingerprint::fromPath(path));
+        if(this->local->getFileFingerprint(this->current.path) != this->current.fingerprint) {
+            return true; // reindexed meanwhile
+        }
+        if(fp.isNull()) {
+            emit localMissing(path);
+        } else if(fp != this->current.fingerprint) {
+            emit localChanged(path);
+        } else if(QString(this->hash.result().toHex()) != this->current.fhash) {
+            // every write bumps ctime, so this is not an edit
+            qWarning() << "Scrub: content does not match the index" << this->current.path;
+            emit localCorrupted(path);
+        } else {
+            verified(this->current);
+        }
+        return true;
+    }
+    return false;
+}
+
+void SafeScrubber::verified(const SafeFileRecord &record)
+{
+    this->local->setFileVerified(record.path, QDateTime::currentDateTime().toTime_t());
+}
+
+void SafeScrubber::finishPass()
+{
+    QJsonObject values(stats());
+    qDebug() << "Scrub pass finished, files:" << values.value("files").toDouble()
+             << "coverage:" << values.value("coverage").toDouble()
+             << "oldest age:" << values.value("oldest_age").toDouble();
+    this->settings->setValue("scrub_cycle_start",
+                             (quint32)QDateTime::currentDateTime().toTime_t());
+}
+
+QJsonObject SafeScrubber::stats()
+{
+    qint64 now = QDateTime::currentDateTime().toTime_t();
+    qint64 since = this->settings->value("scrub_cycle_start").toLongLong();
+    SafeVerifyStats s(this->local->verifyStats(since));
+
+    QJsonObject values;
+    values.insert("files", s.files);
+    values.insert("verified", s.verified);
+    values.insert("never_verified", s.never);
+    values.insert("coverage", s.files > 0 ? double(s.verified) / s.files : 1.0);
+    // -1 while some files were never verified at all
+    values.insert("oldest_age", (s.never == 0 && s.oldest > 0) ? now - s.oldest : -1);
+    values.insert("pass_started", since);
+    values.insert("position", this->settings->value("scrub_position").toString());
+    return values;
+}
@@ -0,0 +1,71 @@
+#ifndef SAFESCRUBBER_H
+#define SAFESCRUBBER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QFile>
+#include <QSettings>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include "safestatedb.h"
+#include "safefingerprint.h"
+#include "safefasthash.h"
+
+#define SCRUB_BATCH 256 // rows fetched per query
+#define SCRUB_BLOCK (1024 * 1024)
+
+// Re-verifies a rolling slice of the local index on every tick: the file
+// must still be on disk with the stored fingerprint and fast hash, and
+// agree with the remote index. Work per tick is bounded by the
+// "scrub_bytes" (read) and "scrub_time" (ms) settings; a large file is
+// hashed across several ticks. The position is kept in "scrub_position"
+// so a restart resumes where it stopped.
+class SafeScrubber : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SafeScrubber(const QString &root, SafeStateDb *local, SafeStateDb *remote,
+                          QSettings *settings, QObject *parent = 0);
+    ~SafeScrubber();
+
+    // coverage of the current pass and age of the least recently verified file
+    QJsonObject stats();
+
+signals:
+    // absolute paths
+    void localChanged(const QString &path);   // fingerprint differs, missed event
+    void localMissing(const QString &path);   // indexed but gone from disk
+    void localCorrupted(const QString &path); // content differs, metadata does not
+    void remoteDiffers(const QString &path);  // local and remote index disagree
+
+public slots:
+    void start();
+
+private slots:
+    void tick();
+
+private:
+    QString root;
+    SafeStateDb *local;
+    SafeStateDb *remote;
+    QSettings *settings;
+    QTimer *ticker;
+
+    // file being hashed across ticks
+    QFile file;
+    SafeFastHash hash;
+    SafeFileRecord current;
+
+    // budget of the running tick
+    qint64 bytesLeft;
+    qint64 timeLimit;
+    QElapsedTimer clock;
+
+    bool exhausted() const;
+    bool check(const SafeFileRecord &record);
+    bool hashStep(); // true once the file is done
+    void verified(const SafeFileRecord &record);
+    void finishPass();
+};
+
+#endif // SAFESCRUBBER_H
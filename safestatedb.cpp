@@ -24,6 +24,18 @@ SafeStateDb::SafeStateDb(QString name, QObject *parent) :
         return;
     }
 
+    QSqlQuery version("PRAGMA user_version", this->database);
+    if(version.next() && version.value(0).toInt() != STATE_DATABASE_VERSION) {
+        qDebug() << "Dropping outdated state database" << name;
+        query("DROP TABLE IF EXISTS files");
+        query("DROP TABLE IF EXISTS dirs");
+        query("DROP TABLE IF EXISTS chunks");
+        query("DROP TABLE IF EXISTS journal");
+        query("DROP TABLE IF EXISTS retries");
+        query("DROP TABLE IF EXISTS oplog");
+        query(QString("PRAGMA user_version = %1").arg(STATE_DATABASE_VERSION));
+    }
+
     QString q("CREATE TABLE IF NOT EXISTS files ");
     q.append("(");
     q.append("_id INTEGER PRIMARY KEY,");
@@ -32,9 +44,17 @@ SafeStateDb::SafeStateDb(QString name, QObject *parent) :
     q.append("path TEXT,");
     q.append("name VARCHAR(255),");
     q.append("hash VARCHAR(32),");
-    q.append("mtime INTEGER");
+    q.append("fhash VARCHAR(32),");
+    q.append("mtime INTEGER,");
+    q.append("size INTEGER,");
+    q.append("mtime_ns INTEGER,");
+    q.append("ctime_ns INTEGER,");
+    q.append("inode INTEGER,");
+    q.append("verified INTEGER");
     q.append(")");
     query(q);
+    query("CREATE UNIQUE INDEX IF NOT EXISTS files_path ON files (path)");
+    query("CREATE INDEX IF NOT EXISTS files_hash ON files (hash)");
 
     q = "CREATE TABLE IF NOT EXISTS dirs ";
     q.append("(");
@@ -46,6 +66,52 @@ SafeStateDb::SafeStateDb(QString name, QObject *parent) :
     q.append("mtime INTEGER");
     q.append(")");
     query(q);
+    query("CREATE UNIQUE INDEX IF NOT EXISTS dirs_path ON dirs (path)");
+
+    q = "CREATE TABLE IF NOT EXISTS chunks ";
+    q.append("(");
+    q.append("path TEXT,");
+    q.append("pos INTEGER,");
+    q.append("length INTEGER,");
+    q.append("digest VARCHAR(32)");
+    q.append(")");
+    query(q);
+    query("CREATE INDEX IF NOT EXISTS chunks_path ON chunks (path)");
+
+    q = "CREATE TABLE IF NOT EXISTS journal ";
+    q.append("(");
+    q.append("path TEXT PRIMARY KEY,");
+    q.append("direction INTEGER,");
+    q.append("id VARCHAR(32),");
+    q.append("hash VARCHAR(32),");
+    q.append("size INTEGER,");
+    q.append("mtime INTEGER,");
+    q.append("pos INTEGER");
+    q.append(")");
+    query(q);
+
+    q = "CREATE TABLE IF NOT EXISTS retries ";
+    q.append("(");
+    q.append("path TEXT PRIMARY KEY,");
+    q.append("operation INTEGER,");
+    q.append("arg VARCHAR(32),");
+    q.append("attempts INTEGER,");
+    q.append("due INTEGER,");
+    q.append("code INTEGER,");
+    q.append("message TEXT");
+    q.append(")");
+    query(q);
+
+    q = "CREATE TABLE IF NOT EXISTS oplog ";
+    q.append("(");
+    q.append("seq INTEGER PRIMARY KEY AUTOINCREMENT,");
+    q.append("operation INTEGER,");
+    q.append("path TEXT,");
+    q.append("source TEXT,");
+    q.append("dir INTEGER,");
+    q.append("known INTEGER");
+    q.append(")");
+    query(q);
 }
 
 SafeStateDb::~SafeStateDb()
@@ -71,13 +137,13 @@ void SafeStateDb::insertDir(QString path, QString name, ulong mtime,
 }
 
 void SafeStateDb::insertFile(QString dir, QString path, QString name, ulong mtime,
-                             QString hash, QString id)
+                             QString hash, QString id, const SafeFingerprint &fp)
 {
     QSqlQuery query(this->database);
     QString q("INSERT OR REPLACE INTO files ");
-    q.append("(id, dir, path, name, hash, mtime)");
+    q.append("(id, dir, path, name, hash, mtime, size, mtime_ns, ctime_ns, inode)");
     q.append(" VALUES ");
-    q.append("(:id, :dir, :path, :name, :hash, :mtime)");
+    q.append("(:id, :dir, :path, :name, :hash, :mtime, :size, :mtime_ns, :ctime_ns, :inode)");
     query.prepare(q);
     query.bindValue(":id", id);
     query.bindValue(":dir", dir);
@@ -85,9 +151,77 @@ void SafeStateDb::insertFile(QString dir, QString path, QString name, ulong mtim
     query.bindValue(":name", name);
     query.bindValue(":hash", hash);
     query.bindValue(":mtime", quint64(mtime));
+    bindFingerprint(query, fp);
+    query.exec();
+}
+
+void SafeStateDb::setFileFingerprint(QString path, const SafeFingerprint &fp)
+{
+    QSqlQuery query(this->database);
+    QString q("UPDATE files SET ");
+    q.append("size=:size, mtime_ns=:mtime_ns, ctime_ns=:ctime_ns, inode=:inode");
+    q.append(" WHERE path=:path");
+    query.prepare(q);
+    query.bindValue(":path", path);
+    bindFingerprint(query, fp);
     query.exec();
 }
 
+void SafeStateDb::setFileHash(QString path, QString hash)
+{
+    QSqlQuery query(this->database);
+    query.prepare("UPDATE files SET hash=:hash WHERE path=:path");
+    query.bindValue(":hash", hash);
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+void SafeStateDb::setFileFastHash(QString path, QString fhash)
+{
+    QSqlQuery query(this->database);
+    query.prepare("UPDATE files SET fhash=:fhash WHERE path=:path");
+    query.bindValue(":fhash", fhash);
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+QString SafeStateDb::getFileFastHash(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("SELECT fhash FROM files WHERE path=:path");
+    query.bindValue(":path", path);
+    if (query.exec() && query.next()) {
+        return query.value(0).toString();
+    }
+
+    return "";
+}
+
+qint64 SafeStateDb::getDirSize(QString path)
+{
+    QString prefix(path + QDir::separator());
+    QSqlQuery query(this->database);
+    query.prepare("SELECT SUM(MAX(size, 0)) FROM files WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":prefix", prefix);
+    if (query.exec() && query.next()) {
+        return query.value(0).toLongLong();
+    }
+
+    return 0;
+}
+
+SafeFingerprint SafeStateDb::getFileFingerprint(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("SELECT size, mtime_ns, ctime_ns, inode FROM files WHERE path=:path");
+    query.bindValue(":path", path);
+    if (query.exec() && query.next()) {
+        return readFingerprint(query, 0);
+    }
+
+    return SafeFingerprint();
+}
+
 void SafeStateDb::removeDir(QString path)
 {
     QSqlQuery query(this->database);
@@ -98,10 +232,91 @@ void SafeStateDb::removeDir(QString path)
 
 void SafeStateDb::removeDirRecursively(QString path)
 {
+    QString prefix(path + QDir::separator());
     QSqlQuery query(this->database);
-    query.prepare("DELETE FROM files WHERE path like :path%");
-    query.bindValue(":path", path);
+    query.prepare("DELETE FROM files WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("DELETE FROM dirs WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("DELETE FROM chunks WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":prefix", prefix);
+    query.exec();
+}
+
+void SafeStateDb::moveDir(QString from, QString to)
+{
+    QString prefix(from + QDir::separator());
+    QSqlQuery query(this->database);
+    this->database.transaction();
+    query.prepare("UPDATE dirs SET path=:to, name=:name WHERE path=:from");
+    query.bindValue(":to", to);
+    query.bindValue(":name", QDir(to).dirName());
+    query.bindValue(":from", from);
     query.exec();
+
+    query.prepare("UPDATE dirs SET path=:to || substr(path, length(:from) + 1) "
+                  "WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("UPDATE files SET path=:to || substr(path, length(:from) + 1) "
+                  "WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("UPDATE files SET dir=:to || substr(dir, length(:from) + 1) "
+                  "WHERE dir=:from OR substr(dir, 1, length(:prefix))=:prefix");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("UPDATE chunks SET path=:to || substr(path, length(:from) + 1) "
+                  "WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.bindValue(":prefix", prefix);
+    query.exec();
+
+    query.prepare("UPDATE journal SET path=:to || substr(path, length(:from) + 1) "
+                  "WHERE substr(path, 1, length(:prefix))=:prefix");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.bindValue(":prefix", prefix);
+    query.exec();
+    this->database.commit();
+}
+
+void SafeStateDb::moveFile(QString from, QString to)
+{
+    int slash = to.lastIndexOf(QDir::separator());
+    QSqlQuery query(this->database);
+    this->database.transaction();
+    query.prepare("UPDATE files SET path=:to, dir=:dir, name=:name WHERE path=:from");
+    query.bindValue(":to", to);
+    query.bindValue(":dir", slash < 0 ? QString(QDir::separator()) : to.left(slash));
+    query.bindValue(":name", to.mid(slash + 1));
+    query.bindValue(":from", from);
+    query.exec();
+
+    query.prepare("UPDATE chunks SET path=:to WHERE path=:from");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.exec();
+
+    query.prepare("UPDATE journal SET path=:to WHERE path=:from");
+    query.bindValue(":to", to);
+    query.bindValue(":from", from);
+    query.exec();
+    this->database.commit();
 }
 
 void SafeStateDb::removeFile(QString path)
@@ -110,6 +325,46 @@ void SafeStateDb::removeFile(QString path)
     query.prepare("DELETE FROM files WHERE path=:path");
     query.bindValue(":path", path);
     query.exec();
+
+    query.prepare("DELETE FROM chunks WHERE path=:path");
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+void SafeStateDb::setFileChunks(QString path, const QList<SafeChunk> &chunks)
+{
+    this->database.transaction();
+    QSqlQuery query(this->database);
+    query.prepare("DELETE FROM chunks WHERE path=:path");
+    query.bindValue(":path", path);
+    query.exec();
+
+    query.prepare("INSERT INTO chunks (path, pos, length, digest) VALUES (:path, :pos, :length, :digest)");
+    foreach(SafeChunk chunk, chunks) {
+        query.bindValue(":path", path);
+        query.bindValue(":pos", chunk.offset);
+        query.bindValue(":length", chunk.length);
+        query.bindValue(":digest", chunk.digest);
+        query.exec();
+    }
+    this->database.commit();
+}
+
+QList<SafeChunk> SafeStateDb::getFileChunks(QString path)
+{
+    QList<SafeChunk> chunks;
+    QSqlQuery query(this->database);
+    query.prepare("SELECT pos, length, digest FROM chunks WHERE path=:path ORDER BY pos");
+    query.bindValue(":path", path);
+    query.exec();
+    while(query.next()) {
+        SafeChunk chunk;
+        chunk.offset = query.value(0).toLongLong();
+        chunk.length = query.value(1).toLongLong();
+        chunk.digest = query.value(2).toString();
+        chunks.append(chunk);
+    }
+    return chunks;
 }
 
 void SafeStateDb::removeFileById(QString id)
@@ -194,7 +449,7 @@ bool SafeStateDb::existsDir(QString path)
 void SafeStateDb::updateDirHash(QString dir)
 {
     QSqlQuery query(this->database);
-    query.prepare("SELECT hash FROM files WHERE dir=:dir");
+    query.prepare("SELECT fhash FROM files WHERE dir=:dir ORDER BY path");
     query.bindValue(":dir", dir);
     query.exec();
     QString hashstr;
@@ -291,11 +546,13 @@ QString SafeStateDb::getFileHashById(QString id)
     return "";
 }
 
-QString SafeStateDb::findFile(QString hash)
+QString SafeStateDb::findFile(QString hash, QString except)
 {
     QSqlQuery query(this->database);
-    query.prepare("SELECT path FROM files WHERE hash=:hash");
+    query.prepare("SELECT path FROM files WHERE hash=:hash AND path!=:except LIMIT 1");
     query.bindValue(":hash", hash);
+    // NULL would match nothing
+    query.bindValue(":except", except.isNull() ? QString("") : except);
     if (query.exec() && query.next()) {
         return query.value(0).toString();
     }
@@ -303,6 +560,316 @@ QString SafeStateDb::findFile(QString hash)
     return "";
 }
 
+QStringList SafeStateDb::findUnhashedFiles(qint64 size, QString except, int limit)
+{
+    QStringList paths;
+    QSqlQuery query(this->database);
+    query.prepare("SELECT path FROM files WHERE size=:size AND (hash IS NULL OR hash='')"
+                  " AND path!=:except LIMIT :limit");
+    query.bindValue(":size", size);
+    query.bindValue(":except", except.isNull() ? QString("") : except);
+    query.bindValue(":limit", limit);
+    if(query.exec()) {
+        while(query.next()) {
+            paths.append(query.value(0).toString());
+        }
+    }
+    return paths;
+}
+
+bool SafeStateDb::existsHashedFile(qint64 size, QString except)
+{
+    QSqlQuery query(this->database);
+    query.prepare("SELECT 1 FROM files WHERE size=:size AND hash IS NOT NULL AND hash!=''"
+                  " AND path!=:except LIMIT 1");
+    query.bindValue(":size", size);
+    query.bindValue(":except", except.isNull() ? QString("") : except);
+    return query.exec() && query.next();
+}
+
+SafeFileRecord SafeStateDb::getFile(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("SELECT path, id, hash, fhash, mtime, size, mtime_ns, ctime_ns, inode"
+                  " FROM files WHERE path=:path");
+    query.bindValue(":path", path);
+    if (query.exec() && query.next()) {
+        return readFile(query);
+    }
+
+    return SafeFileRecord();
+}
+
+QList<SafeFileRecord> SafeStateDb::getFilesAfter(QString path, int limit)
+{
+    QList<SafeFileRecord> records;
+    QSqlQuery query(this->database);
+    query.setForwardOnly(true);
+    query.prepare("SELECT path, id, hash, fhash, mtime, size, mtime_ns, ctime_ns, inode"
+                  " FROM files WHERE path > :path ORDER BY path LIMIT :limit");
+    query.bindValue(":path", path);
+    query.bindValue(":limit", limit);
+    query.exec();
+    while(query.next()) {
+        records.append(readFile(query));
+    }
+    return records;
+}
+
+void SafeStateDb::setFileVerified(QString path, qint64 time)
+{
+    QSqlQuery query(this->database);
+    query.prepare("UPDATE files SET verified=:verified WHERE path=:path");
+    query.bindValue(":verified", time);
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+SafeVerifyStats SafeStateDb::verifyStats(qint64 since)
+{
+    SafeVerifyStats stats;
+    QSqlQuery query(this->database);
+    query.prepare("SELECT count(*), total(verified >= :since), total(verified IS NULL),"
+                  " min(verified) FROM files");
+    query.bindValue(":since", since);
+    if (query.exec() && query.next()) {
+        stats.files = query.value(0).toLongLong();
+        stats.verified = query.value(1).toLongLong();
+        stats.never = query.value(2).toLongLong();
+        stats.oldest = query.value(3).toLongLong();
+    }
+    return stats;
+}
+
+void SafeStateDb::journalTransfer(const SafeJournalEntry &entry)
+{
+    QSqlQuery query(this->database);
+    QString q("INSERT OR REPLACE INTO journal ");
+    q.append("(path, direction, id, hash, size, mtime, pos)");
+    q.append(" VALUES ");
+    q.append("(:path, :direction, :id, :hash, :size, :mtime, :pos)");
+    query.prepare(q);
+    query.bindValue(":path", entry.path);
+    query.bindValue(":direction", int(entry.direction));
+    query.bindValue(":id", entry.id);
+    query.bindValue(":hash", entry.hash);
+    query.bindValue(":size", entry.size);
+    query.bindValue(":mtime", quint64(entry.mtime));
+    query.bindValue(":pos", entry.offset);
+    query.exec();
+}
+
+void SafeStateDb::setTransferOffset(QString path, qint64 offset)
+{
+    QSqlQuery query(this->database);
+    query.prepare("UPDATE journal SET pos=:pos WHERE path=:path");
+    query.bindValue(":pos", offset);
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+void SafeStateDb::removeTransfer(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("DELETE FROM journal WHERE path=:path");
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+SafeJournalEntry SafeStateDb::getTransfer(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("SELECT path, direction, id, hash, size, mtime, pos FROM journal WHERE path=:path");
+    query.bindValue(":path", path);
+    if (query.exec() && query.next()) {
+        return readTransfer(query);
+    }
+
+    return SafeJournalEntry();
+}
+
+QList<SafeJournalEntry> SafeStateDb::getTransfers()
+{
+    QList<SafeJournalEntry> entries;
+    QSqlQuery query(this->database);
+    query.exec("SELECT path, direction, id, hash, size, mtime, pos FROM journal ORDER BY path");
+    while(query.next()) {
+        entries.append(readTransfer(query));
+    }
+    return entries;
+}
+
+void SafeStateDb::putRetry(const SafeRetryEntry &entry)
+{
+    QSqlQuery query(this->database);
+    QString q("INSERT OR REPLACE INTO retries ");
+    q.append("(path, operation, arg, attempts, due, code, message)");
+    q.append(" VALUES ");
+    q.append("(:path, :operation, :arg, :attempts, :due, :code, :message)");
+    query.prepare(q);
+    query.bindValue(":path", entry.path);
+    query.bindValue(":operation", int(entry.operation));
+    query.bindValue(":arg", entry.arg);
+    query.bindValue(":attempts", entry.attempts);
+    query.bindValue(":due", entry.due);
+    query.bindValue(":code", entry.code);
+    query.bindValue(":message", entry.message);
+    query.exec();
+}
+
+void SafeStateDb::removeRetry(QString path)
+{
+    QSqlQuery query(this->database);
+    query.prepare("DELETE FROM retries WHERE path=:path");
+    query.bindValue(":path", path);
+    query.exec();
+}
+
+QList<SafeRetryEntry> SafeStateDb::getRetries()
+{
+    QList<SafeRetryEntry> entries;
+    QSqlQuery query(this->database);
+    query.exec("SELECT path, operation, arg, attempts, due, code, message FROM retries ORDER BY due");
+    while(query.next()) {
+        SafeRetryEntry entry;
+        entry.path = query.value(0).toString();
+        entry.operation = SafeRetryEntry::Operation(query.value(1).toInt());
+        entry.arg = query.value(2).toString();
+        entry.attempts = query.value(3).toInt();
+        entry.due = query.value(4).toLongLong();
+        entry.code = query.value(5).toInt();
+        entry.message = query.value(6).toString();
+        entries.append(entry);
+    }
+    return entries;
+}
+
+void SafeStateDb::appendOp(const SafeOpEntry &entry)
+{
+    QSqlQuery query(this->database);
+    QString q("INSERT INTO oplog ");
+    q.append("(operation, path, source, dir, known)");
+    q.append(" VALUES ");
+    q.append("(:operation, :path, :source, :dir, :known)");
+    query.prepare(q);
+    query.bindValue(":operation", int(entry.operation));
+    query.bindValue(":path", entry.path);
+    query.bindValue(":source", entry.from);
+    query.bindValue(":dir", entry.isDir);
+    query.bindValue(":known", entry.known);
+    query.exec();
+}
+
+QList<SafeOpEntry> SafeStateDb::getOps()
+{
+    QList<SafeOpEntry> entries;
+    QSqlQuery query(this->database);
+    query.exec("SELECT seq, operation, path, source, dir, known FROM oplog ORDER BY seq");
+    while(query.next()) {
+        SafeOpEntry entry;
+        entry.seq = query.value(0).toLongLong();
+        entry.operation = SafeOpEntry::Operation(query.value(1).toInt());
+        entry.path = query.value(2).toString();
+        entry.from = query.value(3).toString();
+        entry.isDir = query.value(4).toBool();
+        entry.known = query.value(5).toBool();
+        entries.append(entry);
+    }
+    return entries;
+}
+
+void SafeStateDb::clearOps()
+{
+    query("DELETE FROM oplog");
+}
+
+SafeIndexCursor SafeStateDb::scanIndex()
+{
+    QSqlQuery query(this->database);
+    query.setForwardOnly(true);
+    QString q("SELECT path AS k, 0, size, mtime_ns, ctime_ns, inode FROM files");
+    q.append(" UNION ALL ");
+    q.append("SELECT path || '/' AS k, 1, NULL, NULL, NULL, NULL FROM dirs WHERE path != '/'");
+    q.append(" ORDER BY k");
+    if(!query.exec(q)) {
+        qWarning() << "Query is not valid:" << q;
+    }
+    return SafeIndexCursor(query);
+}
+
+void SafeStateDb::bindFingerprint(QSqlQuery &query, const SafeFingerprint &fp)
+{
+    if(fp.isNull()) {
+        query.bindValue(":size", QVariant(QVariant::LongLong));
+        query.bindValue(":mtime_ns", QVariant(QVariant::LongLong));
+        query.bindValue(":ctime_ns", QVariant(QVariant::LongLong));
+        query.bindValue(":inode", QVariant(QVariant::LongLong));
+        return;
+    }
+    query.bindValue(":size", fp.size);
+    query.bindValue(":mtime_ns", fp.mtime_ns);
+    query.bindValue(":ctime_ns", fp.ctime_ns);
+    query.bindValue(":inode", qint64(fp.inode));
+}
+
+SafeFileRecord SafeStateDb::readFile(const QSqlQuery &query)
+{
+    SafeFileRecord record;
+    record.path = query.value(0).toString();
+    record.id = query.value(1).toString();
+    record.hash = query.value(2).toString();
+    record.fhash = query.value(3).toString();
+    record.mtime = (ulong)query.value(4).toDouble();
+    record.fingerprint = readFingerprint(query, 5);
+    return record;
+}
+
+SafeJournalEntry SafeStateDb::readTransfer(const QSqlQuery &query)
+{
+    SafeJournalEntry entry;
+    entry.path = query.value(0).toString();
+    entry.direction = SafeJournalEntry::Direction(query.value(1).toInt());
+    entry.id = query.value(2).toString();
+    entry.hash = query.value(3).toString();
+    entry.size = query.value(4).toLongLong();
+    entry.mtime = (ulong)query.value(5).toDouble();
+    entry.offset = query.value(6).toLongLong();
+    return entry;
+}
+
+SafeFingerprint SafeStateDb::readFingerprint(const QSqlQuery &query, int column)
+{
+    SafeFingerprint fp;
+    if(query.value(column).isNull()) {
+        return fp;
+    }
+    fp.size = query.value(column).toLongLong();
+    fp.mtime_ns = query.value(column + 1).toLongLong();
+    fp.ctime_ns = query.value(column + 2).toLongLong();
+    fp.inode = quint64(query.value(column + 3).toLongLong());
+    return fp;
+}
+
+SafeIndexCursor::SafeIndexCursor(const QSqlQuery &query) :
+    query(query)
+{
+}
+
+bool SafeIndexCursor::next()
+{
+    if(!this->query.next()) {
+        return false;
+    }
+    this->current.key = this->query.value(0).toString().toUtf8();
+    this->current.isDir = this->query.value(1).toBool();
+    this->current.path = this->query.value(0).toString();
+    if(this->current.isDir) {
+        this->current.path.chop(1);
+    }
+    this->current.fingerprint = SafeStateDb::readFingerprint(this->query, 2);
+    return true;
+}
+
 void SafeStateDb::query(const QString &str)
 {
     QSqlQuery query(this->database);
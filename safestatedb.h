@@ -8,6 +8,82 @@
 #include <QDir>
 #include <QDebug>
 #include <QCryptographicHash>
+#include "safecommon.h"
+#include "safefingerprint.h"
+#include "safedirwalker.h"
+#include "safechunker.h"
+
+struct SafeFileRecord
+{
+    QString path;
+    QString id;
+    QString hash;
+    QString fhash;
+    ulong mtime = 0;
+    SafeFingerprint fingerprint;
+};
+
+struct SafeVerifyStats
+{
+    qint64 files = 0;
+    qint64 verified = 0; // since the given time
+    qint64 never = 0;
+    qint64 oldest = 0;   // least recent verification time
+};
+
+// Transfer that was started and not finished yet
+struct SafeJournalEntry
+{
+    enum Direction { Upload = 0, Download = 1 };
+
+    QString path;
+    Direction direction = Upload;
+    QString id;     // remote file, downloads only
+    QString hash;   // expected content, downloads only
+    qint64 size = 0;
+    ulong mtime = 0;
+    qint64 offset = 0; // bytes the other side has for certain
+};
+
+// Failed operation waiting for another attempt
+struct SafeRetryEntry
+{
+    enum Operation { Upload = 0, Download = 1, Remove = 2, CreateDir = 3, Move = 4 };
+
+    QString path;   // absolute
+    Operation operation = Upload;
+    QString arg;    // remote id for downloads and removals, old path for moves
+    int attempts = 0;
+    qint64 due = 0; // ms since epoch
+    int code = 0;
+    QString message;
+};
+
+// Local change made while the server was out of reach
+struct SafeOpEntry
+{
+    enum Operation { Upload = 0, Remove = 1, Move = 2, MakeDir = 3 };
+
+    qint64 seq = 0;
+    Operation operation = Upload;
+    QString path;   // relative
+    QString from;   // old path for moves
+    bool isDir = false;
+    bool known = false; // the remote index had the path (from, for moves)
+};
+
+// Forward-only walk over local index rows, ordered like SafeDirWalker
+class SafeIndexCursor
+{
+public:
+    explicit SafeIndexCursor(const QSqlQuery &query);
+    bool next();
+    const SafeDirEntry &entry() const { return current; }
+
+private:
+    QSqlQuery query;
+    SafeDirEntry current;
+};
 
 class SafeStateDb : public QObject
 {
@@ -18,13 +94,47 @@ public:
     void insertDir(QString path, QString name, ulong mtime, QString id = QString(),
                    QString hash = QString());
     void insertFile(QString dir, QString path, QString name, ulong mtime,
-                    QString hash = QString(), QString id = QString());
+                    QString hash = QString(), QString id = QString(),
+                    const SafeFingerprint &fp = SafeFingerprint());
+    void setFileFingerprint(QString path, const SafeFingerprint &fp);
+    SafeFingerprint getFileFingerprint(QString path);
+    void setFileHash(QString path, QString hash);
+    void setFileFastHash(QString path, QString fhash);
+    QString getFileFastHash(QString path);
+    void setFileChunks(QString path, const QList<SafeChunk> &chunks);
+    QList<SafeChunk> getFileChunks(QString path);
+    SafeIndexCursor scanIndex();
+    SafeFileRecord getFile(QString path);
+    QList<SafeFileRecord> getFilesAfter(QString path, int limit);
+    void setFileVerified(QString path, qint64 time);
+    SafeVerifyStats verifyStats(qint64 since);
+    void journalTransfer(const SafeJournalEntry &entry);
+    void setTransferOffset(QString path, qint64 offset);
+    void removeTransfer(QString path);
+    SafeJournalEntry getTransfer(QString path);
+    QList<SafeJournalEntry> getTransfers();
+    void putRetry(const SafeRetryEntry &entry);
+    void removeRetry(QString path);
+    QList<SafeRetryEntry> getRetries();
+    void appendOp(const SafeOpEntry &entry);
+    QList<SafeOpEntry> getOps();
+    void clearOps();
     void removeDir(QString path);
     void removeDirRecursively(QString path);
+    // bytes of all files below path, as far as their sizes are known
+    qint64 getDirSize(QString path);
+    // renames a directory along with everything below it, ids are kept
+    void moveDir(QString from, QString to);
+    void moveFile(QString from, QString to);
     void removeFile(QString path);
     bool existsFile(QString path);
     bool existsDir(QString path);
-    QString findFile(QString hash);
+    // some other indexed file with this content
+    QString findFile(QString hash, QString except = QString());
+    // files of that size with no MD5 yet, content lookups hash them on demand
+    QStringList findUnhashedFiles(qint64 size, QString except, int limit);
+    // some other file of that size whose MD5 is known
+    bool existsHashedFile(qint64 size, QString except = QString());
     void updateDirHash(QString dir);
     void updateDirId(QString dir, QString dirId);
     QString getFileId(QString path);
@@ -41,6 +151,7 @@ public:
     bool existsDirById(QString id);
 
     static QString formPath(QString name);
+    static SafeFingerprint readFingerprint(const QSqlQuery &query, int column);
 
 signals:
 
@@ -48,6 +159,9 @@ signals:
 private:
     QSqlDatabase database;
     void query(const QString &str);
+    void bindFingerprint(QSqlQuery &query, const SafeFingerprint &fp);
+    static SafeFileRecord readFile(const QSqlQuery &query);
+    static SafeJournalEntry readTransfer(const QSqlQuery &query);
 };
 
 #endif // SAFESTATEDB_H
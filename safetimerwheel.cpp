@@ -0,0 +1,101 @@
+#include "safetimerwheel.h"
+
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+
+SafeTimerWheel::SafeTimerWheel(QObject *parent) :
+    QObject(parent),
+    now(0),
+    slots(WHEEL_LEVELS * WHEEL_SLOTS)
+{
+    this->clock.start();
+    this->timer = new QTimer(this);
+    this->timer->setTimerType(Qt::CoarseTimer);
+    this->timer->setInterval(WHEEL_TICK);
+    connect(this->timer, &QTimer::timeout, this, &SafeTimerWheel::tick);
+}
+
+void SafeTimerWheel::start(const QString &key, qint64 delay)
+{
+    cancel(key);
+    if(!this->timer->isActive()) {
+        // nothing was pending, so no slot boundary that was skipped matters
+        this->now = quint64(this->clock.elapsed() / WHEEL_TICK);
+        this->timer->start();
+    }
+    quint64 due = quint64((this->clock.elapsed() + qMax<qint64>(delay, 0) + WHEEL_TICK - 1)
+                          / WHEEL_TICK);
+    place(key, qMax(due, this->now + 1));
+}
+
+bool SafeTimerWheel::cancel(const QString &key)
+{
+    if(!this->index.contains(key)) {
+        return false;
+    }
+    Slot s(this->index.take(key));
+    this->slots[s.level * WHEEL_SLOTS + s.slot].remove(key);
+    if(this->index.isEmpty()) {
+        this->timer->stop();
+    }
+    return true;
+}
+
+void SafeTimerWheel::place(const QString &key, quint64 due)
+{
+    const quint64 span = quint64(1) << (WHEEL_BITS * WHEEL_LEVELS);
+    if(due - this->now >= span) {
+        due = this->now + span - 1;
+    }
+
+    Slot s;
+    s.level = 0;
+    while(s.level < WHEEL_LEVELS - 1
+          && due - this->now >= (quint64(1) << (WHEEL_BITS * (s.level + 1)))) {
+        ++s.level;
+    }
+    s.slot = int((due >> (WHEEL_BITS * s.level)) & (WHEEL_SLOTS - 1));
+    s.due = due;
+    this->slots[s.level * WHEEL_SLOTS + s.slot].insert(key);
+    this->index.insert(key, s);
+}
+
+void SafeTimerWheel::cascade(int level)
+{
+    int slot = int((this->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    QSet<QString> keys;
+    keys.swap(this->slots[level * WHEEL_SLOTS + slot]);
+    foreach(QString key, keys) {
+        place(key, this->index.value(key).due);
+    }
+}
+
+void SafeTimerWheel::tick()
+{
+    // a late timer catches up on every tick it missed
+    quint64 target = quint64(this->clock.elapsed() / WHEEL_TICK);
+    while(this->now < target && !this->index.isEmpty()) {
+        ++this->now;
+        for(int level = 1; level < WHEEL_LEVELS; ++level) {
+            if(this->now & ((quint64(1) << (WHEEL_BITS * level)) - 1)) {
+                break;
+            }
+            cascade(level);
+        }
+
+        int slot = int(this->now & (WHEEL_SLOTS - 1));
+        QSet<QString> keys(this->slots[slot]);
+        foreach(QString key, keys) {
+            // handlers may cancel or re-arm keys that are due in this tick
+            if(!this->index.contains(key) || this->index.value(key).level != 0
+                    || this->index.value(key).due > this->now) {
+                continue;
+            }
+            this->index.remove(key);
+            this->slots[slot].remove(key);
+            emit expired(key);
+        }
+    }
+    if(this->index.isEmpty()) {
+        this->timer->stop();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef SAFETIMERWHEEL_H
+#define SAFETIMERWHEEL_H
+
+#include <QObject>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QVector>
+#include <QStringList>
+#include <QElapsedTimer>
+
+#define WHEEL_TICK 100   // ms
+#define WHEEL_BITS 6     // 64 slots per level
+#define WHEEL_LEVELS 4   // 2^24 ticks, about 19 days at 100 ms
+
+// Deadlines for any number of keys on one QTimer. Each level is a ring of
+// slots covering 64 times the span of the one below; a key sits in the
+// level that fits its deadline and moves down as the deadline gets near,
+// so adding, moving and cancelling a key are O(1) and a tick only touches
+// the keys that are due. Deadlines are rounded up to whole ticks.
+class SafeTimerWheel : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SafeTimerWheel(QObject *parent = 0);
+
+    // (re)arms key to expire in delay ms
+    void start(const QString &key, qint64 delay);
+    bool cancel(const QString &key);
+    bool contains(const QString &key) const { return index.contains(key); }
+    int size() const { return index.size(); }
+
+signals:
+    void expired(const QString &key);
+
+private slots:
+    void tick();
+
+private:
+    struct Slot {
+        int level;
+        int slot;
+        quint64 due;
+    };
+
+    QTimer *timer;
+    QElapsedTimer clock;
+    quint64 now;    // ticks
+    QVector<QSet<QString> > slots;
+    QHash<QString, Slot> index;
+
+    void place(const QString &key, quint64 due);
+    void cascade(int level);
+};
+
+#endif // SAFETIMERWHEEL_H
@@ -0,0 +1,377 @@
+#include "safetransferscheduler.h"
+#include <QFile>
+#include <QDateTime>
+#include <QDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+bool SafeTransferScheduler::Key::operator<(const Key &other) const
+{
+    if(this->rank != other.rank) {
+        return this->rank < other.rank;
+    }
+    if(this->size != other.size) {
+        return this->size < other.size;
+    }
+    return this->seq < other.seq;
+}
+
+SafeTransferScheduler::SafeTransferScheduler(QSettings *settings, SafeApiFactory *factory,
+                                             QObject *parent) :
+    QObject(parent),
+    settings(settings),
+    factory(factory),
+    seq(0),
+    unsettled(0),
+    heldOpen(0)
+{
+    this->clock.start();
+    this->timer = new QTimer(this);
+    this->timer->setSingleShot(true);
+    this->timer->setTimerType(Qt::CoarseTimer);
+    connect(this->timer, &QTimer::timeout, this, &SafeTransferScheduler::dispatch);
+    this->wheel = new SafeTimerWheel(this);
+    connect(this->wheel, &SafeTimerWheel::expired, this, &SafeTransferScheduler::expired);
+}
+
+SafeTransferScheduler::~SafeTransferScheduler()
+{
+    this->timer->stop();
+    foreach(QString path, this->active.keys()) {
+        cancel(path);
+    }
+}
+
+void SafeTransferScheduler::enqueue(const QString &path, Kind kind, qint64 size,
+                                    std::function<void()> start, int delay)
+{
+    bool requested = false;
+    if(this->jobs.contains(path)) {
+        requested = this->jobs.value(path).requested;
+        cancel(path);
+    }
+
+    Job job;
+    job.kind = kind;
+    job.size = qMax<qint64>(size, 0);
+    job.start = start;
+    job.since = -1;
+    job.seq = this->seq++;
+    job.requested = requested;
+    if(kind == Upload) {
+        job.fp = SafeFingerprint::fromPath(path);
+    }
+    this->jobs.insert(path, job);
+    wait(path, this->jobs[path], requested ? 0 : delay);
+    schedule();
+}
+
+void SafeTransferScheduler::attach(const QString &path, SafeApi *api, QObject *device)
+{
+    if(!this->active.contains(path)) {
+        // cancelled meanwhile
+        if(api) {
+            this->factory->discard(api);
+        }
+        if(device) {
+            device->deleteLater();
+        }
+        return;
+    }
+    this->jobs[path].api = api;
+    this->jobs[path].device = device;
+}
+
+void SafeTransferScheduler::acquire(const QString &path, SafeApiFactory::Ready ready)
+{
+    if(!this->active.contains(path)) {
+        return;
+    }
+    quint64 seq = this->jobs.value(path).seq;
+    this->jobs[path].acquiring = true;
+    this->factory->acquire([=](SafeApi *api){
+        if(!this->active.contains(path) || this->jobs.value(path).seq != seq) {
+            // cancelled while it waited, the client was never used
+            this->factory->release(api);
+            return;
+        }
+        Job &job = this->jobs[path];
+        job.acquiring = false;
+        job.api = api;
+        ready(api);
+    });
+}
+
+void SafeTransferScheduler::finish(const QString &path)
+{
+    stop(path, true);
+}
+
+void SafeTransferScheduler::stop(const QString &path, bool done)
+{
+    if(!this->active.contains(path)) {
+        return;
+    }
+    this->active.remove(path);
+    Job job(this->jobs.take(path));
+    if(job.api) {
+        // a client is only reusable once its request is over
+        if(done) {
+            this->factory->release(job.api);
+        } else {
+            this->factory->discard(job.api);
+        }
+    }
+    if(job.device) {
+        job.device->deleteLater();
+    }
+    schedule();
+}
+
+bool SafeTransferScheduler::cancel(const QString &path)
+{
+    if(!this->jobs.contains(path)) {
+        return false;
+    }
+    if(this->active.contains(path)) {
+        qDebug() << "Cancelling transfer of" << path;
+        stop(path, false);
+        return true;
+    }
+    unqueue(path, this->jobs.take(path));
+    return true;
+}
+
+void SafeTransferScheduler::prioritize(const QString &path)
+{
+    if(!this->jobs.contains(path) || this->active.contains(path)) {
+        return;
+    }
+    Job job(this->jobs.value(path));
+    unqueue(path, job);
+    job.requested = true;
+    this->jobs.insert(path, job);
+    wait(path, this->jobs[path], 0);
+    schedule();
+}
+
+bool SafeTransferScheduler::isActive(const QString &path) const
+{
+    return this->active.contains(path);
+}
+
+bool SafeTransferScheduler::hasJob(const QString &path, Kind kind) const
+{
+    return this->jobs.contains(path) && this->jobs.value(path).kind == kind;
+}
+
+QStringList SafeTransferScheduler::jobsUnder(const QString &dir, Kind kind) const
+{
+    QString prefix(dir + "/");
+    QStringList paths;
+    for(auto it = this->jobs.constBegin(); it != this->jobs.constEnd(); ++it) {
+        if(it.value().kind == kind && it.key().startsWith(prefix)) {
+            paths.append(it.key());
+        }
+    }
+    return paths;
+}
+
+void SafeTransferScheduler::wait(const QString &path, Job &job, qint64 delay)
+{
+    job.due = this->clock.elapsed() + qMax<qint64>(delay, 0);
+    job.ready = delay <= 0;
+    if(job.ready) {
+        this->ready[laneOf(job.kind)].insert(keyOf(job), path);
+    } else {
+        this->wheel->start(path, delay);
+    }
+}
+
+void SafeTransferScheduler::expired(const QString &path)
+{
+    if(!this->jobs.contains(path)) {
+        return;
+    }
+    Job &job = this->jobs[path];
+    if(job.since < 0) {
+        job.since = job.due;
+    }
+    if(job.kind == Upload && !job.requested && !settled(path, job)) {
+        return;
+    }
+    job.ready = true;
+    this->ready[laneOf(job.kind)].insert(keyOf(job), path);
+    schedule();
+}
+
+bool SafeTransferScheduler::settled(const QString &path, Job &job)
+{
+    SafeFingerprint fp(SafeFingerprint::fromPath(path));
+    if(fp.isNull()) {
+        // gone; the upload itself finds out
+        return true;
+    }
+
+    qint64 settle = settleDelay(fp.size);
+    if(fp.size != job.fp.size || fp.mtime_ns != job.fp.mtime_ns) {
+        // still being written, the missed events are covered here
+        job.fp = fp;
+        job.size = fp.size;
+        ++this->unsettled;
+        wait(path, job, settle);
+        return false;
+    }
+    qint64 quiet = QDateTime::currentMSecsSinceEpoch() - fp.mtime_ns / 1000000;
+    if(quiet >= 0 && quiet < settle) {
+        ++this->unsettled;
+        wait(path, job, settle - quiet);
+        return false;
+    }
+    // a writer may pause longer than any delay, but not forever
+    if(this->clock.elapsed() - job.since < TRANSFER_MAX_HOLD && isOpenForWrite(path)) {
+        ++this->heldOpen;
+        wait(path, job, settle);
+        return false;
+    }
+    return true;
+}
+
+qint64 SafeTransferScheduler::settleDelay(qint64 size)
+{
+    return qMin<qint64>(TRANSFER_SETTLE_DELAY + size * 1000 / TRANSFER_SETTLE_RATE,
+                        TRANSFER_SETTLE_MAX);
+}
+
+bool SafeTransferScheduler::isOpenForWrite(const QString &path)
+{
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(fd < 0) {
+        return false;
+    }
+    // a read lease is refused while anyone has the file open for writing;
+    // files of other users can't be leased and count as closed
+    bool busy = ::fcntl(fd, F_SETLEASE, F_RDLCK) < 0 && errno == EAGAIN;
+    if(!busy) {
+        ::fcntl(fd, F_SETLEASE, F_UNLCK);
+    }
+    ::close(fd);
+    return busy;
+}
+
+void SafeTransferScheduler::dispatch()
+{
+    int total = this->settings->value("transfer_slots", 4).toInt();
+
+    // alternate lanes so neither one takes every global slot
+    bool started = true;
+    while(started && this->active.size() < total) {
+        started = false;
+        for(int lane = 0; lane < Lanes && this->active.size() < total; ++lane) {
+            if(this->ready[lane].isEmpty() || activeIn(Lane(lane)) >= limit(Lane(lane))) {
+                continue;
+            }
+            QString path(this->ready[lane].take(this->ready[lane].firstKey()));
+            run(path, Lane(lane));
+            started = true;
+        }
+    }
+    schedule();
+}
+
+void SafeTransferScheduler::run(const QString &path, Lane lane)
+{
+    Job &job = this->jobs[path];
+    qint64 wait = this->clock.elapsed() - job.due;
+    LaneStats &stats = this->laneStats[lane];
+    ++stats.started;
+    stats.totalWait += wait;
+    stats.maxWait = qMax(stats.maxWait, wait);
+
+    this->active.insert(path, lane);
+    std::function<void()> start(job.start);
+    start();
+
+    // nothing to wait for
+    if(this->active.contains(path) && !this->jobs.value(path).api
+            && !this->jobs.value(path).device && !this->jobs.value(path).acquiring) {
+        finish(path);
+    }
+}
+
+SafeTransferScheduler::Key SafeTransferScheduler::keyOf(const Job &job) const
+{
+    Key key;
+    key.rank = (job.kind == Remove || job.kind == Move) ? 0 : (job.requested ? 1 : 2);
+    key.size = job.size;
+    key.seq = job.seq;
+    return key;
+}
+
+int SafeTransferScheduler::activeIn(Lane lane) const
+{
+    int count = 0;
+    foreach(Lane l, this->active) {
+        if(l == lane) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void SafeTransferScheduler::unqueue(const QString &path, const Job &job)
+{
+    if(job.ready) {
+        this->ready[laneOf(job.kind)].remove(keyOf(job));
+    } else {
+        this->wheel->cancel(path);
+    }
+}
+
+void SafeTransferScheduler::schedule()
+{
+    // ready jobs without a slot are picked up again by finish()
+    bool runnable = false;
+    if(this->active.size() < this->settings->value("transfer_slots", 4).toInt()) {
+        for(int lane = 0; lane < Lanes; ++lane) {
+            runnable |= !this->ready[lane].isEmpty() && activeIn(Lane(lane)) < limit(Lane(lane));
+        }
+    }
+
+    // waiting jobs come back through the wheel
+    if(!runnable) {
+        this->timer->stop();
+    } else if(!this->timer->isActive()) {
+        this->timer->start(0);
+    }
+}
+
+int SafeTransferScheduler::limit(Lane lane) const
+{
+    if(lane == DownloadLane) {
+        return this->settings->value("download_slots", 3).toInt();
+    }
+    return this->settings->value("upload_slots", 3).toInt();
+}
+
+QJsonObject SafeTransferScheduler::stats() const
+{
+    const char *names[Lanes] = { "upload", "download" };
+    QJsonObject values;
+    values.insert("active", this->active.size());
+    values.insert("waiting", this->wheel->size());
+    values.insert("unsettled", (qint64)this->unsettled);
+    values.insert("held_open", (qint64)this->heldOpen);
+    for(int lane = 0; lane < Lanes; ++lane) {
+        const LaneStats &s = this->laneStats[lane];
+        QJsonObject l;
+        l.insert("queued", this->ready[lane].size());
+        l.insert("active", activeIn(Lane(lane)));
+        l.insert("started", (qint64)s.started);
+        l.insert("avg_wait_ms", s.started ? (qint64)(s.totalWait / s.started) : 0);
+        l.insert("max_wait_ms", s.maxWait);
+        values.insert(names[lane], l);
+    }
+    return values;
+}
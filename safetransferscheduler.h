@@ -0,0 +1,128 @@
+#ifndef SAFETRANSFERSCHEDULER_H
+#define SAFETRANSFERSCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <QHash>
+#include <QMap>
+#include <QStringList>
+#include <QSettings>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <functional>
+#include <lib2safe/safeapi.h>
+#include "safeapifactory.h"
+#include "safetimerwheel.h"
+#include "safefingerprint.h"
+
+#define TRANSFER_SETTLE_DELAY 2000              // ms a path must stay quiet before it is sent
+#define TRANSFER_SETTLE_RATE (64 * 1024 * 1024) // bytes of file per extra second of quiet
+#define TRANSFER_SETTLE_MAX 30000
+#define TRANSFER_MAX_HOLD (10 * 60 * 1000)      // an upload still open after this goes anyway
+
+// Queue for every remote transfer of the daemon. Jobs are keyed by path: a
+// new job for a path replaces the queued one and cancels the running one.
+//
+// Uploads, removals and moves share the upload lane, downloads have their
+// own. "transfer_slots" caps the jobs running at once, "upload_slots" and
+// "download_slots" cap each lane. Within a lane removals and moves go first, then
+// paths a client asked for, then the smallest files.
+//
+// An upload only starts once its file has settled: size and mtime have not
+// changed for a delay that grows with the size, and nobody holds it open
+// for writing. A file that keeps growing is thus sent once, when it is done.
+class SafeTransferScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    enum Kind { Remove, Upload, Download, Move };
+
+    explicit SafeTransferScheduler(QSettings *settings, SafeApiFactory *factory,
+                                   QObject *parent = 0);
+    ~SafeTransferScheduler();
+
+    // start() runs once a slot is free and has to hand its SafeApi (and the
+    // device it reads or writes, if any) to attach(), or take one through
+    // acquire(); a job that did neither is done when start() returns
+    void enqueue(const QString &path, Kind kind, qint64 size,
+                 std::function<void()> start, int delay = TRANSFER_SETTLE_DELAY);
+    void attach(const QString &path, SafeApi *api, QObject *device = 0);
+    // a pooled client for the running job at path, attached before ready
+    // gets it; nothing is called if the job is cancelled meanwhile
+    void acquire(const QString &path, SafeApiFactory::Ready ready);
+    void finish(const QString &path);
+    bool cancel(const QString &path);
+    void prioritize(const QString &path);
+
+    bool isActive(const QString &path) const;
+    // a job of that kind is queued or running for path
+    bool hasJob(const QString &path, Kind kind) const;
+    // paths of the jobs of that kind somewhere below the directory dir
+    QStringList jobsUnder(const QString &dir, Kind kind) const;
+    int activeCount() const { return active.size(); }
+    int queuedCount() const { return jobs.size() - active.size(); }
+    QJsonObject stats() const;
+
+private slots:
+    void dispatch();
+    void expired(const QString &path);
+
+private:
+    enum Lane { UploadLane, DownloadLane, Lanes };
+
+    struct Key {
+        int rank;
+        qint64 size;
+        quint64 seq;
+        bool operator<(const Key &other) const;
+    };
+    struct Job {
+        Kind kind;
+        qint64 size;
+        std::function<void()> start;
+        qint64 due;      // ms on the scheduler clock
+        qint64 since;    // when it first became due
+        quint64 seq;
+        SafeFingerprint fp;
+        bool requested = false;
+        bool ready = false;
+        bool acquiring = false;
+        SafeApi *api = 0;
+        QObject *device = 0;
+    };
+    struct LaneStats {
+        quint64 started = 0;
+        qint64 totalWait = 0;
+        qint64 maxWait = 0;
+    };
+
+    QSettings *settings;
+    SafeApiFactory *factory;
+    QTimer *timer;
+    SafeTimerWheel *wheel;
+    QElapsedTimer clock;
+    quint64 seq;
+    quint64 unsettled;
+    quint64 heldOpen;
+
+    QHash<QString, Job> jobs;
+    QMap<Key, QString> ready[Lanes];
+    QHash<QString, Lane> active;
+    LaneStats laneStats[Lanes];
+
+    static Lane laneOf(Kind kind) { return kind == Download ? DownloadLane : UploadLane; }
+    Key keyOf(const Job &job) const;
+    int activeIn(Lane lane) const;
+    int limit(Lane lane) const;
+    void unqueue(const QString &path, const Job &job);
+    void stop(const QString &path, bool done);
+    void run(const QString &path, Lane lane);
+    void schedule();
+    void wait(const QString &path, Job &job, qint64 delay);
+    bool settled(const QString &path, Job &job);
+
+    static qint64 settleDelay(qint64 size);
+    static bool isOpenForWrite(const QString &path);
+};
+
+#endif // SAFETRANSFERSCHEDULER_H
@@ -0,0 +1,163 @@
+#include "safeuploadsource.h"
+
+SafeUploadSource::SafeUploadSource(const QString &path, QObject *parent) :
+    QIODevice(parent),
+    file(path),
+    md5(QCryptographicHash::Md5),
+    chunker(0),
+    hashed(0),
+    complete(false),
+    modified(false),
+    limiter(0),
+    throttled(false)
+{
+}
+
+SafeUploadSource::~SafeUploadSource()
+{
+    delete this->chunker;
+}
+
+bool SafeUploadSource::open(OpenMode mode)
+{
+    if(mode != QIODevice::ReadOnly) {
+        return false;
+    }
+
+    this->fp = SafeFingerprint::fromPath(this->file.fileName());
+    if(this->fp.isNull() || !this->file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    this->md5.reset();
+    this->xxh.reset();
+    resetChunker();
+    this->hashed = 0;
+    this->complete = false;
+    this->modified = false;
+    if(this->fp.size == 0) {
+        finish();
+    }
+    // no extra buffering on top of the network stack
+    return QIODevice::open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+void SafeUploadSource::close()
+{
+    this->file.close();
+    QIODevice::close();
+}
+
+bool SafeUploadSource::seek(qint64 pos)
+{
+    if(!QIODevice::seek(pos) || !this->file.seek(pos)) {
+        return false;
+    }
+    // the body is being resent from the start (redirect, retry)
+    if(pos == 0) {
+        this->md5.reset();
+        this->xxh.reset();
+        resetChunker();
+        this->hashed = 0;
+        this->complete = (this->fp.size == 0);
+    }
+    return true;
+}
+
+qint64 SafeUploadSource::size() const
+{
+    return this->fp.size;
+}
+
+bool SafeUploadSource::atEnd() const
+{
+    return pos() >= this->fp.size;
+}
+
+QString SafeUploadSource::hash() const
+{
+    if(!this->complete || this->modified) {
+        return QString();
+    }
+    return this->md5.result().toHex();
+}
+
+QString SafeUploadSource::fastHash() const
+{
+    if(!this->complete || this->modified) {
+        return QString();
+    }
+    return this->xxh.result().toHex();
+}
+
+void SafeUploadSource::setRateLimiter(SafeRateLimiter *limiter)
+{
+    this->limiter = limiter;
+    connect(limiter, &SafeRateLimiter::refilled, this, [this](){
+        if(this->throttled) {
+            this->throttled = false;
+            emit readyRead();
+        }
+    });
+}
+
+qint64 SafeUploadSource::readData(char *data, qint64 maxlen)
+{
+    qint64 offset = this->file.pos();
+    qint64 wanted = qMin(maxlen, this->fp.size - offset);
+    if(this->limiter && wanted > 0) {
+        wanted = this->limiter->take(wanted);
+        if(wanted == 0) {
+            this->throttled = true;
+            return 0;
+        }
+    }
+    qint64 len = this->file.read(data, wanted);
+    if(len <= 0 && offset < this->fp.size) {
+        // truncated under our feet
+        this->modified = true;
+        return -1;
+    }
+    if(len > 0 && offset == this->hashed) {
+        this->md5.addData(data, len);
+        this->xxh.addData(data, len);
+        if(this->chunker) {
+            this->chunker->addData(data, len);
+        }
+        this->hashed += len;
+        if(this->hashed == this->fp.size) {
+            finish();
+        }
+    }
+    return len;
+}
+
+qint64 SafeUploadSource::writeData(const char *data, qint64 len)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(len);
+    return -1;
+}
+
+void SafeUploadSource::resetChunker()
+{
+    delete this->chunker;
+    this->chunker = 0;
+    this->manifest.clear();
+    if(this->fp.size >= CHUNK_THRESHOLD) {
+        this->chunker = new SafeChunker();
+    }
+}
+
+void SafeUploadSource::finish()
+{
+    this->complete = true;
+    if(this->chunker) {
+        this->manifest = this->chunker->result();
+    }
+    // a writer touched the file while we were reading it
+    SafeFingerprint now(SafeFingerprint::fromPath(this->file.fileName()));
+    if(now.size != this->fp.size || now.mtime_ns != this->fp.mtime_ns) {
+        this->modified = true;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef SAFEUPLOADSOURCE_H
+#define SAFEUPLOADSOURCE_H
+
+#include <QIODevice>
+#include <QFile>
+#include <QCryptographicHash>
+#include "safecommon.h"
+#include "safefingerprint.h"
+#include "safefasthash.h"
+#include "safechunker.h"
+#include "saferatelimiter.h"
+
+// Upload body that hashes the file while it is being sent, so each upload
+// reads the file from disk exactly once.
+class SafeUploadSource : public QIODevice
+{
+    Q_OBJECT
+public:
+    explicit SafeUploadSource(const QString &path, QObject *parent = 0);
+    ~SafeUploadSource();
+
+    bool open(OpenMode mode);
+    void close();
+    bool seek(qint64 pos);
+    qint64 size() const;
+    bool atEnd() const;
+
+    // valid once every byte was read in order and the file was left untouched
+    QString hash() const;
+    QString fastHash() const;
+    // chunk manifest, built on the way for files above CHUNK_THRESHOLD
+    QList<SafeChunk> chunks() const { return manifest; }
+    bool isModified() const { return modified; }
+    SafeFingerprint fingerprint() const { return fp; }
+    // reads return 0 while the limiter has no tokens, readyRead() follows
+    void setRateLimiter(SafeRateLimiter *limiter);
+
+protected:
+    qint64 readData(char *data, qint64 maxlen);
+    qint64 writeData(const char *data, qint64 len);
+
+private:
+    QFile file;
+    QCryptographicHash md5;
+    SafeFastHash xxh;
+    SafeChunker *chunker;
+    QList<SafeChunk> manifest;
+    SafeFingerprint fp;
+    qint64 hashed;
+    bool complete;
+    bool modified;
+    SafeRateLimiter *limiter;
+    bool throttled;
+
+    void resetChunker();
+    void finish();
+};
+
+#endif // SAFEUPLOADSOURCE_H
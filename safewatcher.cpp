@@ -2,6 +2,7 @@
 
 SafeWatcher::SafeWatcher(ulong timestamp, SafeApiFactory *fc, QObject *parent) :
     QObject(parent),
+    api(0),
     fc(fc),
     timestamp(timestamp)
 {
@@ -10,13 +11,19 @@ SafeWatcher::SafeWatcher(ulong timestamp, SafeApiFactory *fc, QObject *parent) :
     //this->ticker->setSingleShot(true);
     this->ticker->setTimerType(Qt::VeryCoarseTimer);
 
-    this->api = this->fc->newApi();
-    connect(this->api, &SafeApi::getEventsComplete, this, &SafeWatcher::eventsFetched);
-    connect(this->api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
-        qWarning() << "Error fetching events:" << text << "(" << code << ")";
+    // kept for as long as the watcher lives
+    this->fc->acquire([this](SafeApi *api){
+        this->api = api;
+        connect(this->api, &SafeApi::getEventsComplete, this, &SafeWatcher::eventsFetched);
+        connect(this->api, &SafeApi::errorRaised, [&](ulong id, quint16 code, QString text){
+            qWarning() << "Error fetching events:" << text << "(" << code << ")";
+        });
     });
     connect(ticker, &QTimer::timeout, [&](){
-        this->api->getEvents(this->timestamp);
+        // the first polls may come before the pool had a client to spare
+        if(this->api) {
+            this->api->getEvents(this->timestamp);
+        }
     });
 }
 
@@ -0,0 +1,14 @@
+QT       += core testlib
+QT       -= gui
+
+TARGET = tst_eventloop
+CONFIG   += console testcase
+CONFIG   += c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+# the daemon's sources are read, not built
+DEFINES += SRCDIR=\\\"$$PWD/../..\\\"
+
+SOURCES += tst_eventloop.cpp
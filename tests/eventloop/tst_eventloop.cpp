@@ -0,0 +1,55 @@
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+
+// The daemon runs on a single event loop. A nested one (QEventLoop,
+// processEvents()) lets other events run in the middle of a handler and holds
+// everything else back until its reply is in, so nothing but main() may
+// spin one.
+class TestEventLoop : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void noNestedLoops_data();
+    void noNestedLoops();
+};
+
+void TestEventLoop::noNestedLoops_data()
+{
+    QTest::addColumn<QString>("path");
+
+    QDir dir(SRCDIR);
+    QStringList sources(dir.entryList(QStringList() << "*.cpp", QDir::Files, QDir::Name));
+    sources.removeAll("main.cpp");
+    // the ones that used to wait for replies in a loop of their own
+    foreach(QString name, QStringList() << "safedaemon.cpp" << "safeapifactory.cpp"
+                                        << "fswatcher.cpp") {
+        QVERIFY2(sources.contains(name), qPrintable(name + " not found in " + dir.path()));
+    }
+    foreach(QString name, sources) {
+        QTest::newRow(qPrintable(name)) << dir.filePath(name);
+    }
+}
+
+void TestEventLoop::noNestedLoops()
+{
+    QFETCH(QString, path);
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadOnly | QIODevice::Text));
+
+    QRegularExpression nested("\\bQEventLoop\\b|\\bprocessEvents\\s*\\(");
+    int number = 0;
+    while(!file.atEnd()) {
+        QString line(QString::fromUtf8(file.readLine()));
+        ++number;
+        // comments may name what is not done
+        line = line.left(line.indexOf("//"));
+        QVERIFY2(!nested.match(line).hasMatch(),
+                 qPrintable(QString("%1:%2: %3").arg(path).arg(number).arg(line.trimmed())));
+    }
+}
+
+QTEST_GUILESS_MAIN(TestEventLoop)
+#include "tst_eventloop.moc"
@@ -0,0 +1,17 @@
+QT       += core network testlib
+QT       -= gui
+
+TARGET = tst_safepeerservice
+CONFIG   += console testcase
+CONFIG   += c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../..
+
+SOURCES += tst_safepeerservice.cpp \
+    ../../safepeerservice.cpp
+
+HEADERS += \
+    ../../safepeerservice.h
@@ -0,0 +1,163 @@
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QTcpServer>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include "safepeerservice.h"
+
+// Two services on loopback, as two daemons of one account on one host
+// would run them: distinct "peer_port", the same key, each listed in the
+// other's "peers".
+class TestSafePeerService : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void fetchesFromPeer();
+    void refusesOtherKey();
+    void missingContent();
+
+private:
+    struct Attempt {
+        bool done = false;
+        bool ok = false;
+    };
+
+    QTemporaryDir dir;
+    QByteArray content;
+    QString hash;
+    QString path;
+
+    quint16 freePort();
+    QSettings *settingsFor(const QString &name, quint16 port, quint16 other);
+    SafePeerService *serviceWith(const QByteArray &key, QSettings *settings);
+    void fetch(SafePeerService *service, const QString &hash, qint64 size, QBuffer *buffer,
+               Attempt *attempt);
+};
+
+void TestSafePeerService::initTestCase()
+{
+    if(!QSslSocket::supportsSsl()) {
+        QSKIP("No TLS support, peers exchange nothing");
+    }
+    QVERIFY(this->dir.isValid());
+
+    // a few blocks, so the transfer spans several writes
+    this->content.resize(1024 * 1024 + 123);
+    for(int i = 0; i < this->content.size(); ++i) {
+        this->content[i] = char((i * 131) ^ (i >> 7));
+    }
+    this->hash = QCryptographicHash::hash(this->content, QCryptographicHash::Md5).toHex();
+    this->path = this->dir.filePath("content");
+    QFile file(this->path);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(this->content), qint64(this->content.size()));
+}
+
+quint16 TestSafePeerService::freePort()
+{
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost, 0);
+    return server.serverPort();
+}
+
+QSettings *TestSafePeerService::settingsFor(const QString &name, quint16 port, quint16 other)
+{
+    QSettings *settings = new QSettings(this->dir.filePath(name + ".ini"),
+                                        QSettings::IniFormat, this);
+    settings->setValue("peer_port", port);
+    // announcements stay off the default port of real daemons
+    settings->setValue("peer_discovery_port", port + 1);
+    settings->setValue("peers", QString("127.0.0.1:%1").arg(other));
+    return settings;
+}
+
+SafePeerService *TestSafePeerService::serviceWith(const QByteArray &key, QSettings *settings)
+{
+    return new SafePeerService(key, settings, [this](const QString &hash, qint64 size){
+        return hash == this->hash && (size < 0 || size == this->content.size())
+                ? this->path : QString();
+    }, this);
+}
+
+void TestSafePeerService::fetch(SafePeerService *service, const QString &hash, qint64 size,
+                                QBuffer *buffer, Attempt *attempt)
+{
+    buffer->open(QIODevice::WriteOnly);
+    service->fetch(hash, size, buffer, [attempt](bool ok){
+        attempt->done = true;
+        attempt->ok = ok;
+    });
+}
+
+void TestSafePeerService::fetchesFromPeer()
+{
+    QByteArray key(SafePeerService::newKey());
+    QCOMPARE(key.size(), PEER_KEY_SIZE);
+    quint16 portA = freePort();
+    quint16 portB = freePort();
+    SafePeerService *a = serviceWith(key, settingsFor("a", portA, portB));
+    SafePeerService *b = serviceWith(key, settingsFor("b", portB, portA));
+    QVERIFY(a->stats().value("listening").toBool());
+    QVERIFY(b->stats().value("listening").toBool());
+    QVERIFY(a->hasPeers());
+
+    QBuffer buffer;
+    Attempt attempt;
+    fetch(a, this->hash, this->content.size(), &buffer, &attempt);
+    QTRY_VERIFY_WITH_TIMEOUT(attempt.done, PEER_TIMEOUT + 5000);
+    QVERIFY(attempt.ok);
+    QCOMPARE(QCryptographicHash::hash(buffer.data(), QCryptographicHash::Md5).toHex(),
+             this->hash.toLatin1());
+
+    // both ends count what went over the wire
+    qint64 size = this->content.size();
+    QCOMPARE(qint64(a->stats().value("fetched_files").toDouble()), qint64(1));
+    QCOMPARE(qint64(a->stats().value("fetched_bytes").toDouble()), size);
+    QCOMPARE(qint64(b->stats().value("served_files").toDouble()), qint64(1));
+    QCOMPARE(qint64(b->stats().value("served_bytes").toDouble()), size);
+    QCOMPARE(qint64(a->stats().value("failed").toDouble()), qint64(0));
+    delete a;
+    delete b;
+}
+
+void TestSafePeerService::refusesOtherKey()
+{
+    quint16 portA = freePort();
+    quint16 portB = freePort();
+    SafePeerService *a = serviceWith(SafePeerService::newKey(), settingsFor("c", portA, portB));
+    SafePeerService *b = serviceWith(SafePeerService::newKey(), settingsFor("d", portB, portA));
+
+    QBuffer buffer;
+    Attempt attempt;
+    fetch(a, this->hash, this->content.size(), &buffer, &attempt);
+    QTRY_VERIFY_WITH_TIMEOUT(attempt.done, PEER_TIMEOUT + 5000);
+    QVERIFY(!attempt.ok);
+    QVERIFY(buffer.data().isEmpty());
+    QCOMPARE(b->stats().value("served_bytes").toDouble(), 0.0);
+    delete a;
+    delete b;
+}
+
+void TestSafePeerService::missingContent()
+{
+    QByteArray key(SafePeerService::newKey());
+    quint16 portA = freePort();
+    quint16 portB = freePort();
+    SafePeerService *a = serviceWith(key, settingsFor("e", portA, portB));
+    SafePeerService *b = serviceWith(key, settingsFor("f", portB, portA));
+
+    QBuffer buffer;
+    QString other(QCryptographicHash::hash("other", QCryptographicHash::Md5).toHex());
+    Attempt attempt;
+    fetch(a, other, 5, &buffer, &attempt);
+    QTRY_VERIFY_WITH_TIMEOUT(attempt.done, PEER_TIMEOUT + 5000);
+    QVERIFY(!attempt.ok);
+    QCOMPARE(b->stats().value("served_files").toDouble(), 0.0);
+    delete a;
+    delete b;
+}
+
+QTEST_GUILESS_MAIN(TestSafePeerService)
+#include "tst_safepeerservice.moc"
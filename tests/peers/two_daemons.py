@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Two daemons of one account on one host, sharing content over loopback.
+
+Each daemon gets a HOME of its own, a distinct "peer_port" and the same
+"peer_key", with the other listed in "peers". A file is put into the first
+daemon's root; once the second one downloaded it, its "peers" event has to
+show the bytes it fetched from the first one instead of the server.
+
+    TWOSAFE_LOGIN=... TWOSAFE_PASSWORD=... ./two_daemons.py path/to/2safe-daemon
+
+Needs a test account; skips (exit 77) without one.
+"""
+
+import json
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+SKIP = 77
+TIMEOUT = 300
+
+
+def configure(home, port, other, key):
+    config = os.path.join(home, ".config", "ROSA")
+    os.makedirs(config)
+    with open(os.path.join(config, "2Safe.conf"), "w") as conf:
+        conf.write("[General]\n")
+        conf.write("login=%s\n" % os.environ["TWOSAFE_LOGIN"])
+        conf.write("password=%s\n" % os.environ["TWOSAFE_PASSWORD"])
+        conf.write("root_name=2safe\n")
+        conf.write("peer_sync=true\n")
+        conf.write("peer_key=%s\n" % key)
+        conf.write("peer_port=%d\n" % port)
+        conf.write("peer_discovery_port=%d\n" % (port + 1))
+        conf.write("peers=127.0.0.1:%d\n" % other)
+    os.makedirs(os.path.join(home, "2safe"))
+
+
+def start(daemon, home):
+    env = dict(os.environ, HOME=home)
+    log = open(os.path.join(home, "daemon.log"), "w")
+    return subprocess.Popen([daemon], env=env, stdout=log, stderr=subprocess.STDOUT)
+
+
+def events(home):
+    """The events of one noop round trip, by category."""
+    path = os.path.join(home, ".2safe", "control.sock")
+    client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        client.connect(path)
+        client.sendall(json.dumps({"type": "noop"}).encode())
+        reply = b""
+        while True:
+            data = client.recv(65536)
+            if not data:
+                break
+            reply += data
+    except OSError:
+        return {}
+    finally:
+        client.close()
+    message = json.loads(reply.decode() or "{}")
+    return dict((m.get("category"), m.get("values", {}))
+                for m in message.get("messages", []))
+
+
+def wait(what, check):
+    deadline = time.time() + TIMEOUT
+    while time.time() < deadline:
+        result = check()
+        if result:
+            return result
+        time.sleep(2)
+    sys.exit("Timed out waiting for %s" % what)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: two_daemons.py path/to/2safe-daemon")
+    if not os.environ.get("TWOSAFE_LOGIN") or not os.environ.get("TWOSAFE_PASSWORD"):
+        print("TWOSAFE_LOGIN and TWOSAFE_PASSWORD not set, skipping")
+        return SKIP
+    daemon = os.path.abspath(sys.argv[1])
+
+    base = tempfile.mkdtemp(prefix="2safe-peers-")
+    homes = [os.path.join(base, "a"), os.path.join(base, "b")]
+    ports = [47717, 47727]
+    key = os.urandom(32).hex()
+    for home, port, other in zip(homes, ports, reversed(ports)):
+        os.makedirs(home)
+        configure(home, port, other, key)
+
+    processes = []
+    try:
+        processes.append(start(daemon, homes[0]))
+        # unique content, so nothing on the server or in a trash has it
+        name = "peer-test-%d.bin" % os.getpid()
+        content = os.urandom(4 * 1024 * 1024)
+        wait("the first daemon to log in",
+             lambda: events(homes[0]).get("auth", {}).get("authorized"))
+        with open(os.path.join(homes[0], "2safe", name), "wb") as f:
+            f.write(content)
+
+        # the second one learns about the file from the server, either in its
+        # first index or as an event once the upload is through
+        processes.append(start(daemon, homes[1]))
+        target = os.path.join(homes[1], "2safe", name)
+        wait("the download", lambda: os.path.exists(target)
+             and os.path.getsize(target) == len(content))
+        with open(target, "rb") as f:
+            if f.read() != content:
+                sys.exit("Downloaded content differs")
+
+        fetched = events(homes[1]).get("peers", {})
+        served = events(homes[0]).get("peers", {})
+        print("fetching daemon:", json.dumps(fetched))
+        print("serving daemon:", json.dumps(served))
+        if fetched.get("wan_bytes_saved", 0) < len(content):
+            sys.exit("The file did not come from the peer")
+        if fetched.get("fetched_files", 0) < 1 or served.get("served_bytes", 0) < len(content):
+            sys.exit("Peer statistics don't match the transfer")
+        print("OK")
+
+        # the test file goes again
+        os.remove(os.path.join(homes[0], "2safe", name))
+        time.sleep(10)
+        return 0
+    finally:
+        for process in processes:
+            process.terminate()
+            process.wait()
+        shutil.rmtree(base, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,7 @@
+# Tests of the parts of the daemon that don't need lib2safe:
+#   qmake tests.pro && make && make check
+# peers/two_daemons.py runs two built daemons against a test account.
+TEMPLATE = subdirs
+
+SUBDIRS += peers \
+    eventloop